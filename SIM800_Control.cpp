@@ -11,237 +11,1580 @@
 
 #include "SIM800_Control.h"
 
+//Standard rates tried by begin(), slowest first
+const long PROGMEM BAUD_RATES[] = {9600, 19200, 38400, 57600, 115200};
+#define BAUD_RATE_COUNT (sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0]))
+
+//Garbled lines within a minute (at one rate) before dropping to the next slowest
+#define BAUD_FALLBACK_ERRORS 5
+#define BAUD_FALLBACK_WINDOW_MS 60000UL
+
+//Clean running after a fallback before the faster rate is tried again
+#define BAUD_STEP_UP_QUIET_MS 3600000UL
+
+//A reboot announces "Call Ready" then "SMS Ready"; any READY this soon after
+//the first is the same boot.  Resuming waits for "SMS Ready", or this long
+#define REBOOT_READY_WINDOW_MS 10000UL
+#define REBOOT_RESUME_WAIT_MS 5000UL
+
+//Start-up sequence, one command per step.  initialise(), resume_after_reboot()
+//and enable_features() run it blocking; refresh_slice() one step at a time
+#define INIT_HANDSHAKE 0x01      //Only sent by refresh_slice() (the others retry AT themselves)
+#define INIT_FULL      0x02      //Only on a full start-up, and not when the saved profile matched
+#define INIT_PROFILE   0x04      //The saved profile check (fast_boot only; the command is built)
+#define INIT_SAVED     0x08      //Kept by AT&W, so skipped when the saved profile matched (AT+CUSD isn't)
+#define INIT_SIM       0x10      //Failing means there's no SIM
+#define INIT_SAVE      0x20      //Only with fast_boot
+#define INIT_RADIO     0x40      //Not in lazy mode
+#define INIT_OPTIONAL  0x80      //Failing is logged, but doesn't stop the start-up
+
+const char INIT_CMD_AT[] PROGMEM = "AT";
+const char INIT_CMD_FACTORY[] PROGMEM = "AT&F";
+const char INIT_CMD_ECHO_OFF[] PROGMEM = "ATE 0";
+const char INIT_CMD_CCID[] PROGMEM = "AT+CCID";
+#if SIM800_ENABLE_SMS
+const char INIT_CMD_SMS_TEXT[] PROGMEM = "AT+CMGF=1";
+#endif
+#if SIM800_ENABLE_VOICE
+const char INIT_CMD_CLIP[] PROGMEM = "AT+CLIP=1";
+const char INIT_CMD_CLCC[] PROGMEM = "AT+CLCC=1";
+#endif
+#if SIM800_ENABLE_USSD
+const char INIT_CMD_CUSD[] PROGMEM = "AT+CUSD=1";
+#endif
+const char INIT_CMD_FLOW[] PROGMEM = "AT+IFC=2,2";
+const char INIT_CMD_SAVE[] PROGMEM = "AT&W";
+const char INIT_CMD_RADIO_OFF[] PROGMEM = "AT+CFUN=4";
+const char INIT_CMD_RADIO_ON[] PROGMEM = "AT+CFUN=1";
+
+struct Sim800_Init_Step
+{
+  PGM_P command;
+  byte feature;
+  byte flags;
+  byte timeout_secs;
+  byte settle_secs;                      //Waited (handling URCs) before it's sent
+};
+
+const Sim800_Init_Step PROGMEM INIT_STEPS[] = 
+{
+  {INIT_CMD_AT,        0,                           INIT_HANDSHAKE,                          2 * SECONDS, 0},
+  {NULL,               0,                           INIT_PROFILE,                            2 * SECONDS, 0},
+  {INIT_CMD_FACTORY,   0,                           INIT_FULL,                               2 * SECONDS, 0},
+  {INIT_CMD_ECHO_OFF,  0,                           INIT_SAVED,                              2 * SECONDS, 0},
+  {INIT_CMD_CCID,      0,                           INIT_SAVED | INIT_SIM,                   2 * SECONDS, 0},
+#if SIM800_ENABLE_SMS
+  {INIT_CMD_SMS_TEXT,  SIM800_FEATURE_SMS,          INIT_SAVED,                              2 * SECONDS, 0},
+#endif
+#if SIM800_ENABLE_VOICE
+  {INIT_CMD_CLIP,      SIM800_FEATURE_VOICE,        INIT_SAVED,                             15 * SECONDS, 0},
+  {INIT_CMD_CLCC,      SIM800_FEATURE_CALL_STATE,   0,                                       2 * SECONDS, 0},
+#endif
+#if SIM800_ENABLE_USSD
+  {INIT_CMD_CUSD,      SIM800_FEATURE_USSD,         0,                                       2 * SECONDS, 0},
+#endif
+  {INIT_CMD_FLOW,      SIM800_FEATURE_FLOW_CONTROL, INIT_SAVED,                              2 * SECONDS, 0},
+  {INIT_CMD_SAVE,      0,                           INIT_FULL | INIT_SAVE | INIT_OPTIONAL,   5 * SECONDS, 0},
+  {INIT_CMD_RADIO_OFF, 0,                           INIT_FULL | INIT_RADIO | INIT_OPTIONAL, 15 * SECONDS, 5 * SECONDS},
+  {INIT_CMD_RADIO_ON,  0,                           INIT_FULL | INIT_RADIO | INIT_OPTIONAL, 15 * SECONDS, 5 * SECONDS}
+};
+#define INIT_STEP_COUNT (sizeof(INIT_STEPS) / sizeof(INIT_STEPS[0]))
+
+static_assert (INIT_STEP_COUNT <= 16, "The saved profile check keeps one bit per start-up step");
+
+static_assert (SIM800_CAPTURE_SIZE >= 256, "SIM800_CAPTURE_SIZE must hold at least two full records");
+
+const char HEX_DIGITS[] PROGMEM = "0123456789ABCDEF";
+
+const unsigned int LATENCY_LIMITS_MS[SIM800_LATENCY_BUCKETS - 1] PROGMEM = {50, 100, 250, 500, 1000, 2500, 5000};
+
+static_assert ((RX_BUFFER_SIZE >= 64) && (RX_BUFFER_SIZE <= 255), "RX_BUFFER_SIZE must be 64..255");
+static_assert (MAX_CALLER_ID_SIZE >= 10, "MAX_CALLER_ID_SIZE must hold \"UNKNOWN\"");
+
+//put_balance_in_sms_buffer() leaves the reply where it lands, in ::sms_buffer
+#if SIM800_ENABLE_SMS && SIM800_ENABLE_USSD
+static_assert (SIM800_USSD_BUFFER_SIZE <= TX_BUFFER_SIZE, "SIM800_USSD_BUFFER_SIZE must fit in TX_BUFFER_SIZE");
+#endif
+
+static_assert ((SIM800_EVENT_QUEUE_SIZE & (SIM800_EVENT_QUEUE_SIZE - 1)) == 0, "SIM800_EVENT_QUEUE_SIZE must be a power of two");
+static_assert (SIM800_EVENT_QUEUE_SIZE <= 128, "SIM800_EVENT_QUEUE_SIZE must fit the byte indices");
+
+//================================================================================================
+Sim800_Event_Queue::Sim800_Event_Queue()
+{
+  head = 0;
+  tail = 0;
+  overflow_count = 0;
+}
+
+//================================================================================================
+bool Sim800_Event_Queue::push (byte type, const char *data)
+{
+  //Producer side: only ever called from the library
+  byte current_head = head;
+  byte current_tail = __atomic_load_n (&tail, __ATOMIC_ACQUIRE);
+
+  if ((byte)(current_head - current_tail) >= SIM800_EVENT_QUEUE_SIZE)
+  {
+    overflow_count++;
+    return false;
+  }
+
+  Sim800_Event *event = &events[current_head & (SIM800_EVENT_QUEUE_SIZE - 1)];
+  event->type = type;
+  memset (&event->data, 0, sizeof(char) * MAX_CALLER_ID_SIZE);
+  if (data != NULL) strncpy (event->data, data, MAX_CALLER_ID_SIZE - 1);
+
+  //Publish the entry only once it's complete
+  __atomic_store_n (&head, (byte)(current_head + 1), __ATOMIC_RELEASE);
+  return true;
+}
+
+//================================================================================================
+bool Sim800_Event_Queue::pop (Sim800_Event *event)
+{
+  //Consumer side: only ever called from the application
+  byte current_tail = tail;
+  byte current_head = __atomic_load_n (&head, __ATOMIC_ACQUIRE);
+
+  if (current_head == current_tail) return false;
+
+  memcpy (event, &events[current_tail & (SIM800_EVENT_QUEUE_SIZE - 1)], sizeof(Sim800_Event));
+
+  //Hand the slot back to the producer
+  __atomic_store_n (&tail, (byte)(current_tail + 1), __ATOMIC_RELEASE);
+  return true;
+}
+
+//================================================================================================
+byte Sim800_Event_Queue::count (void)
+{
+  return (byte)(__atomic_load_n (&head, __ATOMIC_ACQUIRE) - __atomic_load_n (&tail, __ATOMIC_ACQUIRE));
+}
+
+//================================================================================================
+Sim800_Capture::Sim800_Capture()
+{
+  clear();
+}
+
+//================================================================================================
+void Sim800_Capture::clear (void)
+{
+  head = 0;
+  tail = 0;
+  used = 0;
+  open_record = SIM800_CAPTURE_SIZE;
+  start_time = 0;
+  record_time = 0;
+  byte_time = 0;
+  dropped_records = 0;
+}
+
+//================================================================================================
+void Sim800_Capture::put (byte value)
+{
+  ring[head] = value;
+  head = (head + 1) % SIM800_CAPTURE_SIZE;
+  used++;
+}
+
+//================================================================================================
+void Sim800_Capture::drop_oldest (void)
+{
+  unsigned int record_size = 3 + (peek(0) & 0x7F);
+
+  if (tail == open_record) open_record = SIM800_CAPTURE_SIZE;
+
+  tail = (tail + record_size) % SIM800_CAPTURE_SIZE;
+  used -= record_size;
+  dropped_records++;
+
+  //Carry the start time forward to the new oldest record
+  if (used > 0) start_time += peek(1) | ((unsigned int)peek(2) << 8);
+}
+
+//================================================================================================
+void Sim800_Capture::record (byte direction, char value)
+{
+  unsigned long now = millis();
+
+  if ((open_record < SIM800_CAPTURE_SIZE) && ((ring[open_record] & 0x80) == direction) &&
+      ((ring[open_record] & 0x7F) < 0x7F) && ((now - byte_time) < SIM800_CAPTURE_GAP_MS))
+  {
+    //Carry on with the current burst
+    if (used == SIM800_CAPTURE_SIZE) drop_oldest();
+
+    if (open_record < SIM800_CAPTURE_SIZE)
+    {
+      put (value);
+      ring[open_record]++;
+      byte_time = now;
+      return;
+    }
+  }
+
+  //Start a new record
+  while ((SIM800_CAPTURE_SIZE - used) < 4) drop_oldest();
+
+  unsigned long delta = (used == 0) ? 0 : (now - record_time);
+  if (delta > 0xFFFF) delta = 0xFFFF;
+  if (used == 0) start_time = now;
+
+  open_record = head;
+  put (direction | 1);
+  put (delta & 0xFF);
+  put (delta >> 8);
+  put (value);
+
+  record_time = now;
+  byte_time = now;
+}
+
 //================================================================================================
-SIM800_Control::SIM800_Control()
+void Sim800_Capture::dump (void)
 {
+  //#SIM800 capture <time of first record> <records lost>
+  //<T|R> <ms since previous record> <hex bytes>
+  Serial.print (F("#SIM800 capture "));
+  Serial.print (start_time);
+  Serial.print (' ');
+  Serial.println (dropped_records);
+
+  unsigned int offset = 0;
+
+  while (offset < used)
+  {
+    byte header = peek(offset);
+    unsigned int length = header & 0x7F;
+
+    Serial.print ((header & SIM800_CAPTURE_RX) ? 'R' : 'T');
+    Serial.print (' ');
+    //The oldest record's gap was to one that has since been dropped
+    if (offset == 0) Serial.print ('0');
+    else Serial.print ((unsigned int)(peek(offset + 1) | ((unsigned int)peek(offset + 2) << 8)));
+    Serial.print (' ');
+
+    for (unsigned int idx = 0; idx < length; idx++)
+    {
+      byte value = peek(offset + 3 + idx);
+      Serial.print ((char)pgm_read_byte(&HEX_DIGITS[value >> 4]));
+      Serial.print ((char)pgm_read_byte(&HEX_DIGITS[value & 0x0F]));
+    }
+    Serial.println ();
+
+    offset += 3 + length;
+  }
+
+  Serial.println (F("#end"));
+}
+
+//================================================================================================
+Sim800_Metrics::Sim800_Metrics()
+{
+  clear();
+}
+
+//================================================================================================
+void Sim800_Metrics::clear (void)
+{
+  memset (&commands, 0, sizeof(commands));
+  memset (&urcs, 0, sizeof(urcs));
+  memset (&recoveries, 0, sizeof(recoveries));
+  rx_overflows = 0;
+  transport_overflows = 0;
+  bytes_sent = 0;
+  bytes_received = 0;
+
+  open_class = CMD_NOT_A_COMMAND;
+  last_class = CMD_BASIC;
+  open_time = 0;
+}
+
+//================================================================================================
+unsigned int Sim800_Metrics::bucket_limit_ms (byte bucket)
+{
+  //The last bucket has no upper limit (0)
+  if (bucket >= (SIM800_LATENCY_BUCKETS - 1)) return 0;
+
+  return pgm_read_word(&LATENCY_LIMITS_MS[bucket]);
+}
+
+//================================================================================================
+void Sim800_Metrics::command_sent (const char *command)
+{
+  byte command_class = sim800_classify_command (command);
+
+  //A CTRL+Z submits what the last command opened (the SMS text or socket
+  //data), and is waited on like a command of its own
+  if (command[0] == char(26)) command_class = last_class;
+
+  if (command_class == CMD_NOT_A_COMMAND) return;
+
+  commands[command_class].sent++;
+  open_class = command_class;
+  last_class = command_class;
+  open_time = millis();
+}
+
+//================================================================================================
+void Sim800_Metrics::command_sent_P (PGM_P command)
+{
+  //The start is enough to classify it
+  char command_start[8];
+
+  strncpy_P (command_start, command, sizeof(command_start) - 1);
+  command_start[sizeof(command_start) - 1] = '\0';
+
+  command_sent (command_start);
+}
+
+//================================================================================================
+void Sim800_Metrics::command_done (Sim800_Buffer_State result)
+{
+  //Only the first result after a command counts; later waits are for
+  //more of the reply, or URCs
+  if (open_class == CMD_NOT_A_COMMAND) return;
+
+  Sim800_Command_Stats *stats = &commands[open_class];
+  open_class = CMD_NOT_A_COMMAND;
+
+  if (result == BS_TIMEOUT)
+  {
+    stats->timeout++;
+    return;
+  }
+
+  if (result == BS_ERROR) stats->error++;
+  else stats->ok++;
+
+  unsigned long elapsed = millis() - open_time;
+  byte bucket = 0;
+
+  while ((bucket < (SIM800_LATENCY_BUCKETS - 1)) && (elapsed >= pgm_read_word(&LATENCY_LIMITS_MS[bucket])))
+  {
+    bucket++;
+  }
+
+  stats->latency[bucket]++;
+  stats->total_ms += elapsed;
+}
+
+//================================================================================================
+SIM800_Control::SIM800_Control(Sim800_Transport &transport, byte rst_pin) : modem_serial (transport)
+{
+  reset_pin = rst_pin;
+
   call_when_idle = NULL;
   
   initialised = false;
+  module_rebooted = false;
+  reboot_announced = false;
+  reboot_time = 0;
+  sms_ready_seen = false;
+  fast_boot = false;
+  lazy_init = false;
+  features_configured = 0;
+  init_started = 0;
+  last_init_duration = 0;
+#if SIM800_ENABLE_SMS
+  time_to_first_sms = 0;
+#endif
+#if SIM800_ENABLE_GPRS
+  time_to_first_upload = 0;
+#endif
+  link_baud_rate = 0;
+  link_errors = 0;
+  link_error_time = 0;
+  link_quiet_since = 0;
+  link_best_baud = 0;
+  flow_control = false;
+  rts_pin = 0;
+  cts_pin = 0;
+
+  network_poll_time = 0;
+  net_connected = false;
+  rssi_poll_time = 0;
+  last_rssi = 0;
+#if SIM800_ENABLE_SMS
+  sms_poll_time = 0;
+  sms_consecutive_errors = 0;
+#endif
+#if SIM800_ENABLE_GPRS
+  website_connected = false;
+  gprs_poll_time = 0;
+  gprs_connected = false;
+  had_valid_gprs_context = false;
+#endif
   protocol_error_count = 0;
+  gsm_resets = 0;
   signal_strength = 0;
   fatal_error_detected = false;
   sim_card_inserted = true; //Assume we have a SIM until we confirm we havent'
   net_registration_denied = false; 
   
+#if SIM800_ENABLE_VOICE
   incoming_call_ring_time = 0;
+  call_action = CALL_UNDECIDED;
+  call_state = CS_IDLE;
+  dial_time = 0;
+  call_answered = false;
+  answer_time = 0;
+  caller_rules = NULL;
+  caller_rule_count = 0;
+  caller_default_action = CALL_UNDECIDED;
   clear_stored_caller_id();
-
+#elif SIM800_ENABLE_SMS
+  memset (&stored_caller_id, 0, sizeof(char) * MAX_CALLER_ID_SIZE);
+#endif
+#if SIM800_ENABLE_USSD
+  ussd_state = USSD_IDLE;
+  ussd_status = '0';
+  ussd_request_time = 0;
+  ussd_streaming = false;
+  ussd_group[0] = '\0';
+  ussd_group_length = 0;
+  ussd_split_digits = 0;
+  ussd_line_decoded = false;
+#endif
+  rx_deadline = 0;
+  rx_deadline_active = false;
+  slice_job = SJ_NONE;
+  slice_step = 0;
+  slice_retries = 0;
+  slice_features = 0;
+  slice_run = INIT_RUN_SLICE;
+  profile_matched = false;
+  profile_echo = false;
+  profile_found = 0;
+  slice_command_sent = false;
+  slice_command_time = 0;
+  slice_command_timeout = 0;
+  slice_last_us = 0;
+  slice_worst_us = 0;
+  async_command_active = false;
+  async_command_time = 0;
+  async_command_timeout = 0;
+  async_command_pattern = NULL;
+  async_command_owner = NULL;
+
+#if SIM800_ENABLE_SMS
   clear_sms_buffer();
+#endif
+#if SIM800_ENABLE_USSD
+  memset (&ussd_response, 0, sizeof(char) * SIM800_USSD_BUFFER_SIZE);
+#endif
+#if SIM800_ENABLE_SMS || SIM800_ENABLE_USSD
+  message_owner = MESSAGE_FREE;
+#endif
   
-  memset (&tx_buffer, 0, sizeof(char) * TX_BUFFER_SIZE);
   memset (&rx_buffer, 0, sizeof(char) * RX_BUFFER_SIZE);
   rx_buff_pos = 0;
   rx_buff_state = BS_WAITING; 
-
-  website_connected = false;
-  
 }
 
 //================================================================================================
 void SIM800_Control::refresh (void)
 {  
-  if (initialised == false)
+  //Leave a flow's command alone; its replies are read by command_poll()
+  if (async_command_owns_link() == true) return;
+
+  //If lines start arriving garbled after a baud rate increase, drop down a step
+  if ((link_baud_rate > pgm_read_dword(&BAUD_RATES[0])) && (link_errors >= BAUD_FALLBACK_ERRORS))
+  {
+    LogInfo (TR_BAUD_DOWN, 0u);
+    step_down_baud_rate();
+  }
+  //...and once it has run clean for long enough, try the faster rate again
+  else if ((link_baud_rate < link_best_baud) && (initialised == true) && (call_in_progress() == false) &&
+           ((millis() - link_quiet_since) >= BAUD_STEP_UP_QUIET_MS))
   {
-    DebugPrintln (F("Re-Init"));
+    LogInfo (TR_BAUD_UP, 0u);
+    step_up_baud_rate();
+  }
+
+  if ((initialised == false) && (module_rebooted == true) && (reboot_settled() == true))
+  {
+    //The module has just announced a reboot; try the quick path first
+    LogInfo (TR_RESUME, 0u);
+    resume_after_reboot();
+  }
+
+  if ((initialised == false) && (module_rebooted == false))
+  {
+    LogInfo (TR_REINIT, 0u);
+    SIM800_METRICS (recoveries[RECOVER_REINIT]++);
     initialise(false);
   }
   
   if (check_for_response() == BS_DATA)
   {
     //Unexpected data on the link - handle it as a URC
-    process_urc();       
+    process_urc(true);       
   }  
 
-  //Hang-up / disconnect the call two seconds after it's first detected
-  if ((incoming_call_ring_time > 0) && ((millis() - incoming_call_ring_time) > 10000))
+#if SIM800_ENABLE_VOICE
+  if (incoming_call_ring_time > 0)
   {
-    //ATH - Hang-up / disconnect the call
-    send_command(F("ATH"));
-    if (wait_for_status(20 * SECONDS) == BS_OK)
-    {
-      //Call disconnected successfully
-      incoming_call_ring_time = 0;
-      incoming_call_received = true;
-    }    
+    handle_incoming_call();
+  }
+#endif
+
+#if SIM800_ENABLE_USSD
+  check_ussd_timeout();
+#endif
+
+#if SIM800_ENABLE_VOICE
+  //Give up on an outbound call that hasn't been answered
+  if (((call_state == CS_DIALLING) || (call_state == CS_RINGING)) && ((millis() - dial_time) > 45000UL))
+  {
+    LogError (TR_NO_ANSWER, 0u);
+    hang_up();
   }
-}
 
+  if (answered_call_overdue() == true)
+  {
+    LogError (TR_CALL_TOO_LONG, 0u);
+    hang_up();
+  }
+#endif
+}
 //================================================================================================
-void SIM800_Control::begin (int baud_Rate)
+bool SIM800_Control::refresh_slice (unsigned int budget_ms)
 {
+  unsigned long slice_start = micros();
+  unsigned long budget_us = (unsigned long)budget_ms * 1000UL;
+  Sim800_Buffer_State line_state;
+
+  //Never read past the end of the slice
+  //A flow's command owns the link; its replies are read by command_poll()
+  if (async_command_owns_link() == true) return false;
+
+  rx_deadline = slice_start + budget_us;
+  rx_deadline_active = true;
+
+  if (slice_job == SJ_NONE) start_slice_job();
+
+#if SIM800_ENABLE_USSD
+  check_ussd_timeout();
+#endif
+
+  while ((micros() - slice_start) < budget_us)
+  {
+    if ((slice_job != SJ_NONE) && (slice_command_sent == false))
+    {
+      //Only start a command if there's time to transmit all of it (if not,
+      //carry on reading what's already arrived)
+      send_slice_command (budget_us - (micros() - slice_start));
+    }
+
+    line_state = check_for_response();
+
+    if (line_state != BS_DATA)
+    {
+      //Nothing more to read for now
+      if ((slice_job != SJ_NONE) && (slice_command_sent == true) && 
+          ((millis() - slice_command_time) > ((unsigned long)slice_command_timeout * 1000UL)))
+      {
+        finish_slice_command (BS_TIMEOUT);
+      }
+      break;
+    }
+
+    if ((strlen(rx_buffer) < 4) && (strstr_P(rx_buffer, PSTR("OK")) != NULL))
+    {
+      if (slice_command_sent == true) finish_slice_command (BS_OK);
+    }
+    else if ((strlen(rx_buffer) < 7) && (strstr_P(rx_buffer, PSTR("ERROR")) != NULL))
+    {
+      if (slice_command_sent == true) finish_slice_command (BS_ERROR);
+    }
+    else if ((slice_job == SJ_REINIT) && (slice_command_sent == true) && (slice_step < INIT_STEP_COUNT) &&
+             (pgm_read_byte(&INIT_STEPS[slice_step].flags) & INIT_PROFILE))
+    {
+      note_profile_line (slice_features);
+    }
+    else
+    {
+      //(a line nothing was waiting for, unless a command is out)
+      process_urc(slice_command_sent == false);
+    }
+  }
+
+  rx_deadline_active = false;
 
+  //Record how long the slice really took, so the worst case can be checked
+  slice_last_us = micros() - slice_start;
+  if (slice_last_us > slice_worst_us) slice_worst_us = slice_last_us;
+
+  return ((slice_job == SJ_NONE) && (initialised == true));
 }
+//================================================================================================
+void SIM800_Control::start_slice_job (void)
+{
+  slice_command_sent = false;
+  slice_retries = 0;
+
+  if ((initialised == false) && (module_rebooted == true) && (reboot_settled() == false))
+  {
+    //Let the reboot finish first
+  }
+  else if (initialised == false)
+  {
+    //Bring the module back step by step (it's assumed to have booted already);
+    //after an announced reboot only the settings it lost, as refresh() would
+    if (module_rebooted == true)
+    {
+      LogInfo (TR_RESUME, 0u);
+      SIM800_METRICS (recoveries[RECOVER_RESUME]++);
+      slice_run = INIT_RUN_SLICE_RESUME;
+    }
+    else
+    {
+      SIM800_METRICS (recoveries[RECOVER_REINIT]++);
+      slice_run = INIT_RUN_SLICE;
+    }
 
+    slice_job = SJ_REINIT;
+    slice_step = 0;
+    slice_features = restore_features();
+    slice_command_time = millis();
+    module_rebooted = false;
+    profile_matched = false;
+    features_configured = 0;
+    drop_flow_control();
+    init_started = millis();
+  }
+#if SIM800_ENABLE_VOICE
+  else if ((incoming_call_ring_time > 0) && (call_action == CALL_ACCEPT))
+  {
+    slice_job = SJ_ANSWER_CALL;
+  }
+  else if ((incoming_call_ring_time > 0) &&
+           ((call_action == CALL_REJECT) ||
+            ((call_action == CALL_UNDECIDED) && ((millis() - incoming_call_ring_time) > 10000))))
+  {
+    slice_job = SJ_REJECT_CALL;
+  }
+  else if ((incoming_call_ring_time > 0) && (call_action == CALL_IGNORE))
+  {
+    //Nothing to send; just stop waiting once it has rung out
+    handle_incoming_call();
+  }
+  else if (((call_state == CS_DIALLING) || (call_state == CS_RINGING)) && ((millis() - dial_time) > 45000UL))
+  {
+    LogError (TR_NO_ANSWER, 0u);
+    slice_job = SJ_HANGUP;
+  }
+  else if (answered_call_overdue() == true)
+  {
+    LogError (TR_CALL_TOO_LONG, 0u);
+    slice_job = SJ_HANGUP;
+  }
+#endif
+}
 //================================================================================================
-void SIM800_Control::initialise (bool force_warmstart)
+bool SIM800_Control::send_slice_command (unsigned long time_left_us)
 {
-  Sim800_Buffer_State return_val;
-  bool terminal_online = false;
-  
-  initialised = false;
+  PGM_P command = NULL;
+  unsigned int length;
   
-  //Non-blocking wait for 1 secs
-  for (byte wait = 0; wait < 100; wait++)
+  if (slice_job == SJ_REINIT)
   {
-    if (call_when_idle) call_when_idle();
-    delay(10);
+    //The same steps as initialise(), less the ones that aren't wanted
+    while ((slice_step < INIT_STEP_COUNT) && (init_step_wanted(slice_step, slice_run, slice_features) == false))
+    {
+      slice_step++;
+    }
+
+    if (slice_step >= INIT_STEP_COUNT)
+    {
+      if (slice_run == INIT_RUN_SLICE_RESUME) LogInfo (TR_RESUME_OK, 0u);
+      else LogInfo (TR_INIT_OK, 0u);
+      last_init_duration = millis() - init_started;
+      initialised = true;
+      slice_job = SJ_NONE;
+      return true;
+    }
+
+    //Some steps need a pause after the one before
+    if ((millis() - slice_command_time) < ((unsigned long)pgm_read_byte(&INIT_STEPS[slice_step].settle_secs) * 1000UL)) return false;
+
+    length = init_command_length(slice_step, slice_features);
+    slice_command_timeout = pgm_read_byte(&INIT_STEPS[slice_step].timeout_secs);
+  }
+  else
+  {
+    command = (slice_job == SJ_ANSWER_CALL) ? PSTR("ATA") : PSTR("ATH");
+    length = strlen_P(command);
+    slice_command_timeout = 20 * SECONDS;
+  }
+
+  //transmit() would wait for the module to take it
+  if ((flow_control == true) && (digitalRead(cts_pin) == HIGH)) return false;
+
+  //Each character takes ten bit times on the wire
+  unsigned long baud = (link_baud_rate > 0) ? link_baud_rate : 9600;
+  if (((length + 2) * (10000000UL / baud)) > time_left_us) return false;
+
+  if (command == NULL)
+  {
+    send_init_step (slice_step, slice_features, false);
+  }
+  else
+  {
+    command_start (false);
+    command_add ((const __FlashStringHelper *)command);
+    command_end (false);
+  }
+
+  slice_command_sent = true;
+  slice_command_time = millis();
+  return true;
+}
+//================================================================================================
+void SIM800_Control::finish_slice_command (Sim800_Buffer_State result)
+{
+  slice_command_sent = false;
+  SIM800_METRICS (command_done (result));
+
+  switch (slice_job)
+  {
+    case SJ_REINIT :
+      //Settle times run from the end of the step before
+      slice_command_time = millis();
+
+      if (finish_init_step(slice_step, slice_features, result) == false)
+      {
+        //Retry the step a few times, then start the sequence again (the
+        //whole of it, if resuming didn't work)
+        slice_retries++;
+        if (slice_retries >= 3)
+        {
+          if (slice_run == INIT_RUN_SLICE_RESUME) LogError (TR_RESUME_FAIL, 0u);
+          else LogError (TR_SLICE_INIT_FAIL, 0u);
+
+          slice_run = INIT_RUN_SLICE;
+          slice_retries = 0;
+          slice_step = 0;
+          profile_matched = false;
+          features_configured = 0;
+          drop_flow_control();
+        }
+        return;
+      }
+
+      slice_retries = 0;
+      slice_step++;
+      return;
+
+#if SIM800_ENABLE_VOICE
+    case SJ_ANSWER_CALL :
+    case SJ_REJECT_CALL :
+      if (result == BS_OK)
+      {
+        incoming_call_ring_time = 0;
+        incoming_call_received = true;
+        call_action = CALL_UNDECIDED;
+        if (slice_job == SJ_ANSWER_CALL) note_call_answered();
+      }
+      break;
+
+    case SJ_HANGUP :
+      if (result != BS_OK)
+      {
+        LogProtocolFailure();
+        protocol_error_count++; 
+      }
+      if (call_in_progress() == true) update_call_state('6');
+      break;
+#endif
   }
 
-  if (force_warmstart == true)
+  slice_job = SJ_NONE;
+}
+//================================================================================================
+bool SIM800_Control::command_begin (const __FlashStringHelper *cmd_string, byte timeout_secs, const __FlashStringHelper *pattern, const void *owner)
+{
+  if (link_free() == false) return false;
+
+  LogTrace (TR_TX_ASYNC, cmd_string);
+
+  transmit_P ((PGM_P)cmd_string);
+  transmit ('\r');
+  transmit ('\n');
+  SIM800_METRICS (command_sent_P ((PGM_P)cmd_string));
+
+  start_async_command (timeout_secs, pattern, owner);
+  return true;
+}
+//================================================================================================
+bool SIM800_Control::command_begin (const char *cmd_string, byte timeout_secs, const __FlashStringHelper *pattern, const void *owner)
+{
+  if (link_free() == false) return false;
+
+  LogTrace (TR_TX_ASYNC, cmd_string);
+
+  transmit (cmd_string);
+  transmit ('\r');
+  transmit ('\n');
+  SIM800_METRICS (command_sent (cmd_string));
+
+  start_async_command (timeout_secs, pattern, owner);
+  return true;
+}
+//================================================================================================
+void SIM800_Control::start_async_command (byte timeout_secs, const __FlashStringHelper *pattern, const void *owner)
+{
+  async_command_active = true;
+  async_command_time = millis();
+  async_command_timeout = timeout_secs;
+  async_command_pattern = pattern;
+  async_command_owner = owner;
+}
+//================================================================================================
+bool SIM800_Control::async_command_owns_link (void)
+{
+  if (async_command_active == false) return false;
+
+  //Take the link back from a flow that has stopped polling, well after its timeout
+  if ((millis() - async_command_time) > (2UL * async_command_timeout * 1000UL))
+  {
+    async_command_active = false;
+    SIM800_METRICS (command_done (BS_TIMEOUT));
+    return false;
+  }
+
+  return true;
+}
+//================================================================================================
+Sim800_Buffer_State SIM800_Control::command_poll (const void *owner)
+{
+  //Nothing in progress (for this caller, at least)
+  if ((async_command_active == false) || (owner != async_command_owner)) return BS_UNKNOWN;
+
+  //Check for a timeout condition
+  if ((millis() - async_command_time) > ((unsigned long)async_command_timeout * 1000UL))
+  {
+    async_command_active = false;
+    SIM800_METRICS (command_done (BS_TIMEOUT));
+    return BS_TIMEOUT;
+  }
+
+  //Handle at most one line per poll, so each call stays short
+  if (check_for_response() != BS_DATA) return BS_WAITING;
+
+  if ((strlen(rx_buffer) < 4) && (strstr_P(rx_buffer, PSTR("OK")) != NULL))
+  {
+    async_command_active = false;
+    SIM800_METRICS (command_done (BS_OK));
+    return BS_OK;
+  }
+  else if ((strlen(rx_buffer) < 7) && (strstr_P(rx_buffer, PSTR("ERROR")) != NULL))
+  {
+    async_command_active = false;
+    SIM800_METRICS (command_done (BS_ERROR));
+    return BS_ERROR;
+  }
+  else if ((async_command_pattern != NULL) && (strstr_P(rx_buffer, (PGM_P)async_command_pattern) != NULL))
+  {
+    //The reply the caller is after; it's in last_line() until the next poll
+    SIM800_METRICS (command_done (BS_DATA));
+    return BS_DATA;
+  }
+
+  process_urc();
+  return BS_WAITING;
+}
+#if SIM800_ENABLE_USSD
+//================================================================================================
+void SIM800_Control::check_ussd_timeout (void)
+{
+  //Give up on a USSD request the network hasn't answered
+  if (((ussd_state == USSD_WAITING) || (ussd_state == USSD_RECEIVING)) && ((millis() - ussd_request_time) > 60000UL))
+  {
+    LogError (TR_USSD_TIMEOUT, 0u);
+    ussd_state = USSD_FAILED;
+    events.push (EV_USSD_FAILED, NULL);
+  }
+}
+#endif
+
+#if SIM800_ENABLE_VOICE
+//================================================================================================
+void SIM800_Control::handle_incoming_call (void)
+{
+  switch (call_action)
+  {
+    case CALL_REJECT :
+      //ATH - Hang-up / disconnect the call straight away
+      send_command(F("ATH"));
+      if (wait_for_status(20 * SECONDS) == BS_OK)
+      {
+        incoming_call_ring_time = 0;
+        incoming_call_received = true;
+        call_action = CALL_UNDECIDED;
+      }    
+      break;
+
+    case CALL_ACCEPT :
+      //ATA - Answer the call
+      send_command(F("ATA"));
+      if (wait_for_status(20 * SECONDS) == BS_OK)
+      {
+        incoming_call_ring_time = 0;
+        incoming_call_received = true;
+        call_action = CALL_UNDECIDED;
+        note_call_answered();
+      }    
+      break;
+
+    case CALL_IGNORE :
+      //Let it ring out; "NO CARRIER" normally ends it, but don't wait forever
+      if ((millis() - incoming_call_ring_time) > 60000UL)
+      {
+        incoming_call_ring_time = 0;
+        call_action = CALL_UNDECIDED;
+      }
+      break;
+
+    default :
+      //No policy: hang-up / disconnect the call ten seconds after it's first detected
+      if ((millis() - incoming_call_ring_time) > 10000)
+      {
+        //ATH - Hang-up / disconnect the call
+        send_command(F("ATH"));
+        if (wait_for_status(20 * SECONDS) == BS_OK)
+        {
+          //Call disconnected successfully
+          incoming_call_ring_time = 0;
+          incoming_call_received = true;
+        }    
+      }
+      break;
+  }
+}
+//================================================================================================
+void SIM800_Control::set_caller_policy (const Sim800_Caller_Rule *rules, byte rule_count, byte default_action)
+{
+  caller_rules = rules;
+  caller_rule_count = rule_count;
+  caller_default_action = default_action;
+}
+//================================================================================================
+byte SIM800_Control::lookup_caller (const char *caller_id)
+{
+  char number [MAX_CALLER_ID_SIZE];
+  int low = 0;
+  int high = caller_rule_count - 1;
+
+  //Strip the quotes from the +CLIP number
+  memset (&number, 0, sizeof(char) * MAX_CALLER_ID_SIZE);
+  strncpy (number, (caller_id[0] == '\"') ? &caller_id[1] : caller_id, MAX_CALLER_ID_SIZE - 1);
+  if ((strlen(number) > 0) && (number[strlen(number) - 1] == '\"')) number[strlen(number) - 1] = '\0';
+
+  //Binary search of the (sorted) PROGMEM table
+  while (low <= high)
+  {
+    int mid = (low + high) / 2;
+    int compare = strcmp_P (number, caller_rules[mid].number);
+
+    if (compare == 0) return pgm_read_byte (&caller_rules[mid].action);
+    else if (compare < 0) high = mid - 1;
+    else low = mid + 1;
+  }
+
+  return caller_default_action;
+}
+#endif
+
+//================================================================================================
+void SIM800_Control::begin (long baud_Rate, long max_baud_Rate)
+{
+  link_baud_rate = baud_Rate;
+  modem_serial.begin (baud_Rate);
+
+  //Give the module a chance to lock on to the rate ("AT" autobaud), and if that
+  //doesn't work look for it at the other standard rates (e.g. an AT+IPR left over
+  //from a previous run)
+  if (link_responds() == false)
+  {
+    if (find_baud_rate() == false)
+    {
+      //Nothing is answering (probably still powering up); initialise() will retry
+      link_baud_rate = baud_Rate;
+      modem_serial.begin (baud_Rate);
+      return;
+    }
+  }
+
+  //Step up to the fastest rate that survives an integrity check
+  for (byte idx = 0; idx < BAUD_RATE_COUNT; idx++)
+  {
+    long new_rate = pgm_read_dword(&BAUD_RATES[idx]);
+    long old_rate = link_baud_rate;
+
+    if ((new_rate <= link_baud_rate) || (new_rate > max_baud_Rate)) continue;
+
+    if ((change_baud_rate(new_rate) == false) || (link_integrity_ok() == false))
+    {
+      LogError (TR_BAUD_FAIL, 0u);
+
+      //Drop back to the last good rate, and stop climbing
+      if ((change_baud_rate(old_rate) == false) || (link_responds() == false))
+      {
+        find_baud_rate();
+      }
+      break;
+    }
+  }
+
+  link_best_baud = link_baud_rate;
+  link_errors = 0;
+  link_quiet_since = millis();
+}
+
+//================================================================================================
+void SIM800_Control::initialise (bool force_warmstart)
+{
+  Sim800_Buffer_State return_val;
+  bool terminal_online = false;
+  unsigned long init_start = millis();
+  
+  initialised = false;
+  module_rebooted = false;
+  init_started = init_start;
+  
+  //Non-blocking wait for 1 secs
+  for (byte wait = 0; wait < 100; wait++)
+  {
+    idle();
+    delay(10);
+  }
+
+  if (force_warmstart == true)
+  {
+    SIM800_METRICS (recoveries[RECOVER_WARMSTART]++);
+
+    //Cycle the RESET Pin to restart the module
+    pinMode (reset_pin, OUTPUT);
+  
+    //Non-blocking wait for 500ms
+    for (byte wait = 0; wait < 50; wait++)
+    {
+      idle();
+      delay(10);
+    }
+  
+    pinMode (reset_pin, INPUT);
+
+    //Non-blocking wait for 500ms
+    for (byte wait = 0; wait < 50; wait++)
+    {
+      idle();
+      delay(10);
+    }
+  
+  }
+
+  //Wait until the Serial port is active
+  send_command(F("\r\n"));
+  
+  let_terminal_settle();
+
+  unsigned long start_time = millis();  
+  return_val = BS_UNKNOWN;
+
+  while (((millis() - start_time) < 30000) && (return_val != BS_OK))
+  {
+    //AT - Check that the module is accepting commands
+    send_command(F("AT"));
+
+    return_val = wait_for_status(2 * SECONDS);
+    if (return_val != BS_OK)
+    {
+      LogError (TR_NO_RESPONSE, 0u);
+    }    
+  }
+
+  if (return_val != BS_OK)
+  {
+    LogError (TR_RESET_FAIL, 0u);
+    return;
+  }
+
+  return_val = wait_for_data(F("SMS Ready"), 30 * SECONDS);  
+  if ((return_val != BS_DATA) && (force_warmstart == true))
+  {
+    //AT+CCID - Check for a valid SIM card
+    send_command(F("AT+CCID"));
+  
+    wait_for_data(NULL, 2 * SECONDS);  
+    
+    return_val = wait_for_status(2 * SECONDS);
+    if (return_val != BS_OK)
+    {
+      sim_card_inserted = false;
+      LogError (TR_NO_SIM, 0u);
+      return;
+    }
+  
+    
+    return;
+  }
+
+  //Non-blocking wait for 1 secs
+  for (byte wait = 0; wait < 100; wait++)
+  {
+    idle();
+    delay(10);
+  }
+  
+  //AT&F, then the runtime configuration and a radio cycle (see INIT_STEPS)
+  //In lazy mode each feature (bar caller ID) is configured on first use instead
+  if (run_init_steps(INIT_RUN_START, restore_features()) == false) return;
+
+       
+  LogInfo (TR_INIT_OK, 0u);
+  last_init_duration = millis() - init_start;
+  initialised = true;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::resume_after_reboot (void)
+{
+  Sim800_Buffer_State return_val = BS_UNKNOWN;
+  unsigned long init_start = millis();
+
+  SIM800_METRICS (recoveries[RECOVER_RESUME]++);
+
+  initialised = false;
+  module_rebooted = false;
+
+  //The module has already announced "SMS Ready", so skip the boot waits
+  //and just confirm that it is accepting commands
+  for (byte retries = 0; ((retries < 3) && (return_val != BS_OK)); retries++)
+  {
+    //AT - Check that the module is accepting commands
+    send_command(F("AT"));
+
+    return_val = wait_for_status(2 * SECONDS);
+  }
+
+  if (return_val != BS_OK)
+  {
+    //Leave initialised FALSE so that the full start-up sequence is used
+    LogError (TR_RESUME_FAIL, 0u);
+    return;
+  }
+
+  //The reboot has already loaded the power-on profile, so there's no need
+  //for AT&F or a radio cycle; just reapply the runtime settings that were lost
+  if (run_init_steps(INIT_RUN_RESUME, restore_features()) == false) return;
+
+  LogInfo (TR_RESUME_OK, 0u);
+  last_init_duration = millis() - init_start;
+  initialised = true;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::reboot_settled (void)
+{
+  //"SMS Ready" is the last thing a boot announces
+  return ((sms_ready_seen == true) || ((millis() - reboot_time) >= REBOOT_RESUME_WAIT_MS));
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::link_responds (void)
+{
+  for (byte retries = 0; retries < 2; retries++)
+  {
+    //AT - Check that the module is accepting commands
+    send_command(F("AT"));
+
+    if (wait_for_status(1 * SECONDS) == BS_OK) return true;
+  }
+
+  return false;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::find_baud_rate (void)
+{
+  for (byte idx = 0; idx < BAUD_RATE_COUNT; idx++)
+  {
+    link_baud_rate = pgm_read_dword(&BAUD_RATES[idx]);
+    modem_serial.begin (link_baud_rate);
+
+    if (link_responds() == true) return true;
+  }
+
+  return false;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::change_baud_rate (long new_rate)
+{
+  //AT+IPR - Fix the module's rate, then follow it on our side
+  command_start();
+  command_add (F("AT+IPR="));
+  command_add (new_rate);
+  command_end();
+
+  if (wait_for_status(2 * SECONDS) != BS_OK) return false;
+
+  modem_serial.begin (new_rate);
+  link_baud_rate = new_rate;
+  let_terminal_settle();
+
+  return true;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::link_integrity_ok (void)
+{
+  //ATI - Product ID; several round trips of known text must come back intact
+  for (byte attempt = 0; attempt < 5; attempt++)
+  {
+    send_command(F("ATI"));
+
+    if (wait_for_data(F("SIM"), 2 * SECONDS) != BS_DATA) return false;
+    if (wait_for_status(2 * SECONDS) != BS_OK) return false;
+  }
+
+  return true;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::step_down_baud_rate (void)
+{
+  SIM800_METRICS (recoveries[RECOVER_BAUD_STEP_DOWN]++);
+
+  long new_rate = pgm_read_dword(&BAUD_RATES[0]);
+
+  for (byte idx = 0; idx < BAUD_RATE_COUNT; idx++)
+  {
+    if (pgm_read_dword(&BAUD_RATES[idx]) < link_baud_rate) new_rate = pgm_read_dword(&BAUD_RATES[idx]);
+  }
+
+  if (change_baud_rate(new_rate) == false)
+  {
+    //The link may be too corrupted to accept AT+IPR; go looking for the module
+    find_baud_rate();
+  }
+
+  link_errors = 0;
+  link_quiet_since = millis();
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::step_up_baud_rate (void)
+{
+  long old_rate = link_baud_rate;
+  long new_rate = link_best_baud;
+
+  //The next rate up (no faster than begin() found to work)
+  for (byte idx = BAUD_RATE_COUNT; idx > 0; idx--)
+  {
+    long rate = pgm_read_dword(&BAUD_RATES[idx - 1]);
+
+    if ((rate > link_baud_rate) && (rate < new_rate)) new_rate = rate;
+  }
+
+  if ((change_baud_rate(new_rate) == false) || (link_integrity_ok() == false))
+  {
+    LogError (TR_BAUD_FAIL, 0u);
+
+    //Still not clean enough; go back, and wait as long again before the next try
+    if ((change_baud_rate(old_rate) == false) || (link_responds() == false))
+    {
+      find_baud_rate();
+    }
+  }
+
+  link_errors = 0;
+  link_quiet_since = millis();
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::note_link_error (void)
+{
+  //Only errors close together count towards a fallback
+  if ((link_errors == 0) || ((millis() - link_error_time) > BAUD_FALLBACK_WINDOW_MS))
+  {
+    link_errors = 0;
+    link_error_time = millis();
+  }
+
+  if (link_errors < 255) link_errors++;
+  link_quiet_since = millis();
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::enable_features (byte features)
+{
+  byte pending = features & ~features_configured;
+
+  if (pending == 0) return true;
+
+  return run_init_steps(INIT_RUN_FEATURES, pending);
+}
+//==================================================================================
+//==================================================================================
+byte SIM800_Control::restore_features (void)
+{
+  //In lazy mode only bring back the features that were already in use (and
+  //caller ID, without which an incoming call is never noticed)
+  if (lazy_init == true) return (features_configured | SIM800_FEATURE_INCOMING);
+
+  return (SIM800_FEATURE_ALL | (features_configured & (SIM800_FEATURE_CALL_STATE | SIM800_FEATURE_FLOW_CONTROL)));
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::run_init_steps (byte run, byte features)
+{
+  profile_matched = false;
+
+  //A start-up or a reboot has lost whatever was set up before
+  if (run != INIT_RUN_FEATURES)
+  {
+    features_configured = 0;
+    drop_flow_control();
+  }
+
+  for (byte step = 0; step < INIT_STEP_COUNT; step++)
+  {
+    if (init_step_wanted(step, run, features) == false) continue;
+
+    byte settle_secs = pgm_read_byte(&INIT_STEPS[step].settle_secs);
+    if (settle_secs > 0) wait_for_status(settle_secs);
+
+    send_init_step (step, features, true);
+
+    if (finish_init_step(step, features, read_init_reply(step, features)) == false) return false;
+  }
+
+  return true;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::init_step_wanted (byte step, byte run, byte features)
+{
+  byte feature = pgm_read_byte(&INIT_STEPS[step].feature);
+  byte flags = pgm_read_byte(&INIT_STEPS[step].flags);
+
+  if ((feature != 0) && ((feature & features) == 0)) return false;
+  if (flags & INIT_HANDSHAKE) return ((run == INIT_RUN_SLICE) || (run == INIT_RUN_SLICE_RESUME));
+  if (run == INIT_RUN_FEATURES) return (feature != 0);
+  if (flags & INIT_PROFILE) return fast_boot;
+
+  //The saved profile (or the reboot that loaded it) covers these
+  if ((flags & INIT_FULL) && ((run == INIT_RUN_RESUME) || (run == INIT_RUN_SLICE_RESUME) || (profile_matched == true))) return false;
+  if ((flags & INIT_SAVED) && (profile_matched == true)) return false;
+
+  if ((flags & INIT_SAVE) && (fast_boot == false)) return false;
+  if ((flags & INIT_RADIO) && (lazy_init == true)) return false;
+
+  return true;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::profile_step (byte step, byte features)
+{
+  byte feature = pgm_read_byte(&INIT_STEPS[step].feature);
+
+  //Saved by AT&W, and wanted this time
+  return ((pgm_read_byte(&INIT_STEPS[step].flags) & INIT_SAVED) && ((feature == 0) || (feature & features)));
+}
+//==================================================================================
+//==================================================================================
+byte SIM800_Control::profile_query (byte features, bool send)
+{
+  byte length = 2;
+
+  //Query every saved setting (and the SIM) in a single exchange:
+  //AT+CMGF=1 becomes +CMGF?, and so on
+  if (send == true) command_add (F("AT"));
+
+  for (byte step = 0; step < INIT_STEP_COUNT; step++)
+  {
+    if (profile_step(step, features) == false) continue;
+
+    PGM_P command = (PGM_P)pgm_read_ptr(&INIT_STEPS[step].command);
+    PGM_P value = strchr_P(command, '=');
+
+    if (value == NULL) continue;
+
+    for (PGM_P next = command + 2; next < value; next++)
+    {
+      if (send == true) command_add ((char)pgm_read_byte(next));
+      length++;
+    }
+
+    if (send == true) command_add (F("?;"));
+    length += 2;
+  }
+
+  if (send == true) command_add (F("+CCID"));
+
+  return length + 5;
+}
+//==================================================================================
+//==================================================================================
+byte SIM800_Control::init_command_length (byte step, byte features)
+{
+  if (pgm_read_byte(&INIT_STEPS[step].flags) & INIT_PROFILE) return profile_query(features, false);
+
+  return strlen_P((PGM_P)pgm_read_ptr(&INIT_STEPS[step].command));
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::send_init_step (byte step, byte features, bool blocking)
+{
+  command_start (blocking);
+
+  if (pgm_read_byte(&INIT_STEPS[step].flags) & INIT_PROFILE)
+  {
+    profile_found = 0;
+    profile_echo = false;
+    profile_query (features, true);
+  }
+  else
+  {
+    command_add ((const __FlashStringHelper *)pgm_read_ptr(&INIT_STEPS[step].command));
+  }
+
+  command_end (blocking);
+}
+//==================================================================================
+//==================================================================================
+Sim800_Buffer_State SIM800_Control::read_init_reply (byte step, byte features)
+{
+  Sim800_Buffer_State return_val;
+  byte flags = pgm_read_byte(&INIT_STEPS[step].flags);
+  byte timeout_secs = pgm_read_byte(&INIT_STEPS[step].timeout_secs);
+
+  if (flags & INIT_PROFILE)
   {
-    //Cycle the RESET Pin to restart the module
-    pinMode (GSM_RST_PIN, OUTPUT);
-  
-    //Non-blocking wait for 500ms
-    for (byte wait = 0; wait < 50; wait++)
+    return_val = wait_for_data(NULL, timeout_secs);
+    while (return_val == BS_DATA)
     {
-      if (call_when_idle) call_when_idle();
-      delay(10);
+      note_profile_line (features);
+      return_val = wait_for_data(NULL, timeout_secs);
     }
-  
-    pinMode (GSM_RST_PIN, INPUT);
 
-    //Non-blocking wait for 500ms
-    for (byte wait = 0; wait < 50; wait++)
-    {
-      if (call_when_idle) call_when_idle();
-      delay(10);
-    }
-  
+    return return_val;
   }
 
-  //Wait until the Serial port is active
-  send_command(F("\r\n"));
-  
-  let_terminal_settle();
-
-  unsigned long start_time = millis();  
-  return_val = BS_UNKNOWN;
-
-  while (((millis() - start_time) < 30000) && (return_val != BS_OK))
+  if (flags & INIT_SIM)
   {
-    //AT - Check that the module is accepting commands
-    send_command(F("AT"));
+    //The CCID comes before the OK
+    return_val = wait_for_data(NULL, timeout_secs);
+    if (return_val != BS_DATA) return return_val;
 
-    return_val = wait_for_status(2 * SECONDS);
-    if (return_val != BS_OK)
-    {
-      DebugPrintln (F("F! NoResp"));
-    }    
+    LogInfo (TR_SIM_OK, 0u);
   }
 
-  if (return_val != BS_OK)
+  return wait_for_status(timeout_secs);
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::note_profile_line (byte features)
+{
+  //Echo means ATE 0 wasn't saved
+  if (strncmp_P(rx_buffer, PSTR("AT"), 2) == 0)
   {
-    DebugPrintln (F("F! RstFail"));    
+    profile_echo = true;
     return;
   }
 
-  return_val = wait_for_data(F("SMS Ready"), 30 * SECONDS);  
-  if ((return_val != BS_DATA) && (force_warmstart == true))
+  for (byte step = 0; step < INIT_STEP_COUNT; step++)
   {
-    //AT+CCID - Check for a valid SIM card
-    send_command(F("AT+CCID"));
-  
-    wait_for_data(NULL, 2 * SECONDS);  
-    
-    return_val = wait_for_status(2 * SECONDS);
-    if (return_val != BS_OK)
+    if (profile_step(step, features) == false) continue;
+
+    if (pgm_read_byte(&INIT_STEPS[step].flags) & INIT_SIM)
     {
-      sim_card_inserted = false;
-      DebugPrintln (F("F! NoSim"));
-      return;
+      if ((rx_buffer[0] >= '0') && (rx_buffer[0] <= '9')) profile_found |= (1 << step);
+      continue;
+    }
+
+    //+CMGF: 1 for AT+CMGF=1 (anything after the value is ignored)
+    PGM_P command = (PGM_P)pgm_read_ptr(&INIT_STEPS[step].command);
+    PGM_P value = strchr_P(command, '=');
+
+    if (value == NULL) continue;
+
+    byte name_length = value - (command + 2);
+
+    if ((strncmp_P(rx_buffer, command + 2, name_length) == 0) &&
+        (strncmp_P(&rx_buffer[name_length], PSTR(": "), 2) == 0) &&
+        (strncmp_P(&rx_buffer[name_length + 2], value + 1, strlen_P(value + 1)) == 0))
+    {
+      profile_found |= (1 << step);
     }
-  
-    
-    return;
   }
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::finish_init_step (byte step, byte features, Sim800_Buffer_State result)
+{
+  byte flags = pgm_read_byte(&INIT_STEPS[step].flags);
+  unsigned int profile_wanted = 0;
 
-  //Non-blocking wait for 1 secs
-  for (byte wait = 0; wait < 100; wait++)
+  if (flags & INIT_PROFILE)
   {
-    if (call_when_idle) call_when_idle();
-    delay(10);
-  }
-  
-  //AT&F - Reset to Factory Defaults
-  send_command(F("AT&F"));
+    //A setting with no query (ATE 0) is covered by the echo check
+    for (byte idx = 0; idx < INIT_STEP_COUNT; idx++)
+    {
+      PGM_P command = (PGM_P)pgm_read_ptr(&INIT_STEPS[idx].command);
 
-  return_val = wait_for_status(2 * SECONDS);
-  if (return_val != BS_OK)
-  {    
-    DebugPrintln (PROTO_FAILURE_STR); //PROTO_FAILURE_STR);
-    protocol_error_count++; 
-    return;
-  }
+      if ((profile_step(idx, features) == true) &&
+          ((pgm_read_byte(&INIT_STEPS[idx].flags) & INIT_SIM) || (strchr_P(command, '=') != NULL)))
+      {
+        profile_wanted |= (1 << idx);
+      }
+    }
 
-  //ATE 0 - Disable Command Echo
-  send_command(F("ATE 0"));
+    profile_matched = ((result == BS_OK) && (profile_echo == false) && (profile_found == profile_wanted));
 
-  return_val = wait_for_status(2 * SECONDS);
-  if (return_val != BS_OK)
-  {
-    DebugPrintln (PROTO_FAILURE_STR);
-    protocol_error_count++; 
-    return;
-  }
+    if (profile_matched == true)
+    {
+      //The saved profile already holds our configuration (and found the SIM)
+      LogInfo (TR_PROFILE_OK, 0u);
+      sim_card_inserted = true;
 
-  //AT+CCID - Check for a valid SIM card
-  send_command(F("AT+CCID"));
+      for (byte idx = 0; idx < INIT_STEP_COUNT; idx++)
+      {
+        if (profile_step(idx, features) == true) features_configured |= pgm_read_byte(&INIT_STEPS[idx].feature);
+      }
 
-  if (wait_for_data(NULL, 2 * SECONDS) == BS_DATA)
-  {
-    DebugPrintln (F("SimOk"));  
-  }
+      flow_control = ((features_configured & SIM800_FEATURE_FLOW_CONTROL) != 0);
+    }
 
-  return_val = wait_for_status(2 * SECONDS);
-  if (return_val != BS_OK)
-  {
-    DebugPrintln (F("F! NoSim"));
-    return;
+    //A mismatch just means the full configuration is applied
+    return true;
   }
-  
-  //AT+CMGF=1 - Manage SMS in Text Format
-  send_command(F("AT+CMGF=1"));
 
-  return_val = wait_for_status(2 * SECONDS);
-  if (return_val != BS_OK)
-  {
-    DebugPrintln (F("F! InitFail"));
-    return;
-  }
-  
-  //AT+CLIP=1 - Enable Caller ID Presentation
-  send_command(F("AT+CLIP=1"));
+  if (flags & INIT_SIM) sim_card_inserted = (result == BS_OK);
 
-  return_val = wait_for_status(15 * SECONDS);
-  if (return_val != BS_OK)
+  if (result == BS_OK)
   {
-    DebugPrintln (PROTO_FAILURE_STR);
-    protocol_error_count++; 
-    return;
+    features_configured |= pgm_read_byte(&INIT_STEPS[step].feature);
+    flow_control = ((features_configured & SIM800_FEATURE_FLOW_CONTROL) != 0);
+    return true;
   }
 
-  //AT+CUSD=1 - Enable Unstructured Data Responses
-  send_command(F("AT+CUSD=1"));
-
-  return_val = wait_for_status(2 * SECONDS);
-  if (return_val != BS_OK)
+  if (flags & INIT_SIM)
   {
-    DebugPrintln (PROTO_FAILURE_STR);
-    protocol_error_count++; 
-    return;
+    LogError (TR_NO_SIM, 0u);
+    return false;
   }
 
-  wait_for_status(5 * SECONDS);
-  send_command(F("AT+CFUN=4"));  
-  wait_for_status(15 * SECONDS);
-  wait_for_status(5 * SECONDS);
-  send_command(F("AT+CFUN=1"));  
-  wait_for_status(15 * SECONDS);
+  LogError (TR_INIT_FAIL, step);
+  LogProtocolFailure();
+  protocol_error_count++; 
 
-       
-  DebugPrintln (F("InitOk"));  
-  initialised = true;
+  return ((flags & INIT_OPTIONAL) != 0);
 }
 //==================================================================================
 //==================================================================================
@@ -255,48 +1598,68 @@ Sim800_Buffer_State SIM800_Control::check_for_response (void)
   }  
 
   rx_buff_state = BS_WAITING;
+
+  if (flow_control == true)
+  {
+    //Let the module send while we're here to read it, giving it a few
+    //character times to start
+    unsigned long window_start = micros();
+    unsigned long window_us = 30000000UL / ((link_baud_rate > 0) ? link_baud_rate : 9600);
+
+    set_rts (false);
+    while ((modem_serial.available() == 0) && ((micros() - window_start) < window_us) &&
+           ((rx_deadline_active == false) || ((long)(micros() - rx_deadline) < 0)))
+    {
+      idle();
+      set_rts (false);
+    }
+  }
   
   //Loop until either a complete line has been read,
   //or there is no more data in the receive buffer
-  while ((Sim800_Serial.available()) && (rx_buff_state == BS_WAITING))
+  while ((modem_serial.available()) && (rx_buff_state == BS_WAITING) &&
+         ((rx_deadline_active == false) || ((long)(micros() - rx_deadline) < 0)))
   {
-    if (call_when_idle) call_when_idle();
+    idle();
+    set_rts (false);
     
-    rx_buffer[rx_buff_pos] = Sim800_Serial.read();
+    char incoming = modem_serial.read();
+    SIM800_CAPTURE_BYTE (SIM800_CAPTURE_RX, incoming);
+    SIM800_METRICS (bytes_received++);
 
-    if (rx_buffer[rx_buff_pos] == char(10))
-    {
-      //Do nothing (Strip Line Feeds)
-    }
-    else if (rx_buffer[rx_buff_pos] == char(13))
-    {      
-      //Replace the CR with a NULL so that the data forms a valid string
-      rx_buffer[rx_buff_pos] = char(0);
+#if SIM800_ENABLE_USSD
+    //USSD text that may be UCS2 hex is decoded on the way in
+    if (stream_ussd_byte (incoming) == true) continue;
+#endif
 
-      //If something more than a CR on it's own has been received, store the data
-      if (rx_buff_pos > 0)
-      {
-        DebugPrint (F("Rx: "));
-        DebugPrintln (rx_buffer);
-        rx_buff_state = BS_DATA;
-      }
+    if (sim800_frame_byte (rx_buffer, &rx_buff_pos, RX_BUFFER_SIZE, incoming) == true)
+    {
+      LogTrace (TR_RX_LINE, rx_buffer);
+      rx_buff_state = BS_DATA;
+
+      //Bytes the module never sends mean the link itself is failing (the
+      //USSD characters decoded on the way in are marked with the top bit)
+      bool garbled = sim800_line_garbled(rx_buffer);
+#if SIM800_ENABLE_USSD
+      if (ussd_line_decoded == true) garbled = false;
+      ussd_line_decoded = false;
+#endif
+      if (garbled == true) note_link_error();
     }
-    else
-    {      
-      if (rx_buff_pos < RX_BUFFER_SIZE)
-      {
-        rx_buff_pos++;
-      }
-      else
-      {
-        //If the buffer has filled, but there's no meaningful data,
-        //clear down the buffer
-        memset (&rx_buffer, 0, sizeof(char) * RX_BUFFER_SIZE);
-        rx_buff_pos = 0;
-      }
+    else if ((rx_buff_pos == 0) && (incoming != char(13)) && (incoming != char(10)))
+    {
+      //The line didn't fit, and has been thrown away
+      SIM800_METRICS (rx_overflows++);
     }
   }
 
+  //Hold the module off again until the next read
+  set_rts (true);
+
+#if SIM800_ENABLE_METRICS && SIM800_TRANSPORT_HAS_OVERFLOW
+  if (modem_serial.overflow() == true) SIM800_METRICS (transport_overflows++);
+#endif
+
   return rx_buff_state;
 }
 //==================================================================================
@@ -308,7 +1671,7 @@ Sim800_Buffer_State SIM800_Control::wait_for_status (byte timeout_secs)
 
   while (return_val == BS_UNKNOWN)
   {
-    if (call_when_idle) call_when_idle();
+    idle();
     
     //Check for a timeout condition
     if (millis() > (loop_start + ((unsigned long)timeout_secs * 1000UL)))
@@ -327,59 +1690,150 @@ Sim800_Buffer_State SIM800_Control::wait_for_status (byte timeout_secs)
       {
         return_val = BS_ERROR;
       }     
-      else if ((rx_buffer[0] == '+') &&
-               ((rx_buffer[4] == ':') || (rx_buffer[5] == ':')))
+      //(including a reboot part way through the command)
+      else if (((rx_buffer[0] == '+') &&
+                ((rx_buffer[4] == ':') || (rx_buffer[5] == ':'))) ||
+               (sim800_classify_urc (rx_buffer) == URC_READY))
       {
-         process_urc();       
+         process_urc(true);       
       }
     }
   }
 
+  SIM800_METRICS (command_done (return_val));
+
   return return_val;  
 }
 //==================================================================================
 //==================================================================================
-void SIM800_Control::process_urc (void)
+void SIM800_Control::process_urc (bool count_unmatched)
 {
-  if (strstr_P(rx_buffer, PSTR("+CLIP: ")) != NULL)
+  byte urc_type = sim800_classify_urc (rx_buffer);
+
+#if SIM800_ENABLE_USSD
+  //Further lines of a multi-line USSD reply (anything else is still handled as it arrives)
+  if ((ussd_state == USSD_RECEIVING) && (urc_type == URC_NONE))
+  {
+    process_ussd_continuation();
+    return;
+  }
+#endif
+
+  //Lines that aren't URCs only count where nothing else was waiting for them
+  if ((urc_type != URC_NONE) || (count_unmatched == true)) SIM800_METRICS (urcs[urc_type]++);
+
+  switch (urc_type)
   {
-    //If this is the first ring, then store the number
-    if (incoming_call_ring_time == 0)
+#if SIM800_ENABLE_USSD
+    case URC_USSD :
+      process_ussd();
+      break;
+#endif
+
+#if SIM800_ENABLE_VOICE
+    case URC_CALLER_ID :
+      //If this is the first ring, then store the number
+      if (incoming_call_ring_time == 0)
+      {
+        incoming_call_ring_time = millis();
+
+        //+CLIP: <number>,<type>,...
+        strncpy (stored_caller_id, sim800_csv_cut (&rx_buffer[7]), MAX_CALLER_ID_SIZE - 1);
+        stored_caller_id[MAX_CALLER_ID_SIZE - 1] = '\0';
+
+        if (strlen(stored_caller_id) == 2)
+        {
+          strcpy_P (stored_caller_id, PSTR("\"UNKNOWN\""));
+        }
+        
+        LogInfo (TR_URC_RING, stored_caller_id);
+
+        //Decide now; refresh() acts on it as soon as the link is free
+        call_action = lookup_caller (stored_caller_id);
+
+        if (call_action == CALL_REJECT) events.push (EV_CALL_REJECTED, stored_caller_id);
+        else if (call_action == CALL_ACCEPT) events.push (EV_CALL_ACCEPTED, stored_caller_id);
+        else if (call_action == CALL_IGNORE) events.push (EV_CALL_IGNORED, stored_caller_id);
+        else events.push (EV_INCOMING_CALL, stored_caller_id);
+      }       
+      break;
+
+    case URC_CALL_STATE :
     {
-      incoming_call_ring_time = millis();
-      
-      for (byte idx = 7; idx < strlen(rx_buffer); idx++)
+      //+CLCC: <id>,<dir>,<stat>,<mode>,<mpty>,<number>,<type>
+      char *direction = sim800_csv_field (&rx_buffer[7], 1);
+      char *status = sim800_csv_field (&rx_buffer[7], 2);
+
+      //Only follow our own (mobile originated) calls, and ones we've answered
+      if ((direction != NULL) && (status != NULL) && ((*direction == '0') || (call_answered == true)) &&
+          (call_in_progress() == true))
       {
-        if (rx_buffer[idx] == ',') rx_buffer[idx] = '\0';      
+        update_call_state (*status);
       }
+      break;
+    }
 
-      strcpy(stored_caller_id, (char *)&rx_buffer[7]);
-
-      if (strlen(stored_caller_id) == 2)
+    case URC_NO_CARRIER :
+      if (call_action == CALL_IGNORE)
       {
-        strcpy_P (stored_caller_id, PSTR("\"UNKNOWN\""));
+        //The ignored caller has given up
+        incoming_call_ring_time = 0;
+        call_action = CALL_UNDECIDED;
       }
-      
-      DebugPrint (F("URC=RING "));
-      DebugPrintln (stored_caller_id);    
-    }       
-  }
-  else if (strstr_P(rx_buffer, PSTR("+CMTI: \"SM\"")) != NULL)
-  {
-    DebugPrintln (F("URC=SMS"));
-  }
-  else if ((initialised == true) &&
-           ((strstr_P(rx_buffer, PSTR("SMS Ready")) != NULL) ||
-            (strstr_P(rx_buffer, PSTR("Call Ready")) != NULL)))
-  {
-    //The GSM Module has restarted... re-initialise
-    DebugPrintln (F("URC=REBOOT"));
-    gsm_resets++;
-    initialised = false;
-  }  
-  else if (strstr_P(rx_buffer, PSTR("CLOSED")) != NULL)
-  {
-    website_connected = false;   
+      else if ((call_answered == true) && (call_in_progress() == true))
+      {
+        //The caller hung up (in case +CLCC reports are off)
+        update_call_state ('6');
+      }
+      break;
+#endif
+
+#if SIM800_ENABLE_SMS
+    case URC_SMS :
+      LogInfo (TR_URC_SMS, &rx_buffer[12]);
+
+      //+CMTI: "SM",<index>
+      events.push (EV_SMS_RECEIVED, &rx_buffer[12]);
+      break;
+#endif
+
+    case URC_READY :
+      if (strstr_P(rx_buffer, PSTR("SMS Ready")) != NULL) sms_ready_seen = true;
+
+      //The second of the pair belongs to the reboot already handled
+      if ((reboot_announced == true) && ((millis() - reboot_time) < REBOOT_READY_WINDOW_MS)) break;
+
+      if (initialised == false) break;
+
+      //The GSM Module has restarted... re-initialise
+      LogInfo (TR_URC_REBOOT, 0u);
+      gsm_resets++;
+      initialised = false;
+      module_rebooted = true;
+      reboot_announced = true;
+      reboot_time = millis();
+      sms_ready_seen = (strstr_P(rx_buffer, PSTR("SMS Ready")) != NULL);
+
+#if SIM800_ENABLE_GPRS
+      //Any open socket was lost with the reboot
+      website_connected = false;
+#endif
+
+      events.push (EV_MODULE_REBOOT, NULL);
+
+#if SIM800_ENABLE_VOICE
+      //...as was any call
+      if (call_in_progress() == true) update_call_state ('6');
+#endif
+      break;
+
+#if SIM800_ENABLE_GPRS
+    case URC_CLOSED :
+      website_connected = false;   
+
+      events.push (EV_SOCKET_CLOSED, NULL);
+      break;
+#endif
   }
 }
 //==================================================================================
@@ -389,61 +1843,187 @@ void SIM800_Control::let_terminal_settle (void)
   //Settle for 150ms
   for (byte delay_cnt = 0; delay_cnt < 15; delay_cnt++)
   {
-    if (call_when_idle) call_when_idle();
+    idle();
     delay(10);    
   }
 
   //Clear anything from the receive buffer to ensure we capture the correct reply
   while (check_for_response() == BS_DATA)
   {
-    process_urc();
+    process_urc(true);
   }  
 }
 //==================================================================================
 //==================================================================================
-void SIM800_Control::send_command (const __FlashStringHelper *cmd_string)
+void SIM800_Control::enable_flow_control (byte rts_output_pin, byte cts_input_pin)
 {
-  let_terminal_settle();
-  
-  if (strlen_P((PGM_P)cmd_string) <= TX_BUFFER_SIZE)
-  {
-    strcpy_P (tx_buffer, (PGM_P)cmd_string);
+  rts_pin = rts_output_pin;
+  cts_pin = cts_input_pin;
+
+  //Leave the module free to send until AT+IFC is confirmed (it would hold
+  //back the OK otherwise); from then on RTS is only low while reading
+  pinMode (rts_pin, OUTPUT);
+  digitalWrite (rts_pin, LOW);
+  pinMode (cts_pin, INPUT);
+
+  //AT+IFC=2,2 - RTS/CTS hardware flow control in both directions (one of
+  //the start-up steps from now on, as AT&F and a reboot turn it off)
+  enable_features (SIM800_FEATURE_FLOW_CONTROL);
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::drop_flow_control (void)
+{
+  //Until AT+IFC is confirmed again, leave the module free to send
+  if (flow_control == true) digitalWrite (rts_pin, LOW);
+
+  flow_control = false;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::set_rts (bool pause)
+{
+  if (flow_control == false) return;
 
-    //Send the required command
-    DebugPrint (F("TxC: "));
-    DebugPrintln (tx_buffer);
-    Sim800_Serial.print (tx_buffer);
-    Sim800_Serial.print (F("\r\n"));
+  //RTS high asks the module to pause
+  digitalWrite (rts_pin, (pause == true) ? HIGH : LOW);
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::idle (void)
+{
+  if (call_when_idle)
+  {
+    //Nothing is reading while the callback runs
+    set_rts (true);
+    call_when_idle();
   }
-  else
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::transmit (char to_send)
+{
+  if (flow_control == true)
   {
-    DebugPrintln (F("F! TxCmdTooLong"));
+    //Wait (up to a second) for the module to drop CTS (it's active low) before sending
+    unsigned long wait_start = millis();
+    while ((digitalRead(cts_pin) == HIGH) && ((millis() - wait_start) < 1000))
+    {
+      idle();
+    }
   }
 
-  delay (50);
+  modem_serial.write (to_send);
+  SIM800_CAPTURE_BYTE (SIM800_CAPTURE_TX, to_send);
+  SIM800_METRICS (bytes_sent++);
 }
 //==================================================================================
 //==================================================================================
-void SIM800_Control::send_command (char *cmd_string)
+void SIM800_Control::transmit (const char *to_send)
 {
-  let_terminal_settle();
-  
-  if (strlen(cmd_string) <= TX_BUFFER_SIZE)
+  while (*to_send != '\0')
   {
-    strcpy (tx_buffer, cmd_string);
+    transmit (*to_send++);
+  }
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::transmit_P (PGM_P to_send)
+{
+  char next_char;
 
-    //Send the required command
-    DebugPrint (F("TxC: "));
-    DebugPrintln (tx_buffer);
-    Sim800_Serial.print (tx_buffer);
-    Sim800_Serial.print (F("\r\n"));
+  while ((next_char = (char)pgm_read_byte(to_send++)) != '\0')
+  {
+    transmit (next_char);
   }
-  else
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::send_command (const __FlashStringHelper *cmd_string)
+{
+  command_start();
+  command_add (cmd_string);
+  command_end();
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::send_command (char *cmd_string)
+{
+  command_start();
+  command_add (cmd_string);
+  command_end();
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::command_start (bool blocking)
+{
+  //refresh_slice() can't wait; it reads the replies as they come
+  if (blocking == true) let_terminal_settle();
+
+#if SIM800_COMMAND_HEAD_SIZE > 0
+  command_head_length = 0;
+  command_head[0] = '\0';
+#endif
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::command_add (char value)
+{
+  //Commands go straight out as they're built; only the start is kept (for
+  //the metrics and the trace)
+  transmit (value);
+
+#if SIM800_COMMAND_HEAD_SIZE > 0
+  if (command_head_length < (SIM800_COMMAND_HEAD_SIZE - 1))
+  {
+    command_head[command_head_length++] = value;
+    command_head[command_head_length] = '\0';
+  }
+#endif
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::command_add (const char *text)
+{
+  while (*text != '\0')
+  {
+    command_add (*text++);
+  }
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::command_add (const __FlashStringHelper *fragment)
+{
+  PGM_P next_char = (PGM_P)fragment;
+  char value;
+
+  while ((value = (char)pgm_read_byte(next_char++)) != '\0')
   {
-    DebugPrintln (F("F! TxCmdTooLong"));
+    command_add (value);
   }
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::command_add (long value)
+{
+  char digits[12];
+
+  ltoa (value, digits, 10);
+  command_add (digits);
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::command_end (bool blocking)
+{
+  transmit ('\r');
+  transmit ('\n');
+
+#if SIM800_COMMAND_HEAD_SIZE > 0
+  LogTrace ((blocking == true) ? TR_TX_COMMAND : TR_TX_SLICE, command_head);
+  SIM800_METRICS (command_sent (command_head));
+#endif
 
-  delay (50);
+  if (blocking == true) delay (50);
 }
 //==================================================================================
 //==================================================================================
@@ -454,7 +2034,7 @@ Sim800_Buffer_State SIM800_Control::wait_for_data (const __FlashStringHelper *pa
 
   while (return_val == BS_UNKNOWN)
   {
-    if (call_when_idle) call_when_idle();
+    idle();
 
     //Check for a timeout condition
     if (millis() > (loop_start + ((unsigned long)timeoutSecs * 1000UL)))
@@ -489,6 +2069,8 @@ Sim800_Buffer_State SIM800_Control::wait_for_data (const __FlashStringHelper *pa
     }
   }
 
+  SIM800_METRICS (command_done (return_val));
+
   return return_val;
 }
 //==================================================================================
@@ -505,15 +2087,13 @@ bool SIM800_Control::connected_to_network (void)
 
   
 	Sim800_Buffer_State return_val = BS_UNKNOWN;
-	static unsigned long last_called = 0;
-	static bool net_connected = false;
 
   if (initialised == false) return false;
   
 	//Limit polls to every five seconds
-	if ((millis() - last_called) > 5000)
+	if ((millis() - network_poll_time) > 5000)
 	{
-		last_called = millis();
+		network_poll_time = millis();
     
 		send_command(F("\r\n"));
 		let_terminal_settle();
@@ -533,6 +2113,7 @@ bool SIM800_Control::connected_to_network (void)
 			{
         if (strstr_P(rx_buffer, PSTR("+CREG: 0,3")) != NULL)
         {
+          SIM800_METRICS (recoveries[RECOVER_RADIO_CYCLE]++);
           send_command(F("AT+CFUN=4"));  
           wait_for_status(15 * SECONDS);
           wait_for_status(5 * SECONDS);
@@ -550,7 +2131,7 @@ bool SIM800_Control::connected_to_network (void)
 		return_val = wait_for_status(5 * SECONDS);
 		if (return_val != BS_OK)
 		{
-			DebugPrintln (PROTO_FAILURE_STR);
+			LogProtocolFailure();
 			protocol_error_count++; 
 			return false;
 		}
@@ -602,15 +2183,13 @@ byte SIM800_Control::get_signal_bars (void)
 byte SIM800_Control::get_rssi (void)
 {
   Sim800_Buffer_State return_val = BS_UNKNOWN;
-  static unsigned long last_called = 0;
-  static byte recvd_rssi = 0;
 
   if (initialised == false) return 0;
   
   //Limit polls to once a second
-  if ((millis() - last_called) > 10000)
+  if ((millis() - rssi_poll_time) > 10000)
   {
-    last_called = millis();
+    rssi_poll_time = millis();
     
     send_command(F("\r\n"));
     let_terminal_settle();
@@ -620,62 +2199,67 @@ byte SIM800_Control::get_rssi (void)
 
     if (wait_for_data(F("+CSQ: "), 5 * SECONDS) == BS_DATA)
     {
-      for (byte idx = 6; idx < strlen(rx_buffer); idx++)
-      {
-        if (rx_buffer[idx] == ',') rx_buffer[idx] = '\0';      
-      }
-
-      recvd_rssi = atoi((char *)&rx_buffer[6]);           
+      //+CSQ: <rssi>,<ber>
+      last_rssi = atoi (sim800_csv_cut (&rx_buffer[6]));
     }
 
     return_val = wait_for_status(5 * SECONDS);
     if (return_val != BS_OK)
     {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       return 0;
     }
   }
   
-  return recvd_rssi;
+  return last_rssi;
 }
+
+#if SIM800_ENABLE_SMS
 //==================================================================================
 //==================================================================================
 bool SIM800_Control::send_sms_from_buffer (char *sms_dest_number)
 {  
   if (initialised == false) return false;
 
+  if (enable_features(SIM800_FEATURE_SMS) == false) return false;
+
   bool message_sent = false;
 
-  //Attempt the send three times before giving up
-  for (byte retries = 0; ((retries < 3) && (message_sent == false)); retries++)
+  //Keep any USSD reply still to come out of the message
+  message_owner = MESSAGE_SMS;
+
+  //Attempt the send three times before giving up (or until the module reboots)
+  for (byte retries = 0; ((retries < 3) && (message_sent == false) && (initialised == true)); retries++)
   {
-    if (call_when_idle) call_when_idle();
+    idle();
     
     send_command(F("\r\n"));
     let_terminal_settle();
     
-    char temp_cmd[30];
-    memset (&temp_cmd, 0, sizeof(char) * 30);
-    strcpy_P (temp_cmd, PSTR("AT+CMGS=\""));
-    strcpy (&temp_cmd[9], sms_dest_number);
-    temp_cmd[9 + strlen(sms_dest_number)] = '\"';
-    
-    send_command (temp_cmd);
+    command_start();
+    command_add (F("AT+CMGS=\""));
+    command_add (sms_dest_number);
+    command_add ('\"');
+    command_end();
   
     send_command (sms_buffer);
     
-    temp_cmd[0] = char(26);
-    temp_cmd[1] = '\0';  
-    send_command (temp_cmd);
+    //CTRL+Z
+    send_command (F("\x1A"));
   
     if (wait_for_status(60 * SECONDS) == BS_OK)
     {
       message_sent = true;
       clear_sms_buffer();
+      message_owner = MESSAGE_FREE;
+
+      if (time_to_first_sms == 0) time_to_first_sms = millis() - init_started;
     }  
     else
     {
+      LogProtocolFailure();
+      protocol_error_count++;
       message_sent = false;
     }
   }
@@ -683,11 +2267,16 @@ bool SIM800_Control::send_sms_from_buffer (char *sms_dest_number)
   
   return message_sent;
 }
+#endif
+
+#if SIM800_ENABLE_VOICE
 //==================================================================================
 //==================================================================================
 bool SIM800_Control::call_number (char *dest_number)
 {
   if (initialised == false) return false;
+
+  if (enable_features(SIM800_FEATURE_VOICE) == false) return false;
   
   Sim800_Buffer_State return_val = BS_UNKNOWN;
   bool call_completed = false;
@@ -695,18 +2284,16 @@ bool SIM800_Control::call_number (char *dest_number)
   send_command(F("\r\n"));
   let_terminal_settle();
   
-  char temp_cmd[30];
-  memset (&temp_cmd, 0, sizeof(char) * 30);
-  strcpy_P (temp_cmd, PSTR("ATD "));
-  strcpy (&temp_cmd[4], dest_number);
-  temp_cmd[4 + strlen(dest_number)] = ';';
-  
-  send_command (temp_cmd);
+  command_start();
+  command_add (F("ATD "));
+  command_add (dest_number);
+  command_add (';');
+  command_end();
   
   if (wait_for_status(20 * SECONDS) != BS_OK)
   {
     send_command (F("ATH"));
-    DebugPrintln (F("F! CallInit"));      
+    LogError (TR_CALL_INIT_FAIL, 0u);
     return false;
   }  
 
@@ -725,19 +2312,10 @@ bool SIM800_Control::call_number (char *dest_number)
     return_val = wait_for_data(F("+CLCC:"), 5 * SECONDS);        
     if (return_val == BS_DATA)
     {
-      byte csv_token = 0;
-      byte token_start = 0;
-      for (byte idx = 6; idx < strlen(rx_buffer); idx++)
-      {
-        if (rx_buffer[idx] == ',') 
-        {
-          csv_token++;
-          if (csv_token == 2) token_start = idx+1;
-          if (csv_token == 3) rx_buffer[idx] = '\0'; 
-        }
-      }
+      //+CLCC: <id>,<dir>,<stat>,...
+      char *status = sim800_csv_field (&rx_buffer[6], 2);
   
-      switch (rx_buffer[token_start])
+      switch ((status != NULL) ? *status : '\0')
       {
         case '0' :        //Active
         case '1' :        //Held
@@ -762,7 +2340,7 @@ bool SIM800_Control::call_number (char *dest_number)
     }
     else if (return_val == BS_ERROR)
     {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       call_complete = true;
       call_successful = false;
@@ -771,37 +2349,144 @@ bool SIM800_Control::call_number (char *dest_number)
 	//Non-blocking wait for 500ms
 	for (byte wait = 0; wait < 50; wait++)
 	{
-		if (call_when_idle) call_when_idle();
+		idle();
 		delay(10);
 	}
   }
   
-  //Hangup the call
+  //Hangup the call
+  send_command (F("ATH"));
+  if (wait_for_status(20 * SECONDS) != BS_OK)
+  {
+    LogProtocolFailure();
+    protocol_error_count++; 
+    call_successful = false;
+  }  
+
+  return call_successful;    
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::dial_number (char *dest_number)
+{
+  if (initialised == false) return false;
+  if (call_in_progress() == true) return false;
+
+  if (enable_features(SIM800_FEATURE_VOICE | SIM800_FEATURE_CALL_STATE) == false) return false;
+
+  send_command(F("\r\n"));
+  let_terminal_settle();
+  
+  //Set the state first, as the first +CLCC can arrive before the OK
+  call_state = CS_DIALLING;
+  dial_time = millis();
+  events.push (EV_CALL_DIALLING, dest_number);
+
+  command_start();
+  command_add (F("ATD "));
+  command_add (dest_number);
+  command_add (';');
+  command_end();
+  
+  if (wait_for_status(20 * SECONDS) != BS_OK)
+  {
+    LogError (TR_CALL_INIT_FAIL, 0u);
+    hang_up();
+    return false;
+  }  
+
+  return true;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::hang_up (void)
+{
+  bool hung_up = true;
+
+  //ATH - Hang-up / disconnect the call
   send_command (F("ATH"));
   if (wait_for_status(20 * SECONDS) != BS_OK)
   {
-    DebugPrintln (PROTO_FAILURE_STR);
+    LogProtocolFailure();
     protocol_error_count++; 
-    call_successful = false;
+    hung_up = false;
   }  
 
-  return call_successful;    
+  //No +CLCC is reported for a call that was never set up, so release it here
+  if (call_in_progress() == true) update_call_state('6');
+
+  return hung_up;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::update_call_state (char clcc_status)
+{
+  byte new_state = call_state;
+  byte new_event = EV_NONE;
+
+  switch (clcc_status)
+  {
+    case '2' :        //Dialling
+               new_state = CS_DIALLING;
+               new_event = EV_CALL_DIALLING;
+               break;
+    case '3' :        //Alerting (ringing at the far end)
+               new_state = CS_RINGING;
+               new_event = EV_CALL_RINGING;
+               break;
+    case '0' :        //Active
+    case '1' :        //Held
+               new_state = CS_ACTIVE;
+               new_event = EV_CALL_ACTIVE;
+               break;
+    case '6' :        //Disconnected
+               new_state = CS_RELEASED;
+               new_event = EV_CALL_RELEASED;
+               break;
+  }
+
+  if (new_state == CS_RELEASED) call_answered = false;
+
+  if (new_state != call_state)
+  {
+    call_state = new_state;
+    events.push (new_event, NULL);
+  }
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::note_call_answered (void)
+{
+  //From here it's followed (and limited) like one of our own
+  call_answered = true;
+  answer_time = millis();
+  update_call_state ('0');
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::answered_call_overdue (void)
+{
+  return ((call_answered == true) && (call_state == CS_ACTIVE) &&
+          ((millis() - answer_time) > (SIM800_ANSWERED_CALL_MAX_S * 1000UL)));
 }
+#endif
+
+#if SIM800_ENABLE_SMS
 //==================================================================================
 //==================================================================================
 bool SIM800_Control::sms_available (void)
 {
   Sim800_Buffer_State return_val = BS_UNKNOWN;
-  static unsigned long last_called = 0;
-  static byte consecutive_errors = 0;
   bool sms_store_populated = false;
 
   if (initialised == false) return false;
+
+  if (enable_features(SIM800_FEATURE_SMS) == false) return false;
   
   //Limit polls to once a second
-  if ((millis() - last_called) > 1000)
+  if ((millis() - sms_poll_time) > 1000)
   {
-    last_called = millis();
+    sms_poll_time = millis();
     
     send_command(F("\r\n"));
     let_terminal_settle();
@@ -812,32 +2497,32 @@ bool SIM800_Control::sms_available (void)
     return_val = wait_for_data(F("+CMGL:"), 20 * SECONDS);
     if (return_val == BS_DATA)
     {
-      consecutive_errors = 0;
+      sms_consecutive_errors = 0;
       sms_store_populated = true;
       if (wait_for_status(20 * SECONDS) != BS_OK)
       {
         //Protocol error
-        DebugPrintln (PROTO_FAILURE_STR);
+        LogProtocolFailure();
         protocol_error_count++; 
       }
     }
     else if (return_val == BS_OK)
     {
-      consecutive_errors = 0;
+      sms_consecutive_errors = 0;
       sms_store_populated = false;      
     }
     else
     {
       //protocol error
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
 
       //If this command keeps erroring, then restart the GSM module
       //as it's likely to have warmstarted
-      consecutive_errors++;
-      if (consecutive_errors > 5)
+      sms_consecutive_errors++;
+      if (sms_consecutive_errors > 5)
       {
-        consecutive_errors = 0;
+        sms_consecutive_errors = 0;
         gsm_resets++;
         initialised = false;
       }      
@@ -854,6 +2539,8 @@ bool SIM800_Control::get_pending_sms (char (*sms_id)[4])
   memset (sms_id, 0, sizeof(char) * 4);
   
   if (initialised == false) return false;
+
+  if (enable_features(SIM800_FEATURE_SMS) == false) return false;
       
   send_command(F("\r\n"));
   let_terminal_settle();
@@ -864,34 +2551,21 @@ bool SIM800_Control::get_pending_sms (char (*sms_id)[4])
   return_val = wait_for_data(F("+CMGL:"), 20 * SECONDS);
   if (return_val == BS_DATA)
   {
-    //Extract the caller id
+    //Extract the message id and the caller id
     //+CMGL: 1,"REC UNREAD","+447881554465","","19/04/23,15:17:24+04"
-    byte csv_token = 0;
-    byte token_start = 0;
-    for (byte idx = 7; idx < strlen(rx_buffer); idx++)
+    char *caller = sim800_csv_field (&rx_buffer[7], 2);
+
+    if (caller != NULL)
     {
-      if (rx_buffer[idx] == ',') 
-      {
-        csv_token++;
-        if (csv_token == 1) 
-        {
-          strncpy (*sms_id, ((char *)&rx_buffer[7]), idx-7);
-          DebugPrintln (*sms_id);
-        }
-        else if (csv_token == 2) 
-        {
-          token_start = idx+1;
-        }
-        else if (csv_token == 3) 
-        {
-          rx_buffer[idx] = '\0'; 
-        }
-      }
+      strncpy (stored_caller_id, sim800_csv_cut (caller), MAX_CALLER_ID_SIZE - 1);
+      stored_caller_id[MAX_CALLER_ID_SIZE - 1] = '\0';
     }
-    
-    strncpy (stored_caller_id, (char *)&rx_buffer[token_start], MAX_CALLER_ID_SIZE);
+
+    strncpy (*sms_id, sim800_csv_cut (&rx_buffer[7]), 3);
+    LogTrace (TR_SMS_ID, *sms_id);
     
 	  //Store the message
+    message_owner = MESSAGE_SMS;
     return_val = wait_for_data(F(""), 20 * SECONDS);
     if (return_val == BS_DATA)
     {
@@ -899,82 +2573,17 @@ bool SIM800_Control::get_pending_sms (char (*sms_id)[4])
     }
 
     //Attempt to spot and decode UCS2 encoded messages (mostly from Lebara)
-    byte start_offset = 255;
-
-    if (((stored_caller_id[1] == 'p') || ((stored_caller_id[1] != '+') && (stored_caller_id[1] != '0'))) &&
-        (strlen(sms_buffer) >= 14))
+    if ((stored_caller_id[1] == 'p') || ((stored_caller_id[1] != '+') && (stored_caller_id[1] != '0')))
     {           
-      for (byte idx = 0; ((idx < 8) && (start_offset == 255)) ; idx++)
-      {
-        if ((sms_buffer[idx] == '0') && (sms_buffer[idx+1] == '0') && (sms_buffer[idx+2] != '0') && 
-            (sms_buffer[idx+4] == '0') && (sms_buffer[idx+5] == '0') && (sms_buffer[idx+6] != '0'))
-        {
-          start_offset = idx;
-        }
-      }            
-    }
-
-    if (start_offset != 255)
-    { 
-      byte ascii_val = 0;
-      byte start_idx = 0;
-      byte decoded_length = strlen(sms_buffer) - start_offset;
-      decoded_length = (decoded_length - (decoded_length % 4)) / 4;
+      byte start_offset = sim800_find_ucs2 (sms_buffer);
 
-    
-      for (byte idx = 0; idx < decoded_length; idx++)
-      {
-        start_idx = (idx * 4) + start_offset;
-    
-//        Serial.print ((char)sms_buffer[start_idx]);
-//        Serial.print ((char)sms_buffer[start_idx+1]);
-//        Serial.print ((char)sms_buffer[start_idx+2]);
-//        Serial.print ((char)sms_buffer[start_idx+3]);
-//        Serial.print (" : ");
-        
-        if ((sms_buffer[start_idx] == '0') &&
-            (sms_buffer[start_idx+1] == '0') &&
-            ((((int)sms_buffer[start_idx+2] >= 0x30) && ((int)sms_buffer[start_idx+2] <= 0x39)) || (((int)sms_buffer[start_idx+2] >= 0x41) && ((int)sms_buffer[start_idx+2] <= 0x46))) &&
-            ((((int)sms_buffer[start_idx+3] >= 0x30) && ((int)sms_buffer[start_idx+3] <= 0x39)) || (((int)sms_buffer[start_idx+3] >= 0x41) && ((int)sms_buffer[start_idx+3] <= 0x46))))        
-        {
-            
-          if ((int)sms_buffer[start_idx+2] >= 0x41) //A-F
-          {
-            ascii_val = ((int)sms_buffer[start_idx+2] - 55) << 4;        
-          }
-          else //0-9
-          {
-            ascii_val = ((int)sms_buffer[start_idx+2] - 48) << 4;
-          }
-          
-          if ((int)sms_buffer[start_idx+3] >= 0x41) //A-F
-          {
-            ascii_val = ascii_val + ((int)sms_buffer[start_idx+3] - 55);        
-          }
-          else //0-9
-          {
-            ascii_val = ascii_val + ((int)sms_buffer[start_idx+3] - 48);
-          }      
-    
-          //Serial.print ((int)ascii_val);
-          //Serial.print (" : ");
-          sms_buffer[idx] = (char)ascii_val;
-        }
-        else
-        {
-          sms_buffer[idx] = '*';
-        }
-    
-        //Serial.println (sms_buffer[idx]);
-      }
-  
-      sms_buffer[decoded_length] = '\0';    
+      if (start_offset != SIM800_NOT_UCS2) sim800_decode_ucs2 (sms_buffer, start_offset);
     }
 
     if (wait_for_status(20 * SECONDS) != BS_OK)
     {
       //Protocol error
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
     }
   }
@@ -985,7 +2594,7 @@ bool SIM800_Control::get_pending_sms (char (*sms_id)[4])
   else
   {
     //protocol error
-    DebugPrintln (PROTO_FAILURE_STR);
+    LogProtocolFailure();
     protocol_error_count++; 
   }
 
@@ -996,86 +2605,413 @@ bool SIM800_Control::get_pending_sms (char (*sms_id)[4])
 void SIM800_Control::delete_sms (char *sms_id)
 {
   if (initialised == false) return;
+
+  if (enable_features(SIM800_FEATURE_SMS) == false) return;
   
   Sim800_Buffer_State return_val = BS_UNKNOWN;
 
   send_command(F("\r\n"));
   let_terminal_settle();
   
-  char temp_cmd[30];
-  memset (&temp_cmd, 0, sizeof(char) * 30);
-  strcpy (temp_cmd, "AT+CMGD=");
-  strcpy (&temp_cmd[8], sms_id);
-  
-  send_command (temp_cmd);
+  command_start();
+  command_add (F("AT+CMGD="));
+  command_add (sms_id);
+  command_end();
   
   if (wait_for_status(10 * SECONDS) != BS_OK)
   {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       return;
   }  
   
 }
+#endif
+
+#if SIM800_ENABLE_USSD
 //==================================================================================
 //==================================================================================
-bool SIM800_Control::put_balance_in_sms_buffer (void)
+bool SIM800_Control::send_ussd (const char *ussd_code)
 {
   if (initialised == false) return false;
-  
-  Sim800_Buffer_State return_val = BS_UNKNOWN;
+  if ((ussd_state == USSD_WAITING) || (ussd_state == USSD_RECEIVING)) return false;
+  if (strlen(ussd_code) > SIM800_USSD_CODE_SIZE) return false;
 
-  clear_sms_buffer();
+#if SIM800_ENABLE_SMS
+  //The reply would go over a message that hasn't been sent (or dealt with) yet
+  if ((message_owner == MESSAGE_SMS) && (sms_buffer[0] != '\0')) return false;
+#endif
+
+  if (enable_features(SIM800_FEATURE_USSD) == false) return false;
 
   send_command(F("\r\n"));
   let_terminal_settle();
 
-  send_command (F("ATD *#1345#;"));
-  
-  if (wait_for_status(20 * SECONDS) != BS_OK)
+  //The reply can come in before the OK, so be ready for it
+  message_owner = MESSAGE_USSD;
+  memset (&ussd_response, 0, sizeof(char) * SIM800_USSD_BUFFER_SIZE);
+  ussd_state = USSD_WAITING;
+  ussd_request_time = millis();
+
+  //AT+CUSD=1,"<code>" - Send the request (or the reply to an open session)
+  command_start();
+  command_add (F("AT+CUSD=1,\""));
+  command_add (ussd_code);
+  command_add ('\"');
+  command_end();
+
+  if (wait_for_status(10 * SECONDS) != BS_OK)
   {
-      DebugPrintln (PROTO_FAILURE_STR);
-      protocol_error_count++; 
-      return false;
+    LogProtocolFailure();
+    protocol_error_count++; 
+    ussd_state = USSD_FAILED;
+    return false;
   }  
-  
-  if (wait_for_status(20 * SECONDS) != BS_OK)
+
+  return true;
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::cancel_ussd (void)
+{
+  if (initialised == false) return false;
+
+  //AT+CUSD=2 - End the session
+  send_command(F("AT+CUSD=2"));
+
+  ussd_state = USSD_IDLE;
+  return (wait_for_status(5 * SECONDS) == BS_OK);
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::stream_ussd_byte (char incoming)
+{
+  //The DCS only comes after the text, so while the text is all hex each group of
+  //4 digits is decoded as it arrives, and marked with the top bit (the module only
+  //sends 7 bit text) so decode_ussd_text() can put it back if it wasn't UCS2 after
+  //all.  Characters outside ASCII stay as hex.  Returns true if it's taken <incoming>
+  if (ussd_streaming == false)
   {
-      DebugPrintln (PROTO_FAILURE_STR);
-      protocol_error_count++; 
+    //The text starts at the first quote of a +CUSD line
+    if ((incoming == '\"') && (rx_buff_pos >= 7) && (strncmp_P (rx_buffer, PSTR("+CUSD: "), 7) == 0) &&
+        (memchr (rx_buffer, '\"', rx_buff_pos) == NULL))
+    {
+      ussd_streaming = true;
+      ussd_group_length = 0;
+      ussd_group[0] = '\0';
+      ussd_split_digits = 0;
+    }
+
+    return false;
+  }
+
+  if ((incoming == char(13)) || (incoming == char(10)))
+  {
+    //The text goes on over the next line, which may break a character; that
+    //one stays as hex either side of the break
+    if (ussd_group_length > 0)
+    {
+      frame_ussd_text (ussd_group);
+      ussd_split_digits = 4 - ussd_group_length;
+      ussd_group_length = 0;
+      ussd_group[0] = '\0';
+    }
+
+    return false;
+  }
+
+  if ((rx_buff_pos == 0) && (ussd_state != USSD_RECEIVING))
+  {
+    //The reply was dealt with (or given up on) without its text ending
+    ussd_streaming = false;
+    return false;
+  }
+
+  if (((incoming >= '0') && (incoming <= '9')) || ((incoming >= 'A') && (incoming <= 'F')))
+  {
+    if (ussd_split_digits > 0)
+    {
+      ussd_split_digits--;
       return false;
-  }  
+    }
 
-  return_val = wait_for_data(F("+CUSD:"), 60 * SECONDS);
-  if (return_val == BS_DATA)
+    ussd_group[ussd_group_length++] = incoming;
+    ussd_group[ussd_group_length] = '\0';
+    if (ussd_group_length < 4) return true;
+
+    char decoded[5];
+    strcpy (decoded, ussd_group);
+    sim800_decode_ucs2 (decoded, 0);
+
+    if ((ussd_group[0] == '0') && (ussd_group[1] == '0') && ((byte)decoded[0] > 0) && ((byte)decoded[0] < 0x80))
+    {
+      ussd_line_decoded = true;
+      decoded[0] |= 0x80;
+      frame_ussd_text (decoded);
+    }
+    else
+    {
+      frame_ussd_text (ussd_group);
+    }
+
+    ussd_group_length = 0;
+    ussd_group[0] = '\0';
+    return true;
+  }
+
+  //The closing quote, or text that isn't hex: what's held goes in as it came
+  ussd_streaming = false;
+  frame_ussd_text (ussd_group);
+
+  ussd_group_length = 0;
+  ussd_group[0] = '\0';
+  return false;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::frame_ussd_text (const char *text)
+{
+  for (; *text != '\0'; text++) sim800_frame_byte (rx_buffer, &rx_buff_pos, RX_BUFFER_SIZE, *text);
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::store_ussd_text (const char *text)
+{
+  byte stored = strlen(ussd_response);
+
+  //Anything that doesn't fit is lost, but the text always ends in a terminator
+  while ((*text != '\0') && (stored < (SIM800_USSD_BUFFER_SIZE - 1)))
+  {
+    ussd_response[stored++] = *text++;
+  }
+
+  ussd_response[stored] = '\0';
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::decode_ussd_text (bool ucs2)
+{
+  char *source = ussd_response;
+
+  if (ucs2 == true)
   {
-    byte quote_start = 0;
-    for (byte idx = 7; idx < strlen(rx_buffer); idx++)
+    //Clear the marks, and decode what's still hex (the line breaks aren't part of it)
+    char *decoded = ussd_response;
+    char group[5];
+    byte held = 0;
+
+    for (; *source != '\0'; source++)
     {
-      if (rx_buffer[idx] == '\"') 
+      if (((byte)*source & 0x80) != 0)
+      {
+        *decoded++ = (char)((byte)*source & 0x7F);
+      }
+      else if (*source != '\n')
       {
-        if (quote_start == 0) quote_start = idx + 1;
-        else rx_buffer[idx] = '\0';  
+        group[held++] = *source;
+        if (held < 4) continue;
+
+        group[4] = '\0';
+        sim800_decode_ucs2 (group, 0);
+        *decoded++ = group[0];
+        held = 0;
       }
     }
 
-    strcpy (sms_buffer, &rx_buffer[quote_start]);
+    *decoded = '\0';
+    return;
+  }
+
+  //Not UCS2: the marked characters go back to the hex they came as, as far as it fits
+  byte length = 0;
 
-    Serial.println ("DONE");
+  for (; *source != '\0'; source++)
+  {
+    byte needed = (((byte)*source & 0x80) != 0) ? 4 : 1;
+    if ((length + needed) > (SIM800_USSD_BUFFER_SIZE - 1)) break;
+    length += needed;
   }
-  else
+
+  char *encoded = &ussd_response[length];
+  *encoded = '\0';
+
+  while (source > ussd_response)
   {
-    return false;
+    byte next = (byte)*--source;
+
+    if ((next & 0x80) != 0)
+    {
+      next &= 0x7F;
+      *--encoded = pgm_read_byte (&HEX_DIGITS[next & 0x0F]);
+      *--encoded = pgm_read_byte (&HEX_DIGITS[next >> 4]);
+      *--encoded = '0';
+      *--encoded = '0';
+    }
+    else
+    {
+      *--encoded = (char)next;
+    }
+  }
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::ussd_dcs_is_ucs2 (const char *after_text)
+{
+  //,<dcs> follows the closing quote (no DCS means the GSM 7 bit default).  The
+  //coding groups of 3GPP TS 23.038 that carry UCS2 (sent as hex) are:
+  //  0001 0001        - UCS2, preceded by the language
+  //  01xx 10xx        - general data coding (e.g. 72)
+  //  1001 10xx        - message with a user data header
+  //everything else is GSM 7 bit or 8 bit data
+  if (after_text[0] != ',') return false;
+
+  byte dcs = atoi(&after_text[1]);
+
+  if (dcs == 0x11) return true;
+  if ((dcs & 0xC0) == 0x40) return ((dcs & 0x0C) == 0x08);
+  if ((dcs & 0xF0) == 0x90) return ((dcs & 0x0C) == 0x08);
+
+  return false;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::finish_ussd (char status)
+{
+  //<n>: 0 = done, 1 = network wants a reply, 2 = ended by the network
+  if (status == '1') ussd_state = USSD_AWAITING_REPLY;
+  else if ((status == '0') || (status == '2')) ussd_state = USSD_COMPLETE;
+  else ussd_state = USSD_FAILED;
+
+  LogInfo (TR_URC_USSD, ussd_response);
+
+  events.push ((ussd_state == USSD_FAILED) ? EV_USSD_FAILED : EV_USSD_RESPONSE, NULL);
+}
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::ussd_reply_displaced (void)
+{
+  bool request_pending = ((ussd_state == USSD_WAITING) || (ussd_state == USSD_RECEIVING));
+
+#if SIM800_ENABLE_SMS
+  if ((message_owner == MESSAGE_SMS) && ((request_pending == true) || (sms_buffer[0] != '\0')))
+  {
+    //An SMS has the buffer now; the reply (or notification) has nowhere to go
+    LogError (TR_USSD_DISPLACED, 0u);
+    if (request_pending == true)
+    {
+      ussd_state = USSD_FAILED;
+      events.push (EV_USSD_FAILED, NULL);
+    }
+    return true;
+  }
+#endif
+
+  if (request_pending == false)
+  {
+    //A notification the network sent unasked, and the buffer is free
+    message_owner = MESSAGE_USSD;
+    ussd_request_time = millis();
+  }
+
+  return false;
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::process_ussd (void)
+{
+  //+CUSD: <n>[,"<str>",<dcs>]
+  char *text_start = strchr (rx_buffer, '\"');
+  char *text_end = NULL;
+
+  if (ussd_reply_displaced() == true) return;
+
+  ussd_status = rx_buffer[7];
+  memset (&ussd_response, 0, sizeof(char) * SIM800_USSD_BUFFER_SIZE);
+
+  if (text_start == NULL)
+  {
+    finish_ussd (ussd_status);
+    return;
+  }
+
+  text_start++;
+  text_end = strrchr (text_start, '\"');
+
+  if (text_end == NULL)
+  {
+    //The text runs over several lines; collect the rest as it arrives
+    store_ussd_text (text_start);
+    ussd_state = USSD_RECEIVING;
+    return;
+  }
+
+  *text_end = '\0';
+
+  store_ussd_text (text_start);
+  decode_ussd_text (ussd_dcs_is_ucs2 (&text_end[1]));
+  finish_ussd (ussd_status);
+}
+//==================================================================================
+//==================================================================================
+void SIM800_Control::process_ussd_continuation (void)
+{
+  char *text_end = strrchr (rx_buffer, '\"');
+
+  if (ussd_reply_displaced() == true) return;
+
+  if (text_end != NULL) *text_end = '\0';
+
+  if (strlen(ussd_response) > 0) store_ussd_text ("\n");
+  store_ussd_text (rx_buffer);
+
+  if (text_end == NULL) return;
+
+  //The DCS comes after the last line, which settles what the text was
+  decode_ussd_text (ussd_dcs_is_ucs2 (&text_end[1]));
+  finish_ussd (ussd_status);
+}
+#endif
+
+#if SIM800_ENABLE_USSD && SIM800_ENABLE_SMS
+//==================================================================================
+//==================================================================================
+bool SIM800_Control::put_balance_in_sms_buffer (void)
+{
+  //The caller wants the balance in the buffer, in place of anything there
+  clear_sms_buffer();
+
+  if (send_ussd("*#1345#") == false) return false;
+
+  //Wait for the network to answer
+  while ((ussd_state == USSD_WAITING) || (ussd_state == USSD_RECEIVING))
+  {
+    idle();
+
+    if ((millis() - ussd_request_time) > 60000UL)
+    {
+      ussd_state = USSD_FAILED;
+    }
+    else if (check_for_response() == BS_DATA)
+    {
+      process_urc();
+    }
   }
 
+  if (ussd_state == USSD_FAILED) return false;
+
+  //The reply is already in ::sms_buffer (they're the same memory)
+  message_owner = MESSAGE_SMS;
+  ussd_state = USSD_IDLE;
+
   return true;
 }
+#endif
+
+#if SIM800_ENABLE_GPRS
 //==================================================================================
 //==================================================================================
 bool SIM800_Control::prep_for_web_submission (void)
 {
-  static bool hadValidGprsContext = false;
-   
   if (initialised == false) return false;
 
   website_connected = false;  
@@ -1110,10 +3046,10 @@ bool SIM800_Control::prep_for_web_submission (void)
   }
 
   //AT+CSTT - Define Network APN
-  send_command(F("AT+CSTT=\"pp.vodafone.co.uk\",\"wap\",\"wap\""));  
+  send_command(F("AT+CSTT=\"" SIM800_GPRS_APN "\",\"" SIM800_GPRS_USER "\",\"" SIM800_GPRS_PASSWORD "\""));  
   if (wait_for_status(10 * SECONDS) != BS_OK)
   {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       reset_gprs();
       return false;
@@ -1123,7 +3059,7 @@ bool SIM800_Control::prep_for_web_submission (void)
   send_command(F("AT+CIICR"));  
   if (wait_for_status(85 * SECONDS) != BS_OK)
   {
-      DebugPrintln (F("F! NetStart"));      
+      LogError (TR_NET_START_FAIL, 0u);
       reset_gprs();
       return false;
   }  
@@ -1132,16 +3068,19 @@ bool SIM800_Control::prep_for_web_submission (void)
   send_command(F("AT+CIFSR"));  
   if (wait_for_data(NULL, 2 * SECONDS) != BS_DATA)
   {
-      DebugPrintln (F("FAIL: NoIP"));
+      LogError (TR_NO_IP, 0u);
       reset_gprs();
       return false;
   }  
 
   //AT+CIPSTART - Open TCP connection to server
-  send_command(F("AT+CIPSTART=\"TCP\",\"lythamrnli.jamesamor.co.uk\",80"));  
+  command_start();
+  command_add (F("AT+CIPSTART=\"TCP\",\"" SIM800_SERVER_HOST "\","));
+  command_add ((long)SIM800_SERVER_PORT);
+  command_end();
   if (wait_for_status(75 * SECONDS) != BS_OK)
   {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       reset_gprs();
       return false;    
@@ -1150,7 +3089,7 @@ bool SIM800_Control::prep_for_web_submission (void)
   return_val = wait_for_data(F("CONNECT OK"), 75 * SECONDS);  
   if (return_val != BS_DATA)
   {
-      DebugPrintln (F("F! ServerConnect"));
+      LogError (TR_SERVER_FAIL, 0u);
       reset_gprs();
       return false;
   }  
@@ -1160,7 +3099,7 @@ bool SIM800_Control::prep_for_web_submission (void)
 
   delay (500);
   
-  hadValidGprsContext = true;
+  had_valid_gprs_context = true;
   website_connected = true;
 
   return true; 
@@ -1168,25 +3107,25 @@ bool SIM800_Control::prep_for_web_submission (void)
 }
 //==================================================================================
 //==================================================================================
-bool SIM800_Control::complete_web_submission (void)
+bool SIM800_Control::complete_web_submission (bool end_headers)
 {
   Sim800_Buffer_State return_val = BS_UNKNOWN;
   bool sendSuccess = true;
   
   website_connected = false;
 
-  send_command(F("\r\n"));
-  send_command(F("\r\n"));
+  if (end_headers == true)
+  {
+    send_command(F("\r\n"));
+    send_command(F("\r\n"));
+  }
 
-  char temp_cmd[2];
-  temp_cmd[0] = char(26); //CTRL+Z
-  temp_cmd[1] = '\0';  
-  send_command (temp_cmd);
+  send_command (F("\x1A")); //CTRL+Z
 
   return_val = wait_for_data(F("SEND OK"), 75 * SECONDS);
   if (return_val != BS_DATA)
   {    
-    DebugPrintln (F("F! SendFail"));
+    LogError (TR_SEND_FAIL, 0u);
     reset_gprs();
     return false;    
   }
@@ -1201,7 +3140,7 @@ bool SIM800_Control::complete_web_submission (void)
   }
   else
   {    
-    DebugPrintln (F("F! SiteFail"));
+    LogError (TR_SITE_FAIL, 0u);
     sendSuccess = false;
   }
 
@@ -1210,7 +3149,7 @@ bool SIM800_Control::complete_web_submission (void)
     return_val = wait_for_data(F("CLOSED"), 10 * SECONDS);
     if (return_val != BS_DATA)
     {    
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       reset_gprs();
       return false;    
@@ -1226,12 +3165,17 @@ bool SIM800_Control::complete_web_submission (void)
   return_val = wait_for_data(F("SHUT OK"), 65 * SECONDS);
   if (return_val != BS_DATA)
   {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       reset_gprs();
       return false;
   }    
  
+  if ((sendSuccess == true) && (time_to_first_upload == 0))
+  {
+    time_to_first_upload = millis() - init_started;
+  }
+ 
   return sendSuccess;
 }
 //==================================================================================
@@ -1248,15 +3192,13 @@ bool SIM800_Control::connected_to_gprs (void)
   
   
   Sim800_Buffer_State return_val = BS_UNKNOWN;
-  static unsigned long last_called = 0;
-  static bool gprs_connected = false;
 
   if (initialised == false) return false;
   
   //Limit polls to every five seconds
-  if ((millis() - last_called) > 5000)
+  if ((millis() - gprs_poll_time) > 5000)
   {
-    last_called = millis();
+    gprs_poll_time = millis();
     
     send_command(F("\r\n"));
     let_terminal_settle();
@@ -1270,6 +3212,8 @@ bool SIM800_Control::connected_to_gprs (void)
       {
         wait_for_status(5 * SECONDS);  
 
+        SIM800_METRICS (recoveries[RECOVER_RADIO_CYCLE]++);
+
         send_command(F("AT+CFUN=4"));  
         wait_for_status(15 * SECONDS);
         wait_for_status(5 * SECONDS);
@@ -1291,7 +3235,7 @@ bool SIM800_Control::connected_to_gprs (void)
     return_val = wait_for_status(5 * SECONDS);
     if (return_val != BS_OK)
     {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       return false;
     }
@@ -1317,7 +3261,7 @@ bool SIM800_Control::connected_to_gprs (void)
     return_val = wait_for_status(5 * SECONDS);
     if (return_val != BS_OK)
     {
-      DebugPrintln (PROTO_FAILURE_STR);
+      LogProtocolFailure();
       protocol_error_count++; 
       return false;
     }
@@ -1331,6 +3275,7 @@ bool SIM800_Control::connected_to_gprs (void)
 //==================================================================================
 void SIM800_Control::reset_gprs (void)
 {
+    SIM800_METRICS (recoveries[RECOVER_GPRS_RESET]++);
     send_command(F("AT+CIPSHUT"));  
     wait_for_data(F("SHUT OK"), 65 * SECONDS);           
     wait_for_status(5 * SECONDS);
@@ -1340,3 +3285,4 @@ void SIM800_Control::reset_gprs (void)
     send_command(F("AT+CFUN=1"));  
     wait_for_status(15 * SECONDS);
 }
+#endif
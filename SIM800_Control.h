@@ -8,8 +8,12 @@
  */
 //===================================================================
 
+#ifndef SIM800_CONTROL_H
+#define SIM800_CONTROL_H
+
 #include <Arduino.h>
-#include "SoftwareSerial.h"
+#include "SIM800_Parse.h"
+#include "SIM800_Trace.h"
 
 //-------------------------------------------------------------------
 // SIM800 Library v1 (28-01-2022)
@@ -25,9 +29,26 @@
 // General Usage:
 //
 // CONFIGURATION
-//   - Open the <SoftwareSerial.h> file (hardware\arduino\avr\libraries), and change 
-//     _SS_MAX_RX_BUFF to 162, otherwise this library will not function correctly
-//   - Call ::begin(<baud rate>) once at creation to configure the s/w serial port
+//   - Create the object with the serial port and reset pin the module is 
+//     attached to, e.g. SIM800_Control gsm (Sim800_Serial, GSM_RST_PIN);  
+//     SoftwareSerial is used by default, see "Transport selection" below to
+//     use another serial class
+//   - Each object keeps its own state, so several modems can be driven side
+//     by side.  (Only one SoftwareSerial port can listen at a time, so use
+//     hardware UARTs for more than one modem)
+//   - If using SoftwareSerial, open the <SoftwareSerial.h> file (hardware\arduino\avr\libraries), 
+//     and change _SS_MAX_RX_BUFF to 162, otherwise this library will not function correctly
+//   - Call ::begin(<baud rate>, <max baud rate>) once at creation to configure the 
+//     s/w serial port.  The module is found at <baud rate> (or any standard rate),
+//     then stepped up with AT+IPR to the fastest rate up to <max baud rate> that 
+//     passes an integrity check.  ::refresh() steps back down if garbled lines
+//     climb (five in a minute), and back up after an hour running clean.
+//     ::link_baud_rate holds the rate in use
+//   - Optionally wire the module's RTS/CTS lines and call 
+//     ::enable_flow_control(<RTS pin>, <CTS pin>) after ::begin().  RTS then
+//     holds the module off except while the library is reading (or ::available()
+//     is polled), so long responses can't overrun the receive buffer between
+//     calls, and sends wait for CTS.  It's set up again after every reboot
 //   - Point ::call_when_idle to a void function; this will be called when the
 //     software is waiting.  Suggested use is to kick the watchdog and handle UI.
 //     ** Don't use this to call SIM800_Control functions, as the s/w isn't re-entrant **
@@ -40,16 +61,44 @@
 // 
 //  NORMAL OPERATION
 //   - Call ::refresh() periodically (suggest c. 10-20ms) to handle serial traffic & URC codes
+//   - For a hard bound on loop latency call ::refresh_slice(<budget ms>) instead.
+//     It never blocks: it reads what it can, sends at most the commands that fit,
+//     and carries re-initialisation and call hang-up/answer over to the next call 
+//     (returning FALSE while such work is outstanding).  ::slice_last_us and 
+//     ::slice_worst_us record the time actually taken (the ::call_when_idle 
+//     callback counts against it).  Re-initialisation runs the same steps as
+//     ::initialise() (less its boot waits), or after an announced reboot just
+//     those ::refresh() resumes with, and nothing is sent while CTS holds
+//     the module off.  Baud rate fallback is left to ::refresh()
+//   - Multi-step sequences can be written as non-blocking flows; see SIM800_Flow.h
 //   - Check ::protocol_error_count to confirm health of the SIM800 interface
 //     Maybe consider a watchdog reboot if this number gets too high
 //   
 //  MAKING A CALL
-//   - Self explanatory; use ::call_number function
+//   - Self explanatory; use ::call_number function (blocks until the call ends)
+//
+//  EVENTS
+//  - Incoming calls, new SMS, socket closures and module reboots are also queued
+//    on ::events as they arrive.  Drain them in order with ::events.pop(&event);
+//    ::events.overflow_count counts any that were dropped because it was full
+//
+//  - Or use ::dial_number, which returns as soon as the call is placed.  Progress is
+//    then followed from +CLCC URCs (no polling) in ::call_state, and queued as 
+//    EV_CALL_DIALLING/RINGING/ACTIVE/RELEASED events.  ::hang_up() ends the call; 
+//    an unanswered call is dropped after 45 seconds.  Check ::call_in_progress() 
+//    before starting other work
 //
 //  RECEIVING A CALL
 //  - ::incoming_call_received will be set TRUE when a new call has been handled and disconnected
 //  - when this flag is set, ::stored_caller_id will be populated with the number
 //  - Once handled, call ::clear_stored_caller_id() which will reset the flag
+//  - Optionally install a caller policy with ::set_caller_policy(<table>, <count>, <default>)
+//    Each call is then looked up on its first +CLIP and rejected (ATH), answered (ATA)
+//    or left to ring out straight away, rather than hung up after ten seconds; the 
+//    decision is queued as an EV_CALL_REJECTED/ACCEPTED/IGNORED event
+//  - An answered call is followed in ::call_state like an outbound one (EV_CALL_ACTIVE,
+//    then EV_CALL_RELEASED on +CLCC or NO CARRIER), and hung up once it has lasted
+//    SIM800_ANSWERED_CALL_MAX_S
 //
 //  SENDING AN SMS
 //  - Call ::clear_sms_buffer() 
@@ -62,6 +111,20 @@
 //    ::stored_caller_id with the originators number, and the char pointer with the SMS ID
 //  - Use ::delete_sms (char[4]) to delete the pending SMS and allow access to newer messages
 //
+//  USSD
+//  - Call ::send_ussd("<code>") (e.g. "*#1345#"), which returns once the request
+//    is accepted.  The reply arrives as an EV_USSD_RESPONSE event (or EV_USSD_FAILED
+//    after 60 seconds) with the decoded text in ::ussd_response.  Text sent as UCS2
+//    hex is decoded as it comes in, so a reply is limited by the decoded length
+//  - Notifications the network sends unasked arrive the same way (EV_USSD_RESPONSE)
+//  - If ::ussd_state is USSD_AWAITING_REPLY the network wants an answer; reply with
+//    ::send_ussd("<answer>") or end the session with ::cancel_ussd()
+//  - ::put_balance_in_sms_buffer() is a blocking wrapper for the balance code; it
+//    replaces whatever is in ::sms_buffer with the reply
+//  - ::ussd_response shares its memory with ::sms_buffer (see "Message buffer"
+//    below), so read the reply before starting on an SMS.  ::send_ussd() returns
+//    false while ::sms_buffer holds a message; send it or clear it first
+//
 //  CHECKING NETWORK STATE
 //  Self explanatory:
 //     ::connected_to_network()
@@ -71,40 +134,138 @@
 //  SERIAL PORT PASS-THRU
 //  When in an idle state, you can use the ::available, ::read and ::write 
 //  to get and put commands directly to the device.
+//
+//  LOGGING
+//  - Off by default.  Build with SIM800_LOG_LEVEL set to SIM800_LOG_ERROR, _INFO
+//    or _TRACE to record failures, state changes, or every line; messages go to
+//    a small binary ring, printed with sim800_trace.dump().  See SIM800_Trace.h
+//
+//  BUILD CONFIGURATION
+//  - Voice, SMS, USSD and GPRS can each be left out of the build by defining
+//    SIM800_ENABLE_VOICE (_SMS, _USSD, _GPRS) as 0; their functions, state and
+//    URC handling go with them.  The buffer sizes, APN and server can be set
+//    the same way; see "Feature selection" below.  extras/host "make size-report"
+//    shows what each configuration costs
+//
+//  SERIAL CAPTURE
+//  - Build with SIM800_ENABLE_CAPTURE 1 to keep the last SIM800_CAPTURE_SIZE 
+//    bytes of traffic (both directions, timestamped) in ::capture
+//  - ::capture.dump() prints it to Serial as text; save that and feed it to
+//    extras/host sim800_replay to play the session back through the library
 
 
 //-------------------------------------------------------------------
-extern SoftwareSerial Sim800_Serial;
-extern const byte GSM_RST_PIN;
-
-#define ENABLE_DEBUG_OUTPUT 0
-
-#ifdef ENABLE_DEBUG_OUTPUT
-  #define DebugBegin(a) (Serial.begin(a))
-  #define DebugFlush() (Serial.flush())
-  #define DebugPrint(a) (Serial.print(a))
-  #define DebugPrintVal(a,b) (Serial.print(a,b))
-  #define DebugPrintln(a) (Serial.println(a))
-  #define DebugAvailable() (Serial.available())
-  #define DebugRead() (Serial.read())
-#else  
-  #define DebugBegin(a) 
-  #define DebugFlush() 
-  #define DebugPrint(a) 
-  #define DebugPrintVal(a,b) 
-  #define DebugPrintln(a) 
-  #define DebugAvailable() false
-  #define DebugRead() '\0'
+// Transport selection
+// The serial class used to talk to the module is fixed at compile time, so
+// the per-byte calls are direct (no virtual dispatch).  Any class providing
+// begin(long), available(), read() and write(char) will do; e.g. HardwareSerial
+// on boards with a spare UART, or a host-side stand-in.  Either edit the 
+// defaults below, or define SIM800_TRANSPORT (and SIM800_TRANSPORT_INCLUDE
+// if it needs a header) in the build flags
+#ifndef SIM800_TRANSPORT
+  #include "SoftwareSerial.h"
+  #define SIM800_TRANSPORT SoftwareSerial
+  #ifndef SIM800_TRANSPORT_HAS_OVERFLOW
+    #define SIM800_TRANSPORT_HAS_OVERFLOW 1
+  #endif
+#elif defined(SIM800_TRANSPORT_INCLUDE)
+  #include SIM800_TRANSPORT_INCLUDE
+#endif
+
+//Define as 1 if the transport has SoftwareSerial's overflow() (true once after
+//its receive buffer lost bytes), for ::metrics.transport_overflows
+#ifndef SIM800_TRANSPORT_HAS_OVERFLOW
+  #define SIM800_TRANSPORT_HAS_OVERFLOW 0
 #endif
 
+typedef SIM800_TRANSPORT Sim800_Transport;
+
+//Size of the transport's receive buffer
+#ifndef SIM800_TRANSPORT_RX_SIZE
+  #if defined(_SS_MAX_RX_BUFF)
+    #define SIM800_TRANSPORT_RX_SIZE _SS_MAX_RX_BUFF
+  #elif defined(SERIAL_RX_BUFFER_SIZE)
+    #define SIM800_TRANSPORT_RX_SIZE SERIAL_RX_BUFFER_SIZE
+  #else
+    #define SIM800_TRANSPORT_RX_SIZE 64
+  #endif
+#endif
+
+//-------------------------------------------------------------------
+// Feature selection
+// Set any of these to 0 in the build flags to leave that part of the library
+// out altogether (calling one of its functions is then a compile error)
+#ifndef SIM800_ENABLE_VOICE
+  #define SIM800_ENABLE_VOICE 1      //Calls in and out, caller policy
+#endif
+
+#ifndef SIM800_ENABLE_SMS
+  #define SIM800_ENABLE_SMS 1        //Sending, receiving, SIM800_Pool
+#endif
+
+#ifndef SIM800_ENABLE_USSD
+  #define SIM800_ENABLE_USSD 1
+#endif
+
+#ifndef SIM800_ENABLE_GPRS
+  #define SIM800_ENABLE_GPRS 1       //Web submission
+#endif
+
+//Used by ::prep_for_web_submission (string literals)
+#ifndef SIM800_GPRS_APN
+  #define SIM800_GPRS_APN "pp.vodafone.co.uk"
+#endif
+
+#ifndef SIM800_GPRS_USER
+  #define SIM800_GPRS_USER "wap"
+#endif
+
+#ifndef SIM800_GPRS_PASSWORD
+  #define SIM800_GPRS_PASSWORD "wap"
+#endif
+
+#ifndef SIM800_SERVER_HOST
+  #define SIM800_SERVER_HOST "lythamrnli.jamesamor.co.uk"
+#endif
+
+#ifndef SIM800_SERVER_PORT
+  #define SIM800_SERVER_PORT 80
+#endif
 
 typedef void(*Function_Pointer)();
 
 #define SECONDS 1
 
-#define MAX_CALLER_ID_SIZE 20
-#define TX_BUFFER_SIZE 162
-#define RX_BUFFER_SIZE 162
+#define SIM800_FEATURE_SMS   0x01
+#define SIM800_FEATURE_VOICE 0x02
+#define SIM800_FEATURE_USSD  0x04
+#define SIM800_FEATURE_ALL   ((SIM800_ENABLE_SMS ? SIM800_FEATURE_SMS : 0) | \
+                              (SIM800_ENABLE_VOICE ? SIM800_FEATURE_VOICE : 0) | \
+                              (SIM800_ENABLE_USSD ? SIM800_FEATURE_USSD : 0))
+
+//Only turned on when first needed (by ::dial_number)
+#define SIM800_FEATURE_CALL_STATE 0x08
+
+//Configured at start-up even with ::lazy_init, as incoming calls can't wait for first use
+#define SIM800_FEATURE_INCOMING (SIM800_ENABLE_VOICE ? SIM800_FEATURE_VOICE : 0)
+
+//Set by ::enable_flow_control (AT+IFC); AT&F and reboots clear it, so it's reapplied
+#define SIM800_FEATURE_FLOW_CONTROL 0x10
+
+//Also the size of an event's data
+#ifndef MAX_CALLER_ID_SIZE
+  #define MAX_CALLER_ID_SIZE 20
+#endif
+
+//::sms_buffer (an SMS is up to 160 characters)
+#ifndef TX_BUFFER_SIZE
+  #define TX_BUFFER_SIZE 162
+#endif
+
+//Longest line read from the module (up to 255); longer ones are dropped
+#ifndef RX_BUFFER_SIZE
+  #define RX_BUFFER_SIZE 162
+#endif
 
 enum Sim800_Buffer_State
 {
@@ -116,12 +277,276 @@ enum Sim800_Buffer_State
   BS_UNKNOWN
 };
 
-const char PROGMEM PROTO_FAILURE_STR[] = "F! Proto";
+//-------------------------------------------------------------------
+// Events raised by URCs, in the order they arrived
+enum Sim800_Event_Type
+{
+  EV_NONE,
+  EV_INCOMING_CALL,       //data = caller id
+  EV_SMS_RECEIVED,        //data = SMS index
+  EV_SOCKET_CLOSED,
+  EV_MODULE_REBOOT,
+  EV_CALL_REJECTED,       //data = caller id
+  EV_CALL_IGNORED,        //data = caller id
+  EV_CALL_ACCEPTED,       //data = caller id
+  EV_CALL_DIALLING,       //Outbound call progress (see ::dial_number)
+  EV_CALL_RINGING,
+  EV_CALL_ACTIVE,
+  EV_CALL_RELEASED,
+  EV_USSD_RESPONSE,       //Reply is in ::ussd_response
+  EV_USSD_FAILED
+};
+
+struct Sim800_Event
+{
+  byte type;
+  char data [MAX_CALLER_ID_SIZE];
+};
+
+//-------------------------------------------------------------------
+// Outbound call state
+enum Sim800_Call_State
+{
+  CS_IDLE,
+  CS_DIALLING,
+  CS_RINGING,
+  CS_ACTIVE,
+  CS_RELEASED
+};
+
+//Longest an answered call may last before it's hung up
+#ifndef SIM800_ANSWERED_CALL_MAX_S
+  #define SIM800_ANSWERED_CALL_MAX_S 300
+#endif
+
+//-------------------------------------------------------------------
+// USSD session state
+enum Sim800_Ussd_State
+{
+  USSD_IDLE,
+  USSD_WAITING,
+  USSD_RECEIVING,
+  USSD_AWAITING_REPLY,
+  USSD_COMPLETE,
+  USSD_FAILED
+};
+
+#ifndef SIM800_USSD_BUFFER_SIZE
+  #define SIM800_USSD_BUFFER_SIZE 100
+#endif
+
+//Longest code (or answer) send_ussd() will send
+#define SIM800_USSD_CODE_SIZE 28
+
+//-------------------------------------------------------------------
+// Message buffer
+// ::sms_buffer and ::ussd_response are seldom needed at the same time, so
+// they're one piece of memory, lent to whichever operation used it last:
+// clear_sms_buffer(), send_sms_from_buffer() and get_pending_sms() take it
+// for an SMS, send_ussd() for the reply.  send_ussd() won't take it from an
+// SMS that's still in it (one not yet sent, or just read), and a USSD reply
+// that arrives after an SMS has taken the buffer is dropped (EV_USSD_FAILED),
+// so a message is never written over.  The buffer is the larger of TX_BUFFER_SIZE and 
+// SIM800_USSD_BUFFER_SIZE, so either can grow to the other's size for nothing.
+// A notification the network sends unasked takes the buffer only if it's free
+enum Sim800_Message_Owner
+{
+  MESSAGE_FREE,
+  MESSAGE_SMS,
+  MESSAGE_USSD
+};
+
+//-------------------------------------------------------------------
+// Which parts of the start-up sequence to run
+enum Sim800_Init_Run
+{
+  INIT_RUN_START,                        //After power-on or a warm start
+  INIT_RUN_SLICE,                        //The same, one step per ::refresh_slice()
+  INIT_RUN_RESUME,                       //After the module announced a reboot
+  INIT_RUN_SLICE_RESUME,                 //The same, one step per ::refresh_slice()
+  INIT_RUN_FEATURES                      //Lazy mode, on first use
+};
+
+//-------------------------------------------------------------------
+// Work carried between ::refresh_slice() calls
+enum Sim800_Slice_Job
+{
+  SJ_NONE,
+  SJ_REINIT,
+  SJ_ANSWER_CALL,
+  SJ_REJECT_CALL,
+  SJ_HANGUP
+};
+
+//-------------------------------------------------------------------
+// Incoming call policy
+enum Sim800_Call_Action
+{
+  CALL_UNDECIDED,
+  CALL_REJECT,
+  CALL_IGNORE,
+  CALL_ACCEPT
+};
+
+//One entry of the caller table.  The table lives in PROGMEM and must be
+//sorted (strcmp order) by number, e.g.
+//  const Sim800_Caller_Rule PROGMEM callers[] = {{"+447700900001", CALL_ACCEPT},
+//                                                {"+447700900002", CALL_REJECT}};
+struct Sim800_Caller_Rule
+{
+  char number [MAX_CALLER_ID_SIZE];
+  byte action;
+};
+
+//Must be a power of two (each entry costs MAX_CALLER_ID_SIZE + 1 bytes)
+#ifndef SIM800_EVENT_QUEUE_SIZE
+  #define SIM800_EVENT_QUEUE_SIZE 4
+#endif
+
+//Lock-free single producer (the library) / single consumer (the application)
+//ring.  The indices are single bytes published with acquire/release ordering,
+//so it's safe between an ISR and the main loop, or between two threads
+class Sim800_Event_Queue
+{
+  public:
+    Sim800_Event_Queue (void);
+
+    unsigned int overflow_count;
+
+    bool push (byte type, const char *data);
+    bool pop (Sim800_Event *event);
+    byte count (void);
+
+  private:
+    Sim800_Event events [SIM800_EVENT_QUEUE_SIZE];
+    byte head;
+    byte tail;
+};
+
+//-------------------------------------------------------------------
+// Serial capture
+#ifndef SIM800_ENABLE_CAPTURE
+  #define SIM800_ENABLE_CAPTURE 0
+#endif
+
+#ifndef SIM800_CAPTURE_SIZE
+  #define SIM800_CAPTURE_SIZE 512
+#endif
+
+//A pause at least this long starts a new record
+#define SIM800_CAPTURE_GAP_MS 2
+
+#define SIM800_CAPTURE_TX 0x00
+#define SIM800_CAPTURE_RX 0x80
+
+//Ring of records, oldest dropped first when it fills:
+//  <dir | length (1-127)> <ms since the previous record, 16 bit LE> <bytes>
+//A record holds one burst in one direction, so a typical command/reply 
+//costs 6 bytes over the raw traffic
+class Sim800_Capture
+{
+  public:
+    Sim800_Capture (void);
+
+    unsigned int dropped_records;
+
+    void record (byte direction, char value);
+    void dump (void);
+    void clear (void);
+
+  private:
+    byte ring [SIM800_CAPTURE_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    unsigned int used;
+    unsigned int open_record;
+    unsigned long start_time;
+    unsigned long record_time;
+    unsigned long byte_time;
+
+    void put (byte value);
+    inline byte peek (unsigned int offset) { return ring[(tail + offset) % SIM800_CAPTURE_SIZE]; };
+    void drop_oldest (void);
+};
+
+#if SIM800_ENABLE_CAPTURE
+  #define SIM800_CAPTURE_BYTE(direction, value) capture.record (direction, value)
+#else
+  #define SIM800_CAPTURE_BYTE(direction, value) do { } while (0)
+#endif
+
+//-------------------------------------------------------------------
+// Metrics
+#ifndef SIM800_ENABLE_METRICS
+  #define SIM800_ENABLE_METRICS 0
+#endif
+
+//Response time histogram: < 50, 100, 250, 500, 1000, 2500, 5000ms, and longer
+#define SIM800_LATENCY_BUCKETS 8
+
+enum Sim800_Recovery {RECOVER_BAUD_STEP_DOWN,    //Too many errors at a higher rate
+                      RECOVER_GPRS_RESET,        //AT+CIPSHUT and radio cycled
+                      RECOVER_RADIO_CYCLE,       //AT+CFUN=4/1 to find the network
+                      RECOVER_RESUME,            //Module rebooted; settings were kept
+                      RECOVER_REINIT,            //Full ::initialise()
+                      RECOVER_WARMSTART,         //Reset pin cycled
+                      SIM800_RECOVERY_TIERS};
+
+struct Sim800_Command_Stats
+{
+  unsigned int sent;
+  unsigned int ok;
+  unsigned int error;
+  unsigned int timeout;
+  unsigned int latency [SIM800_LATENCY_BUCKETS];
+  unsigned long total_ms;                //Of those answered, for the average
+};
+
+//Counters wrap (at 65535 on AVR) rather than stick
+class Sim800_Metrics
+{
+  public:
+    Sim800_Metrics (void);
+
+    Sim800_Command_Stats commands [SIM800_COMMAND_CLASSES];
+    unsigned int urcs [SIM800_URC_TYPES];    //[URC_NONE] = unrecognised lines while idle, or in wait_for_status()
+    unsigned int recoveries [SIM800_RECOVERY_TIERS];
+    unsigned int rx_overflows;               //Lines too long for the receive buffer
+    unsigned int transport_overflows;        //Times the transport's receive buffer lost bytes (SIM800_TRANSPORT_HAS_OVERFLOW)
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+
+    void clear (void);
+    static unsigned int bucket_limit_ms (byte bucket);
+
+    void command_sent (const char *command);
+    void command_sent_P (PGM_P command);
+    void command_done (Sim800_Buffer_State result);
+
+  private:
+    byte open_class;
+    byte last_class;
+    unsigned long open_time;
+};
+
+#if SIM800_ENABLE_METRICS
+  #define SIM800_METRICS(action) metrics.action
+#else
+  #define SIM800_METRICS(action) do { } while (0)
+#endif
+
+//Commands are streamed to the module as they're built; just the start is
+//kept, if the metrics or the trace need it
+#if SIM800_ENABLE_METRICS || (SIM800_LOG_LEVEL >= SIM800_LOG_TRACE)
+  #define SIM800_COMMAND_HEAD_SIZE (SIM800_TRACE_TEXT_SIZE + 1)
+#else
+  #define SIM800_COMMAND_HEAD_SIZE 0
+#endif
 
 class SIM800_Control
 {
   public:
-    SIM800_Control (void);
+    SIM800_Control (Sim800_Transport &transport, byte rst_pin);
 
     bool initialised;
     bool sim_card_inserted;
@@ -129,64 +554,276 @@ class SIM800_Control
     byte protocol_error_count;
     byte signal_strength;
     int gsm_resets;
+    unsigned long last_init_duration;
+    bool fast_boot;
+    bool lazy_init;
+#if SIM800_ENABLE_SMS
+    unsigned long time_to_first_sms;
+#endif
+#if SIM800_ENABLE_GPRS
+    unsigned long time_to_first_upload;
+#endif
         
+#if SIM800_ENABLE_SMS || SIM800_ENABLE_VOICE
     char stored_caller_id [MAX_CALLER_ID_SIZE];    
+#endif
+#if SIM800_ENABLE_VOICE
     bool incoming_call_received;
+#endif
+
+    Sim800_Event_Queue events;
+
+#if SIM800_ENABLE_CAPTURE
+    Sim800_Capture capture;
+#endif
 
-    void begin (int baud_Rate);
+#if SIM800_ENABLE_METRICS
+    Sim800_Metrics metrics;
+#endif
+
+    long link_baud_rate;
+
+    void begin (long baud_Rate, long max_baud_Rate = 57600);
+    void enable_flow_control (byte rts_output_pin, byte cts_input_pin);
     void initialise (bool force_warmstart = false);
 
     void refresh (void);
+    bool refresh_slice (unsigned int budget_ms);
 
-    inline bool available (void) {      return Sim800_Serial.available();    };
-    inline char read (void) {      return Sim800_Serial.read();    };
-    inline void write (char to_write) {      Sim800_Serial.write (to_write);    };
+    unsigned long slice_last_us;
+    unsigned long slice_worst_us;
+
+    //<owner> identifies the caller (a flow passes itself); only the owner's polls read the replies
+    bool command_begin (const __FlashStringHelper *cmd_string, byte timeout_secs, const __FlashStringHelper *pattern = NULL, const void *owner = NULL);
+    bool command_begin (const char *cmd_string, byte timeout_secs, const __FlashStringHelper *pattern = NULL, const void *owner = NULL);
+    Sim800_Buffer_State command_poll (const void *owner = NULL);
+    inline const char *last_line (void) { return rx_buffer; };
+    inline bool link_free (void) { return ((slice_job == SJ_NONE) && (async_command_active == false)); };
+
+    inline bool available (void) {      set_rts (false); return modem_serial.available();    };
+    inline char read (void) {      char value = modem_serial.read(); SIM800_CAPTURE_BYTE (SIM800_CAPTURE_RX, value); SIM800_METRICS (bytes_received++); return value;    };
+    inline void write (char to_write) {      transmit (to_write);    };
 
     bool connected_to_network (void);
-    bool connected_to_gprs (void);
     byte get_signal_bars (void);
     byte get_signal_percent (void);
-    bool send_sms_from_buffer (char *sms_dest_number);
+
+#if SIM800_ENABLE_VOICE
     bool call_number (char *dest_number);
+    bool dial_number (char *dest_number);
+    bool hang_up (void);
+    inline bool call_in_progress (void) { return ((call_state == CS_DIALLING) || (call_state == CS_RINGING) || (call_state == CS_ACTIVE)); };
+
+    byte call_state;
+
+    void set_caller_policy (const Sim800_Caller_Rule *rules, byte rule_count, byte default_action);
+    inline void clear_stored_caller_id (void) {incoming_call_received = false;  memset (&stored_caller_id, 0, sizeof(char) * MAX_CALLER_ID_SIZE);}
+#else
+    inline bool call_in_progress (void) { return false; };
+#endif
+
+#if SIM800_ENABLE_SMS
+    bool send_sms_from_buffer (char *sms_dest_number);
     bool sms_available (void);
     bool get_pending_sms (char (*sms_id)[4]);
     void delete_sms (char *sms_id);
-    bool put_balance_in_sms_buffer (void);
-       
-    char sms_buffer[TX_BUFFER_SIZE];
 
-    inline void clear_stored_caller_id (void) {incoming_call_received = false;  memset (&stored_caller_id, 0, sizeof(char) * MAX_CALLER_ID_SIZE);}
-    inline void clear_sms_buffer (void) {memset (&sms_buffer, 0, sizeof(char) * TX_BUFFER_SIZE);}
+    inline void clear_sms_buffer (void) {memset (&sms_buffer, 0, sizeof(char) * TX_BUFFER_SIZE); message_owner = MESSAGE_SMS;}
+#endif
+
+#if SIM800_ENABLE_USSD
+    bool send_ussd (const char *ussd_code);
+    bool cancel_ussd (void);
+
+    byte ussd_state;
+#endif
+
+#if SIM800_ENABLE_SMS || SIM800_ENABLE_USSD
+    //The same memory; see "Message buffer"
+    union
+    {
+  #if SIM800_ENABLE_SMS
+      char sms_buffer [TX_BUFFER_SIZE];
+  #endif
+  #if SIM800_ENABLE_USSD
+      char ussd_response [SIM800_USSD_BUFFER_SIZE];
+  #endif
+    };
+#endif
+
+#if SIM800_ENABLE_USSD && SIM800_ENABLE_SMS
+    bool put_balance_in_sms_buffer (void);
+#endif
     
+#if SIM800_ENABLE_GPRS
+    bool connected_to_gprs (void);
     bool prep_for_web_submission (void);   
-    bool complete_web_submission (void);
+    //Ends the request with two blank lines unless <end_headers> is false
+    //(after a body, which they'd run past the Content-Length of)
+    bool complete_web_submission (bool end_headers = true);
+#endif
             
         
     Function_Pointer call_when_idle;
 
   private:
+    Sim800_Transport &modem_serial;
+    byte reset_pin;
+#if SIM800_ENABLE_VOICE
     unsigned long incoming_call_ring_time;
+    byte call_action;
+    const Sim800_Caller_Rule *caller_rules;
+    byte caller_rule_count;
+    byte caller_default_action;
+    unsigned long dial_time;
+    bool call_answered;
+    unsigned long answer_time;
+#endif
+#if SIM800_ENABLE_USSD
+    unsigned long ussd_request_time;
+    char ussd_status;
+    bool ussd_streaming;                 //Reading reply text that's been UCS2 hex so far
+    char ussd_group[5];                  //Hex digits of the character still arriving
+    byte ussd_group_length;
+    byte ussd_split_digits;              //Digits to come of a character broken by a line end
+    bool ussd_line_decoded;              //The line holds characters decoded as they came in
+#endif
+#if SIM800_ENABLE_SMS || SIM800_ENABLE_USSD
+    byte message_owner;
+#endif
+
+    unsigned long rx_deadline;
+    bool rx_deadline_active;
+    byte slice_job;
+    byte slice_step;
+    byte slice_retries;
+    byte slice_features;
+    byte slice_run;                      //INIT_RUN_SLICE, or _SLICE_RESUME after a reboot
+    bool slice_command_sent;
+    unsigned long slice_command_time;
+    byte slice_command_timeout;
+
+    bool async_command_active;
+    unsigned long async_command_time;
+    byte async_command_timeout;
+    const __FlashStringHelper *async_command_pattern;
+    const void *async_command_owner;
+    bool module_rebooted;
+    bool reboot_announced;
+    unsigned long reboot_time;
+    bool sms_ready_seen;
+    byte features_configured;
+    unsigned long init_started;
+    bool profile_matched;
+    bool profile_echo;
+    unsigned int profile_found;          //One bit per start-up step
+  
+    byte link_errors;                    //Garbled lines since link_error_time
+    unsigned long link_error_time;
+    unsigned long link_quiet_since;      //Last garbled line, or change of rate
+    long link_best_baud;                 //Fastest rate begin() found to work
+    bool flow_control;
+    byte rts_pin;
+    byte cts_pin;
   
-    void process_urc (void);
+    bool link_responds (void);
+    bool find_baud_rate (void);
+    bool change_baud_rate (long new_rate);
+    bool link_integrity_ok (void);
+    void step_down_baud_rate (void);
+    void step_up_baud_rate (void);
+    void note_link_error (void);
+    bool enable_features (byte features);
+    byte restore_features (void);
+    bool run_init_steps (byte run, byte features);
+    bool init_step_wanted (byte step, byte run, byte features);
+    bool profile_step (byte step, byte features);
+    byte profile_query (byte features, bool send);
+    byte init_command_length (byte step, byte features);
+    void send_init_step (byte step, byte features, bool blocking);
+    Sim800_Buffer_State read_init_reply (byte step, byte features);
+    void note_profile_line (byte features);
+    bool finish_init_step (byte step, byte features, Sim800_Buffer_State result);
+    void resume_after_reboot (void);
+    bool reboot_settled (void);
+    void process_urc (bool count_unmatched = false);
+#if SIM800_ENABLE_VOICE
+    void handle_incoming_call (void);
+    byte lookup_caller (const char *caller_id);
+    void update_call_state (char clcc_status);
+    void note_call_answered (void);
+    bool answered_call_overdue (void);
+#endif
+#if SIM800_ENABLE_USSD
+    void process_ussd (void);
+    void process_ussd_continuation (void);
+    bool stream_ussd_byte (char incoming);
+    void frame_ussd_text (const char *text);
+    void store_ussd_text (const char *text);
+    void decode_ussd_text (bool ucs2);
+    bool ussd_dcs_is_ucs2 (const char *after_text);
+    void finish_ussd (char status);
+    bool ussd_reply_displaced (void);
+    void check_ussd_timeout (void);
+#endif
+    void start_slice_job (void);
+    bool send_slice_command (unsigned long time_left_us);
+    void finish_slice_command (Sim800_Buffer_State result);
+    void set_rts (bool pause);
+    void drop_flow_control (void);
+    void idle (void);
+    void transmit (char to_send);
+    void transmit (const char *to_send);
+    void transmit_P (PGM_P to_send);
+    void start_async_command (byte timeout_secs, const __FlashStringHelper *pattern, const void *owner);
+    bool async_command_owns_link (void);
     void send_command (const __FlashStringHelper *cmd_string);
     void send_command (char *cmd_string);
+    void command_start (bool blocking = true);
+    void command_add (char value);
+    void command_add (const char *text);
+    void command_add (const __FlashStringHelper *fragment);
+    void command_add (long value);
+    void command_end (bool blocking = true);
     Sim800_Buffer_State wait_for_data (const __FlashStringHelper *pattern, byte timeoutSecs);
     void let_terminal_settle (void);
     byte get_rssi (void);
+#if SIM800_ENABLE_GPRS
     void reset_gprs (void);
+#endif
 
 //    void flush_sms_store (void);
 
     Sim800_Buffer_State check_for_response (void);
     Sim800_Buffer_State wait_for_status (byte timeout_secs);
 
-    char tx_buffer[TX_BUFFER_SIZE];    
+#if SIM800_COMMAND_HEAD_SIZE > 0
+    char command_head[SIM800_COMMAND_HEAD_SIZE];
+    byte command_head_length;
+#endif
+
     char rx_buffer[RX_BUFFER_SIZE];
     byte rx_buff_pos;
 
     Sim800_Buffer_State rx_buff_state;
     bool fatal_error_detected;
 
+    //Poll rate limiting and cached results
+    unsigned long network_poll_time;
+    bool net_connected;
+    unsigned long rssi_poll_time;
+    byte last_rssi;
+#if SIM800_ENABLE_SMS
+    unsigned long sms_poll_time;
+    byte sms_consecutive_errors;
+#endif
+#if SIM800_ENABLE_GPRS
     bool website_connected;
-    
+    unsigned long gprs_poll_time;
+    bool gprs_connected;
+    bool had_valid_gprs_context;
+#endif
+
 };
+
+#endif
@@ -0,0 +1,127 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// SIM800 Flows
+//-------------------------------------------------------------------
+// Stackless (protothread style) coroutines for writing multi-step modem
+// sequences as straight-line code that doesn't block.  Each flow is a 
+// function taking a Sim800_Flow (4 bytes of state), called repeatedly from 
+// the main loop alongside ::refresh_slice(); it returns FLOW_WAITING until
+// it reaches FLOW_END.  Any number of flows can be interleaved; they take
+// turns on the serial link, one command at a time.
+//
+// Caveats:
+//  - Local variables are NOT kept between calls; keep state in statics/globals
+//  - Don't use switch statements inside a flow (the macros are built on one)
+//  - Don't call the blocking SIM800_Control functions from a flow
+//  - While a flow's command is in progress, ::refresh() and ::refresh_slice()
+//    leave the link to it; a flow that stops polling loses the link at twice
+//    the command's timeout
+//
+// Example:
+//   Sim800_Flow upload_flow;
+//
+//   char upload (Sim800_Flow *flow)
+//   {
+//     FLOW_BEGIN (flow);
+//
+//     FLOW_AWAIT_COMMAND (flow, gsm, F("AT+CGATT?"), 5 * SECONDS, F("+CGATT: "));
+//     if (flow->result == BS_DATA)
+//     {
+//       attached = (strstr (gsm.last_line(), "+CGATT: 1") != NULL);
+//       FLOW_AWAIT_STATUS (flow, gsm);
+//     }
+//
+//     FLOW_AWAIT_COMMAND (flow, gsm, F("AT+CIPSTART=\"TCP\",\"example.com\",80"), 75 * SECONDS, F("CONNECT OK"));
+//     ...
+//     FLOW_END (flow);
+//   }
+//
+//   void loop() { gsm.refresh_slice (5);  upload (&upload_flow); }
+//
+// The same macros build on the host, so flows can be run against the 
+// simulator unchanged
+//-------------------------------------------------------------------
+
+#ifndef SIM800_FLOW_H
+#define SIM800_FLOW_H
+
+#include "SIM800_Control.h"
+
+#define FLOW_WAITING 0
+#define FLOW_DONE    1
+
+struct Sim800_Flow
+{
+  unsigned int resume_line;
+  byte result;
+  bool command_sent;
+
+  Sim800_Flow (void) : resume_line (0), result (BS_UNKNOWN), command_sent (false) {};
+};
+
+//One step of FLOW_AWAIT_COMMAND: send once the link is free, then poll
+template <typename Command>
+inline bool sim800_flow_command (Sim800_Flow *flow, SIM800_Control &modem, Command command, byte timeout_secs, const __FlashStringHelper *pattern)
+{
+  if (flow->command_sent == false)
+  {
+    if (modem.command_begin (command, timeout_secs, pattern, flow) == false) return false;
+    flow->command_sent = true;
+  }
+
+  flow->result = modem.command_poll (flow);
+  return (flow->result != BS_WAITING);
+}
+
+//Each suspension point falls through into its own case label
+#if defined(__GNUC__) && (__GNUC__ >= 7)
+  #define SIM800_FLOW_FALLTHROUGH __attribute__ ((fallthrough))
+#else
+  #define SIM800_FLOW_FALLTHROUGH
+#endif
+
+//Restart a flow from the top
+#define FLOW_RESET(flow)  do { (flow)->resume_line = 0; } while (0)
+
+#define FLOW_BEGIN(flow)  switch ((flow)->resume_line) { case 0:
+
+#define FLOW_END(flow)    } (flow)->resume_line = 0; return FLOW_DONE
+
+//Suspend here until <condition> is true
+#define FLOW_WAIT_UNTIL(flow, condition)                    \
+  do {                                                      \
+    (flow)->resume_line = __LINE__;                         \
+    SIM800_FLOW_FALLTHROUGH; case __LINE__:                 \
+    if (!(condition)) return FLOW_WAITING;                  \
+  } while (0)
+
+//Give the rest of the loop a turn
+#define FLOW_YIELD(flow)                                    \
+  do {                                                      \
+    (flow)->resume_line = __LINE__; return FLOW_WAITING;    \
+    case __LINE__: ;                                        \
+  } while (0)
+
+//Wait for the link, send <command>, then wait for its outcome.  flow->result
+//is BS_OK/BS_ERROR/BS_TIMEOUT, or BS_DATA when a line matching <pattern> has
+//arrived (read it with last_line(), then FLOW_AWAIT_STATUS for the OK)
+#define FLOW_AWAIT_COMMAND(flow, modem, command, timeout_secs, pattern)                   \
+  do {                                                                                    \
+    (flow)->command_sent = false;                                                         \
+    FLOW_WAIT_UNTIL (flow, sim800_flow_command ((flow), (modem), (command), (timeout_secs), (pattern))); \
+  } while (0)
+
+//Wait for the next outcome of this flow's command
+#define FLOW_AWAIT_STATUS(flow, modem)                                                     \
+  FLOW_WAIT_UNTIL (flow, ((flow)->result = (modem).command_poll (flow)) != BS_WAITING)
+
+#endif
@@ -0,0 +1,201 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+#include "SIM800_Parse.h"
+
+//================================================================================================
+bool sim800_frame_byte (char *line, byte *line_pos, byte line_size, char incoming)
+{
+  if (incoming == char(10))
+  {
+    //Do nothing (Strip Line Feeds)
+    return false;
+  }
+
+  if (incoming == char(13))
+  {
+    //Terminate the line so that the data forms a valid string; a CR on
+    //it's own isn't a line
+    line[*line_pos] = '\0';
+    return (*line_pos > 0);
+  }
+
+  if (*line_pos < (line_size - 1))
+  {
+    line[(*line_pos)++] = incoming;
+  }
+  else
+  {
+    //If the buffer has filled, but there's no meaningful data,
+    //clear down the buffer
+    memset (line, 0, sizeof(char) * line_size);
+    *line_pos = 0;
+  }
+
+  return false;
+}
+
+//================================================================================================
+bool sim800_line_garbled (const char *line)
+{
+  for (; *line != '\0'; line++)
+  {
+    //Tabs are the only control code that turns up inside a line
+    if (((byte)*line >= 0x80) || (((byte)*line < ' ') && (*line != '\t'))) return true;
+  }
+
+  return false;
+}
+
+//================================================================================================
+byte sim800_classify_urc (const char *line)
+{
+  //Check the "+XXXX: " codes where each '+' starts, rather than searching
+  //the whole line once per code
+  const char *plus = strchr (line, '+');
+
+  while (plus != NULL)
+  {
+    if (plus[1] == 'C')
+    {
+      if (strncmp_P (plus, PSTR("+CUSD: "), 7) == 0) return URC_USSD;
+      if (strncmp_P (plus, PSTR("+CLIP: "), 7) == 0) return URC_CALLER_ID;
+      if (strncmp_P (plus, PSTR("+CLCC: "), 7) == 0) return URC_CALL_STATE;
+      if (strncmp_P (plus, PSTR("+CMTI: \"SM\""), 11) == 0) return URC_SMS;
+    }
+
+    plus = strchr (plus + 1, '+');
+  }
+
+  if (strstr_P (line, PSTR("NO CARRIER")) != NULL) return URC_NO_CARRIER;
+  if (strstr_P (line, PSTR("SMS Ready")) != NULL) return URC_READY;
+  if (strstr_P (line, PSTR("Call Ready")) != NULL) return URC_READY;
+  if (strstr_P (line, PSTR("CLOSED")) != NULL) return URC_CLOSED;
+
+  return URC_NONE;
+}
+
+//================================================================================================
+byte sim800_classify_command (const char *command)
+{
+  if ((command[0] != 'A') || (command[1] != 'T')) return CMD_NOT_A_COMMAND;
+
+  switch (command[2])
+  {
+    case 'D' :
+    case 'A' :
+    case 'H' :
+      return CMD_CALL;
+
+    case '+' :
+      break;
+
+    default :
+      return CMD_BASIC;
+  }
+
+  //Only the first command of a combined line (AT+X;+Y) is looked at
+  const char *name = &command[3];
+
+  if (strncmp_P (name, PSTR("CMG"), 3) == 0) return CMD_SMS;
+  if (strncmp_P (name, PSTR("CUSD"), 4) == 0) return CMD_USSD;
+  if ((strncmp_P (name, PSTR("CLCC"), 4) == 0) || (strncmp_P (name, PSTR("CLIP"), 4) == 0)) return CMD_CALL;
+  if ((strncmp_P (name, PSTR("CG"), 2) == 0) || (strncmp_P (name, PSTR("CI"), 2) == 0) ||
+      (strncmp_P (name, PSTR("CSTT"), 4) == 0)) return CMD_GPRS;
+  if ((strncmp_P (name, PSTR("CREG"), 4) == 0) || (strncmp_P (name, PSTR("CSQ"), 3) == 0) ||
+      (strncmp_P (name, PSTR("CFUN"), 4) == 0) || (strncmp_P (name, PSTR("CCID"), 4) == 0) ||
+      (strncmp_P (name, PSTR("COPS"), 4) == 0)) return CMD_NETWORK;
+
+  return CMD_BASIC;
+}
+
+//================================================================================================
+char *sim800_csv_field (char *list, byte field)
+{
+  //One pass over the line, stopping as soon as the field is found
+  while (field > 0)
+  {
+    list = strchr (list, ',');
+    if (list == NULL) return NULL;
+
+    list++;
+    field--;
+  }
+
+  return list;
+}
+
+//================================================================================================
+char *sim800_csv_cut (char *field)
+{
+  char *field_end = strchr (field, ',');
+
+  if (field_end != NULL) *field_end = '\0';
+
+  return field;
+}
+
+//================================================================================================
+byte sim800_find_ucs2 (const char *text)
+{
+  //Too short to be worth decoding
+  if (strnlen (text, 14) < 14) return SIM800_NOT_UCS2;
+
+  //Look for two "00XX" characters in a row (the high byte of ASCII is 0)
+  for (byte idx = 0; idx < 8; idx++)
+  {
+    if ((text[idx] == '0') && (text[idx+1] == '0') && (text[idx+2] != '0') &&
+        (text[idx+4] == '0') && (text[idx+5] == '0') && (text[idx+6] != '0'))
+    {
+      return idx;
+    }
+  }
+
+  return SIM800_NOT_UCS2;
+}
+
+//================================================================================================
+static inline int8_t hex_value (char digit)
+{
+  //Upper case only, as the module sends it; anything else is -1
+  if ((digit >= '0') && (digit <= '9')) return digit - '0';
+  if ((digit >= 'A') && (digit <= 'F')) return digit - 'A' + 10;
+
+  return -1;
+}
+
+//================================================================================================
+byte sim800_decode_ucs2 (char *buffer, byte start_offset)
+{
+  byte text_length = strlen(buffer);
+  if (start_offset > text_length) start_offset = text_length;
+
+  byte decoded_length = (text_length - start_offset) / 4;
+  const char *source = &buffer[start_offset];
+
+  for (byte idx = 0; idx < decoded_length; idx++, source += 4)
+  {
+    int8_t high = hex_value (source[2]);
+    int8_t low = hex_value (source[3]);
+
+    if ((source[0] == '0') && (source[1] == '0') && (high >= 0) && (low >= 0))
+    {
+      buffer[idx] = (char)((high << 4) | low);
+    }
+    else
+    {
+      buffer[idx] = '*';
+    }
+  }
+
+  buffer[decoded_length] = '\0';
+
+  return decoded_length;
+}
@@ -0,0 +1,85 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// SIM800 Parsing
+//-------------------------------------------------------------------
+// The string handling that runs on every received byte/line, kept apart
+// from SIM800_Control so it can be tested and benchmarked on its own
+// (see extras/host, make parse-bench).  None of these keep any state.
+//
+//  sim800_frame_byte   - builds lines from the serial stream
+//  sim800_line_garbled - spots a line mangled on the wire
+//  sim800_classify_urc - which unsolicited result code a line holds
+//  sim800_classify_command - which group of commands a line sent belongs to
+//  sim800_csv_field    - finds a field of a comma separated reply
+//  sim800_find_ucs2    - spots text sent as UCS2 hex
+//  sim800_decode_ucs2  - decodes it (in place) to ASCII
+//-------------------------------------------------------------------
+
+#ifndef SIM800_PARSE_H
+#define SIM800_PARSE_H
+
+#include <Arduino.h>
+
+//Returned by sim800_find_ucs2 when the text isn't UCS2
+#define SIM800_NOT_UCS2 255
+
+enum Sim800_Urc_Type {URC_NONE,
+                      URC_USSD,           //+CUSD:
+                      URC_CALLER_ID,      //+CLIP:
+                      URC_CALL_STATE,     //+CLCC:
+                      URC_NO_CARRIER,
+                      URC_SMS,            //+CMTI: "SM"
+                      URC_READY,          //Call Ready / SMS Ready
+                      URC_CLOSED,
+                      SIM800_URC_TYPES};
+
+//Commands grouped by what they're for (for the metrics)
+enum Sim800_Command_Class {CMD_BASIC,         //AT, ATE, AT&F, AT+IPR...
+                           CMD_NETWORK,       //AT+CREG, AT+CSQ, AT+CFUN, AT+CCID
+                           CMD_SMS,           //AT+CMGx
+                           CMD_CALL,          //ATD, ATA, ATH, AT+CLCC, AT+CLIP
+                           CMD_USSD,          //AT+CUSD
+                           CMD_GPRS,          //AT+CGxxx, AT+CIPxxx, AT+CSTT...
+                           SIM800_COMMAND_CLASSES,
+                           CMD_NOT_A_COMMAND = 255};
+
+//Adds one received byte to <line>; returns true once it holds a complete,
+//non-empty line (CR terminated, LFs dropped).  A line that overfills the
+//buffer is thrown away
+bool sim800_frame_byte (char *line, byte *line_pos, byte line_size, char incoming);
+
+//True if the line holds bytes the module never sends (control codes, or
+//anything above 7 bit ASCII), as a baud rate mismatch or line noise leaves
+bool sim800_line_garbled (const char *line);
+
+//The first unsolicited result code found in the line, or URC_NONE
+byte sim800_classify_urc (const char *line);
+
+//The class of a command line (AT...), or CMD_NOT_A_COMMAND (blank lines,
+//SMS text, data)
+byte sim800_classify_command (const char *command);
+
+//Start of field <field> (0 = first) of a comma separated list, or NULL
+//if there aren't that many.  Quotes are not special
+char *sim800_csv_field (char *list, byte field);
+
+//Terminates the field in place at its closing comma; returns the field
+char *sim800_csv_cut (char *field);
+
+//Offset (in the first 8 chars) of what looks like UCS2 hex, or SIM800_NOT_UCS2
+byte sim800_find_ucs2 (const char *text);
+
+//Decode (in place) text sent as UCS2 hex, e.g. "0048006900210021" -> "Hi!!"
+//Characters outside ASCII are replaced with '*'.  Returns the new length
+byte sim800_decode_ucs2 (char *buffer, byte start_offset);
+
+#endif
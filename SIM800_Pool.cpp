@@ -0,0 +1,303 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+
+#include "SIM800_Pool.h"
+
+#if SIM800_ENABLE_SMS
+
+static_assert (SIM800_POOL_MAX_MODEMS <= 8, "SIM800_POOL_MAX_MODEMS must be 1..8 (tried_modems has a bit per modem)");
+
+//================================================================================================
+SIM800_Pool::SIM800_Pool()
+{
+  modem_count = 0;
+  next_modem = 0;
+  failing_modems = 0;
+
+  sent_count = 0;
+  failed_count = 0;
+  retry_count = 0;
+  start_time = 0;
+
+  memset (&sent_by_modem, 0, sizeof(sent_by_modem));
+  memset (&failed_by_modem, 0, sizeof(failed_by_modem));
+  memset (&failing_since, 0, sizeof(failing_since));
+  memset (&queue_length, 0, sizeof(queue_length));
+  memset (&jobs, 0, sizeof(jobs));
+}
+
+//================================================================================================
+bool SIM800_Pool::add_modem (SIM800_Control &modem)
+{
+  if (modem_count >= SIM800_POOL_MAX_MODEMS) return false;
+
+  pool_lock.lock();
+  modems[modem_count] = &modem;
+  queue_length[modem_count] = 0;
+  modem_count++;
+  pool_lock.unlock();
+
+  return true;
+}
+
+//================================================================================================
+bool SIM800_Pool::queue_sms (const char *dest_number, const char *message)
+{
+  byte job_idx = POOL_NO_JOB;
+  byte modem_idx;
+
+  if ((strlen(dest_number) >= MAX_CALLER_ID_SIZE) || (strlen(message) >= TX_BUFFER_SIZE)) return false;
+
+  pool_lock.lock();
+
+  modem_idx = least_loaded_modem(0);
+
+  for (byte idx = 0; ((idx < SIM800_POOL_JOBS) && (job_idx == POOL_NO_JOB)); idx++)
+  {
+    if (jobs[idx].in_use == false) job_idx = idx;
+  }
+
+  if ((job_idx == POOL_NO_JOB) || (modem_idx == POOL_NO_JOB))
+  {
+    pool_lock.unlock();
+    return false;
+  }
+
+  memset (&jobs[job_idx], 0, sizeof(Sim800_Pool_Job));
+  strcpy (jobs[job_idx].dest_number, dest_number);
+  strcpy (jobs[job_idx].message, message);
+  jobs[job_idx].in_use = true;
+
+  if (start_time == 0) start_time = millis();
+
+  push_job(modem_idx, job_idx);
+
+  pool_lock.unlock();
+  return true;
+}
+
+//================================================================================================
+bool SIM800_Pool::service (void)
+{
+  if (modem_count == 0) return false;
+
+  //Give each modem a turn
+  byte modem_idx = next_modem;
+  next_modem = (next_modem + 1) % modem_count;
+
+  return service (modem_idx);
+}
+
+//================================================================================================
+bool SIM800_Pool::service (byte modem_idx)
+{
+  if (modem_idx >= modem_count) return false;
+
+  SIM800_Control *modem = modems[modem_idx];
+
+  //Leave an unavailable (or busy) modem's queue for the others to take
+  if ((modem->initialised == false) || (modem->call_in_progress() == true)) return false;
+
+  //A failing modem sits out its back-off; its queue goes to the others
+  pool_lock.lock();
+  byte job_idx = (backing_off(modem_idx) == true) ? POOL_NO_JOB : claim_job(modem_idx);
+  pool_lock.unlock();
+
+  if (job_idx == POOL_NO_JOB) return false;
+
+  int resets_before = modem->gsm_resets;
+  unsigned int errors_before = modem->protocol_error_count;
+
+  modem->clear_sms_buffer();
+  strcpy (modem->sms_buffer, jobs[job_idx].message);
+
+  bool sent = modem->send_sms_from_buffer (jobs[job_idx].dest_number);
+
+  //A reboot part way through leaves the outcome uncertain; treat it as a failure
+  bool rebooted = (modem->gsm_resets != resets_before);
+  if (rebooted == true) sent = false;
+
+  //Tell a modem fault apart from a message the network turned down
+  bool modem_errored = ((rebooted == true) || (modem->protocol_error_count != errors_before));
+
+  pool_lock.lock();
+  finish_job(modem_idx, job_idx, sent, modem_errored);
+  pool_lock.unlock();
+
+  return sent;
+}
+
+//================================================================================================
+byte SIM800_Pool::pending (void)
+{
+  byte pending_jobs = 0;
+
+  pool_lock.lock();
+  for (byte idx = 0; idx < SIM800_POOL_JOBS; idx++)
+  {
+    if (jobs[idx].in_use == true) pending_jobs++;
+  }
+  pool_lock.unlock();
+
+  return pending_jobs;
+}
+
+//================================================================================================
+unsigned long SIM800_Pool::messages_per_hour (void)
+{
+  unsigned long elapsed = millis() - start_time;
+
+  if ((start_time == 0) || (elapsed == 0)) return 0;
+
+  return (unsigned long)(((unsigned long long)sent_count * 3600000ULL) / elapsed);
+}
+
+//================================================================================================
+bool SIM800_Pool::modem_failing (byte modem_idx)
+{
+  if (modem_idx >= modem_count) return false;
+
+  pool_lock.lock();
+  bool failing = backing_off(modem_idx);
+  pool_lock.unlock();
+
+  return failing;
+}
+
+//==================================================================================
+//==================================================================================
+bool SIM800_Pool::backing_off (byte modem_idx)
+{
+  if ((failing_modems & (1 << modem_idx)) == 0) return false;
+
+  //Give it another go once the back-off is over
+  if ((millis() - failing_since[modem_idx]) >= (SIM800_POOL_BACKOFF_S * 1000UL))
+  {
+    failing_modems &= ~(1 << modem_idx);
+    return false;
+  }
+
+  return true;
+}
+
+//==================================================================================
+//==================================================================================
+bool SIM800_Pool::modem_healthy (byte modem_idx)
+{
+  return ((modems[modem_idx]->initialised == true) && (backing_off(modem_idx) == false));
+}
+
+//==================================================================================
+//==================================================================================
+byte SIM800_Pool::least_loaded_modem (byte excluded_modems)
+{
+  byte best_modem = POOL_NO_JOB;
+  bool best_healthy = false;
+
+  for (byte idx = 0; idx < modem_count; idx++)
+  {
+    if (excluded_modems & (1 << idx)) continue;
+
+    bool healthy = modem_healthy(idx);
+
+    //Prefer modems that are up (and not failing), but fall back to any of them
+    if ((best_modem == POOL_NO_JOB) || ((healthy == true) && (best_healthy == false)) ||
+        ((healthy == best_healthy) && (queue_length[idx] < queue_length[best_modem])))
+    {
+      best_modem = idx;
+      best_healthy = healthy;
+    }
+  }
+
+  return best_modem;
+}
+
+//==================================================================================
+//==================================================================================
+void SIM800_Pool::push_job (byte modem_idx, byte job_idx)
+{
+  queue[modem_idx][queue_length[modem_idx]] = job_idx;
+  queue_length[modem_idx]++;
+}
+
+//==================================================================================
+//==================================================================================
+byte SIM800_Pool::claim_job (byte modem_idx)
+{
+  byte job_idx = POOL_NO_JOB;
+
+  if (queue_length[modem_idx] > 0)
+  {
+    //Take our own oldest job
+    job_idx = queue[modem_idx][0];
+    queue_length[modem_idx]--;
+    memmove (&queue[modem_idx][0], &queue[modem_idx][1], queue_length[modem_idx]);
+    return job_idx;
+  }
+
+  //Nothing of our own; steal the newest job from the busiest queue that we haven't already failed
+  byte victim = POOL_NO_JOB;
+  for (byte idx = 0; idx < modem_count; idx++)
+  {
+    if ((idx == modem_idx) || (queue_length[idx] == 0)) continue;
+    if (jobs[queue[idx][queue_length[idx] - 1]].tried_modems & (1 << modem_idx)) continue;
+
+    if ((victim == POOL_NO_JOB) || (queue_length[idx] > queue_length[victim])) victim = idx;
+  }
+
+  if (victim == POOL_NO_JOB) return POOL_NO_JOB;
+
+  queue_length[victim]--;
+  return queue[victim][queue_length[victim]];
+}
+
+//==================================================================================
+//==================================================================================
+void SIM800_Pool::finish_job (byte modem_idx, byte job_idx, bool sent, bool modem_errored)
+{
+  Sim800_Pool_Job *job = &jobs[job_idx];
+
+  if (sent == true)
+  {
+    sent_count++;
+    sent_by_modem[modem_idx]++;
+    job->in_use = false;
+    return;
+  }
+
+  failed_by_modem[modem_idx]++;
+
+  if (modem_errored == true)
+  {
+    LogError (TR_POOL_MODEM_FAIL, (unsigned int)modem_idx);
+    failing_modems |= (1 << modem_idx);
+    failing_since[modem_idx] = millis();
+  }
+
+  job->attempts++;
+  job->tried_modems |= (1 << modem_idx);
+
+  byte retry_modem = least_loaded_modem(job->tried_modems);
+
+  if ((job->attempts >= SIM800_POOL_MAX_ATTEMPTS) || (retry_modem == POOL_NO_JOB))
+  {
+    LogError (TR_POOL_SMS_FAIL, 0u);
+    failed_count++;
+    job->in_use = false;
+    return;
+  }
+
+  //Hand it to a modem that hasn't tried it yet
+  retry_count++;
+  push_job(retry_modem, job_idx);
+}
+
+#endif
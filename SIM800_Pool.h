@@ -0,0 +1,129 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// SIM800 Modem Pool
+//-------------------------------------------------------------------
+// Spreads outbound SMS across several SIM800_Control objects.
+//
+// - ::add_modem() each (already initialised) modem
+// - ::queue_sms(<number>, <message>) copies the message into the pool and
+//   places it on the least loaded modem's queue
+// - Call ::service() periodically; each call sends at most one message from
+//   the next modem in turn.  A modem with an empty queue takes work from the
+//   back of the busiest queue, and a send that fails (or that sees the modem 
+//   reboot) is moved to a modem that hasn't tried it yet
+// - A modem whose failed send also raised its ::protocol_error_count (or
+//   that rebooted) is left alone for SIM800_POOL_BACKOFF_S; new messages go
+//   to the healthy modems, and they take over its queue
+// - ::sent_count, ::failed_count, ::retry_count and ::messages_per_hour() 
+//   report the aggregate throughput; ::sent_by_modem, ::failed_by_modem and
+//   ::modem_failing() report on each modem
+//
+// To send in parallel (e.g. one Linux gateway thread per modem), call 
+// ::service(<modem index>) from each modem's own thread and build with 
+// SIM800_POOL_MUTEX set to a real mutex type (e.g. std::mutex)
+//
+// Needs SIM800_ENABLE_SMS
+//-------------------------------------------------------------------
+
+#ifndef SIM800_POOL_H
+#define SIM800_POOL_H
+
+#include "SIM800_Control.h"
+
+#if SIM800_ENABLE_SMS
+
+#ifndef SIM800_POOL_MAX_MODEMS
+  #define SIM800_POOL_MAX_MODEMS 4
+#endif
+
+//Messages held by the pool at once (each one costs ~185 bytes of RAM)
+#ifndef SIM800_POOL_JOBS
+  #define SIM800_POOL_JOBS 4
+#endif
+
+#ifndef SIM800_POOL_MAX_ATTEMPTS
+  #define SIM800_POOL_MAX_ATTEMPTS 3
+#endif
+
+//How long a failing modem is passed over
+#ifndef SIM800_POOL_BACKOFF_S
+  #define SIM800_POOL_BACKOFF_S 60
+#endif
+
+//Guards the queues when modems are serviced from several threads
+#ifndef SIM800_POOL_MUTEX
+  struct Sim800_Pool_No_Lock
+  {
+    inline void lock (void) {};
+    inline void unlock (void) {};
+  };
+  #define SIM800_POOL_MUTEX Sim800_Pool_No_Lock
+#endif
+
+#define POOL_NO_JOB 0xFF
+
+struct Sim800_Pool_Job
+{
+  char dest_number [MAX_CALLER_ID_SIZE];
+  char message [TX_BUFFER_SIZE];
+  byte attempts;
+  byte tried_modems;                     //One bit per modem
+  bool in_use;
+};
+
+class SIM800_Pool
+{
+  public:
+    SIM800_Pool (void);
+
+    unsigned long sent_count;
+    unsigned long failed_count;
+    unsigned long retry_count;
+    unsigned long sent_by_modem [SIM800_POOL_MAX_MODEMS];
+    unsigned long failed_by_modem [SIM800_POOL_MAX_MODEMS];   //Sends that failed there (and were retried or given up)
+
+    bool add_modem (SIM800_Control &modem);
+    bool queue_sms (const char *dest_number, const char *message);
+
+    bool service (void);
+    bool service (byte modem_idx);
+
+    byte pending (void);
+    unsigned long messages_per_hour (void);
+    bool modem_failing (byte modem_idx);
+
+  private:
+    SIM800_Control *modems [SIM800_POOL_MAX_MODEMS];
+    byte modem_count;
+    byte next_modem;
+
+    Sim800_Pool_Job jobs [SIM800_POOL_JOBS];
+    byte queue [SIM800_POOL_MAX_MODEMS][SIM800_POOL_JOBS];
+    byte queue_length [SIM800_POOL_MAX_MODEMS];
+
+    byte failing_modems;                 //One bit per modem
+    unsigned long failing_since [SIM800_POOL_MAX_MODEMS];
+
+    SIM800_POOL_MUTEX pool_lock;
+    unsigned long start_time;
+
+    bool backing_off (byte modem_idx);
+    bool modem_healthy (byte modem_idx);
+    byte least_loaded_modem (byte excluded_modems);
+    void push_job (byte modem_idx, byte job_idx);
+    byte claim_job (byte modem_idx);
+    void finish_job (byte modem_idx, byte job_idx, bool sent, bool modem_errored);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,360 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+
+#include "SIM800_Telemetry.h"
+
+#if SIM800_ENABLE_GPRS
+
+//<sequence>,<age>,<reading>\n
+#define TELEMETRY_LINE_SIZE (10 + 1 + 10 + 1 + SIM800_TELEMETRY_TEXT_SIZE + 1)
+
+#define TELEMETRY_SPILL_MAGIC 0xB5
+
+#define TELEMETRY_CAPACITY (SIM800_TELEMETRY_RECORDS + SIM800_TELEMETRY_EEPROM_RECORDS)
+
+static_assert ((SIM800_TELEMETRY_RECORDS > 0) && (SIM800_TELEMETRY_RECORDS < 256), "SIM800_TELEMETRY_RECORDS must be 1..255");
+static_assert (SIM800_TELEMETRY_EEPROM_RECORDS < 256, "SIM800_TELEMETRY_EEPROM_RECORDS must be 0..255");
+static_assert ((SIM800_TELEMETRY_BATCH > 0) && (SIM800_TELEMETRY_BATCH <= TELEMETRY_CAPACITY), "SIM800_TELEMETRY_BATCH must fit in the queue");
+static_assert (SIM800_TELEMETRY_PAYLOAD_MAX >= TELEMETRY_LINE_SIZE, "SIM800_TELEMETRY_PAYLOAD_MAX must hold a reading");
+
+#if SIM800_TELEMETRY_EEPROM && defined(E2END)
+static_assert ((SIM800_TELEMETRY_EEPROM_BASE + sizeof(Sim800_Telemetry_Spill_Header) +
+                (SIM800_TELEMETRY_EEPROM_RECORDS * sizeof(Sim800_Telemetry_Record))) <= (E2END + 1),
+               "The telemetry spill area doesn't fit in the EEPROM");
+#endif
+
+//================================================================================================
+SIM800_Telemetry::SIM800_Telemetry (SIM800_Control &modem) : gsm (modem)
+{
+  head = 0;
+  count = 0;
+
+  queued_count = 0;
+  sent_count = 0;
+  dropped_count = 0;
+  batch_count = 0;
+  failed_count = 0;
+
+  next_sequence = 1;
+  first_sequence = 1;
+  flushing = false;
+  retry_pending = false;
+  failure_time = 0;
+
+  memset (&records, 0, sizeof(records));
+
+#if SIM800_TELEMETRY_EEPROM
+  memset (&spill, 0, sizeof(spill));
+#endif
+}
+
+//================================================================================================
+void SIM800_Telemetry::begin (void)
+{
+#if SIM800_TELEMETRY_EEPROM
+  EEPROM.get (SIM800_TELEMETRY_EEPROM_BASE, spill);
+
+  //Start afresh if the area has never been used, or was laid out differently
+  if ((spill.magic != TELEMETRY_SPILL_MAGIC) || (spill.capacity != SIM800_TELEMETRY_EEPROM_RECORDS) ||
+      (spill.text_size != SIM800_TELEMETRY_TEXT_SIZE) || (spill.head >= SIM800_TELEMETRY_EEPROM_RECORDS) ||
+      (spill.count > SIM800_TELEMETRY_EEPROM_RECORDS))
+  {
+    spill.magic = TELEMETRY_SPILL_MAGIC;
+    spill.capacity = SIM800_TELEMETRY_EEPROM_RECORDS;
+    spill.text_size = SIM800_TELEMETRY_TEXT_SIZE;
+    spill.head = 0;
+    spill.count = 0;
+    spill.sequence_limit = 1;
+    save_spill_header();
+  }
+
+  //Any number below the limit may have gone out before the restart
+  next_sequence = spill.sequence_limit;
+  first_sequence = next_sequence;
+#endif
+}
+
+//================================================================================================
+bool SIM800_Telemetry::add (const char *reading)
+{
+  if ((strlen(reading) >= SIM800_TELEMETRY_TEXT_SIZE) || (strpbrk(reading, "\r\n") != NULL)) return false;
+
+#if SIM800_TELEMETRY_EEPROM
+  if (spill.magic != TELEMETRY_SPILL_MAGIC) begin();
+#endif
+
+  if (pending() >= TELEMETRY_CAPACITY)
+  {
+    //A flush (from the idle callback) has the oldest ones in hand; keep them
+    if (flushing == true)
+    {
+      dropped_count++;
+      return false;
+    }
+
+    remove_oldest (1);
+    dropped_count++;
+  }
+
+#if SIM800_TELEMETRY_EEPROM
+  //Make room in RAM by moving the oldest out to EEPROM
+  if (count >= SIM800_TELEMETRY_RECORDS) spill_oldest();
+#endif
+
+  Sim800_Telemetry_Record *record = &records[(head + count) % SIM800_TELEMETRY_RECORDS];
+
+  record->sequence = take_sequence();
+  record->time_ms = millis();
+  memset (record->text, 0, sizeof(record->text));
+  strcpy (record->text, reading);
+
+  count++;
+  queued_count++;
+
+  return true;
+}
+
+//================================================================================================
+bool SIM800_Telemetry::service (void)
+{
+  Sim800_Telemetry_Record oldest;
+
+  if (get_record (0, &oldest) == false) return false;
+
+  //Leave the modem to whatever it's doing
+  if ((gsm.initialised == false) || (gsm.link_free() == false) || (gsm.call_in_progress() == true)) return false;
+
+  if ((retry_pending == true) && ((millis() - failure_time) < (SIM800_TELEMETRY_RETRY_S * 1000UL))) return false;
+
+  //Send once there's a batch, or the oldest reading has waited long enough
+  //(one kept over a restart has waited long enough)
+  if ((pending() < SIM800_TELEMETRY_BATCH) && (oldest.sequence >= first_sequence) &&
+      ((millis() - oldest.time_ms) < (SIM800_TELEMETRY_MAX_AGE_S * 1000UL)))
+  {
+    return false;
+  }
+
+  return flush();
+}
+
+//================================================================================================
+bool SIM800_Telemetry::flush (void)
+{
+  Sim800_Telemetry_Record record;
+  char line [TELEMETRY_LINE_SIZE];
+  unsigned long flush_time = millis();
+  unsigned int batch = 0;
+  unsigned int length = 0;
+  bool sent = false;
+
+  if (flushing == true) return false;
+
+  //As many of the oldest as fit in one upload
+  while (get_record (batch, &record) == true)
+  {
+    unsigned int line_length = format_line (&record, flush_time, line);
+
+    if ((length + line_length) > SIM800_TELEMETRY_PAYLOAD_MAX) break;
+
+    length += line_length;
+    batch++;
+  }
+
+  if (batch == 0) return false;
+
+  flushing = true;
+  int resets_before = gsm.gsm_resets;
+
+  if (gsm.prep_for_web_submission() == true)
+  {
+    write_text_P (PSTR("POST " SIM800_TELEMETRY_PATH " HTTP/1.0\r\nHost: " SIM800_SERVER_HOST "\r\nContent-Length: "));
+    ultoa (length, line, 10);
+    write_text (line);
+    write_text_P (PSTR("\r\n\r\n"));
+
+    for (unsigned int idx = 0; idx < batch; idx++)
+    {
+      get_record (idx, &record);
+      format_line (&record, flush_time, line);
+      write_text (line);
+    }
+
+    //The body ends the request; nothing may follow it
+    sent = gsm.complete_web_submission (false);
+
+    //A reboot part way through leaves the outcome uncertain; send them again
+    if (gsm.gsm_resets != resets_before) sent = false;
+  }
+
+  flushing = false;
+
+  if (sent == false)
+  {
+    LogError (TR_TELEMETRY_FAIL, batch);
+    failed_count++;
+    retry_pending = true;
+    failure_time = millis();
+    return false;
+  }
+
+  LogInfo (TR_TELEMETRY_SENT, batch);
+  remove_oldest (batch);
+  sent_count += batch;
+  batch_count++;
+  retry_pending = false;
+
+  return true;
+}
+
+//================================================================================================
+unsigned int SIM800_Telemetry::pending (void)
+{
+#if SIM800_TELEMETRY_EEPROM
+  return count + spill.count;
+#else
+  return count;
+#endif
+}
+
+//================================================================================================
+bool SIM800_Telemetry::get_record (unsigned int idx, Sim800_Telemetry_Record *record)
+{
+#if SIM800_TELEMETRY_EEPROM
+  //The spilled readings are always the oldest
+  if (idx < spill.count)
+  {
+    EEPROM.get (spill_address ((spill.head + idx) % SIM800_TELEMETRY_EEPROM_RECORDS), *record);
+    return true;
+  }
+
+  idx -= spill.count;
+#endif
+
+  if (idx >= count) return false;
+
+  *record = records[(head + idx) % SIM800_TELEMETRY_RECORDS];
+  return true;
+}
+
+//================================================================================================
+void SIM800_Telemetry::remove_oldest (unsigned int removed)
+{
+  for (; removed > 0; removed--)
+  {
+#if SIM800_TELEMETRY_EEPROM
+    if (spill.count > 0)
+    {
+      spill.head = (spill.head + 1) % SIM800_TELEMETRY_EEPROM_RECORDS;
+      spill.count--;
+      continue;
+    }
+#endif
+
+    if (count == 0) break;
+
+    head = (head + 1) % SIM800_TELEMETRY_RECORDS;
+    count--;
+  }
+
+#if SIM800_TELEMETRY_EEPROM
+  save_spill_header();
+#endif
+}
+
+//================================================================================================
+unsigned long SIM800_Telemetry::take_sequence (void)
+{
+#if SIM800_TELEMETRY_EEPROM
+  //Reserve a block at a time, so the EEPROM isn't written for every reading
+  if (next_sequence >= spill.sequence_limit)
+  {
+    spill.sequence_limit = next_sequence + SIM800_TELEMETRY_SEQUENCE_BLOCK;
+    save_spill_header();
+  }
+#endif
+
+  return next_sequence++;
+}
+
+//================================================================================================
+unsigned int SIM800_Telemetry::format_line (const Sim800_Telemetry_Record *record, unsigned long flush_time, char *line)
+{
+  char *next = line;
+
+  ultoa (record->sequence, next, 10);
+  next += strlen(next);
+  *next++ = ',';
+
+  //Ages are taken from the start of the flush, so both passes agree
+  if (record->sequence < first_sequence)
+  {
+    *next++ = '-';
+  }
+  else
+  {
+    ultoa ((flush_time - record->time_ms) / 1000UL, next, 10);
+    next += strlen(next);
+  }
+
+  *next++ = ',';
+  strcpy (next, record->text);
+  next += strlen(next);
+  *next++ = '\n';
+  *next = '\0';
+
+  return (next - line);
+}
+
+//================================================================================================
+void SIM800_Telemetry::write_text (const char *text)
+{
+  while (*text != '\0') gsm.write (*text++);
+}
+
+//================================================================================================
+void SIM800_Telemetry::write_text_P (PGM_P text)
+{
+  char value;
+
+  while ((value = (char)pgm_read_byte(text++)) != '\0') gsm.write (value);
+}
+
+#if SIM800_TELEMETRY_EEPROM
+//================================================================================================
+int SIM800_Telemetry::spill_address (byte slot)
+{
+  return SIM800_TELEMETRY_EEPROM_BASE + sizeof(Sim800_Telemetry_Spill_Header) + (slot * sizeof(Sim800_Telemetry_Record));
+}
+
+//================================================================================================
+void SIM800_Telemetry::save_spill_header (void)
+{
+  //put() only writes the bytes that have changed
+  EEPROM.put (SIM800_TELEMETRY_EEPROM_BASE, spill);
+}
+
+//================================================================================================
+bool SIM800_Telemetry::spill_oldest (void)
+{
+  if ((count == 0) || (spill.count >= SIM800_TELEMETRY_EEPROM_RECORDS)) return false;
+
+  EEPROM.put (spill_address ((spill.head + spill.count) % SIM800_TELEMETRY_EEPROM_RECORDS), records[head]);
+  spill.count++;
+  save_spill_header();
+
+  head = (head + 1) % SIM800_TELEMETRY_RECORDS;
+  count--;
+
+  return true;
+}
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// SIM800 Telemetry Store-and-Forward
+//-------------------------------------------------------------------
+// Collects readings and uploads them in batches, one GPRS connection per
+// batch rather than one per reading.
+//
+// - ::add(<reading>) queues a short line of text (e.g. "t=21.5,h=40"),
+//   stamped with a sequence number and the time it was taken
+// - Call ::service() periodically.  Once SIM800_TELEMETRY_BATCH readings are
+//   waiting, or the oldest has waited SIM800_TELEMETRY_MAX_AGE_S, the queue
+//   is sent (oldest first) as one HTTP POST to SIM800_SERVER_HOST:
+//     <sequence>,<age in seconds>,<reading>\n  ...
+//   The age is "-" for a reading kept over a restart.  ::flush() sends
+//   straight away
+// - Readings are only removed once the server acknowledges the batch
+//   (+BOB: 1, see ::complete_web_submission); anything else leaves them
+//   queued for the next attempt, SIM800_TELEMETRY_RETRY_S later.  Delivery is
+//   at-least-once, so the server should ignore sequence numbers it has seen
+// - When the queue is full the oldest reading is dropped (::dropped_count)
+//
+// Define SIM800_TELEMETRY_EEPROM 1 to spill the oldest readings to EEPROM
+// instead of dropping them when the RAM queue fills.  ::begin() then picks
+// up whatever was left there before a restart, and sequence numbers carry
+// on across restarts (reserved in blocks, to spare the EEPROM)
+//
+// Needs SIM800_ENABLE_GPRS.  ::add() may be called from ::call_when_idle
+// (e.g. to keep sampling during a flush); ::service() and ::flush() may not
+//-------------------------------------------------------------------
+
+#ifndef SIM800_TELEMETRY_H
+#define SIM800_TELEMETRY_H
+
+#include "SIM800_Control.h"
+
+#if SIM800_ENABLE_GPRS
+
+//Readings held in RAM (each one costs SIM800_TELEMETRY_TEXT_SIZE + 8 bytes)
+#ifndef SIM800_TELEMETRY_RECORDS
+  #define SIM800_TELEMETRY_RECORDS 8
+#endif
+
+#ifndef SIM800_TELEMETRY_TEXT_SIZE
+  #define SIM800_TELEMETRY_TEXT_SIZE 24
+#endif
+
+//Flush triggers
+#ifndef SIM800_TELEMETRY_BATCH
+  #define SIM800_TELEMETRY_BATCH 6
+#endif
+
+#ifndef SIM800_TELEMETRY_MAX_AGE_S
+  #define SIM800_TELEMETRY_MAX_AGE_S 900
+#endif
+
+//Wait after a failed flush
+#ifndef SIM800_TELEMETRY_RETRY_S
+  #define SIM800_TELEMETRY_RETRY_S 120
+#endif
+
+//Most bytes of readings sent over one connection (the rest go next time)
+#ifndef SIM800_TELEMETRY_PAYLOAD_MAX
+  #define SIM800_TELEMETRY_PAYLOAD_MAX 1024
+#endif
+
+#ifndef SIM800_TELEMETRY_PATH
+  #define SIM800_TELEMETRY_PATH "/telemetry"
+#endif
+
+#ifndef SIM800_TELEMETRY_EEPROM
+  #define SIM800_TELEMETRY_EEPROM 0
+#endif
+
+#if SIM800_TELEMETRY_EEPROM
+  #include <EEPROM.h>
+
+  //Where the spill area starts, and how many readings it holds
+  #ifndef SIM800_TELEMETRY_EEPROM_BASE
+    #define SIM800_TELEMETRY_EEPROM_BASE 0
+  #endif
+
+  #ifndef SIM800_TELEMETRY_EEPROM_RECORDS
+    #define SIM800_TELEMETRY_EEPROM_RECORDS 16
+  #endif
+
+  //Sequence numbers reserved per EEPROM write
+  #define SIM800_TELEMETRY_SEQUENCE_BLOCK 64
+#else
+  #define SIM800_TELEMETRY_EEPROM_RECORDS 0
+#endif
+
+struct Sim800_Telemetry_Record
+{
+  unsigned long sequence;
+  unsigned long time_ms;
+  char text [SIM800_TELEMETRY_TEXT_SIZE];
+};
+
+//Start of the EEPROM spill area; the records follow it
+struct Sim800_Telemetry_Spill_Header
+{
+  byte magic;
+  byte capacity;
+  byte text_size;
+  byte head;
+  byte count;
+  unsigned long sequence_limit;          //Every number below this may have been used
+};
+
+class SIM800_Telemetry
+{
+  public:
+    SIM800_Telemetry (SIM800_Control &modem);
+
+    unsigned long queued_count;
+    unsigned long sent_count;            //Acknowledged by the server
+    unsigned long dropped_count;
+    unsigned long batch_count;
+    unsigned long failed_count;          //Flushes that weren't acknowledged
+
+    void begin (void);
+    bool add (const char *reading);
+
+    bool service (void);
+    bool flush (void);
+
+    unsigned int pending (void);
+
+  private:
+    SIM800_Control &gsm;
+
+    Sim800_Telemetry_Record records [SIM800_TELEMETRY_RECORDS];
+    byte head;
+    byte count;
+
+    unsigned long next_sequence;
+    unsigned long first_sequence;        //Of this run; older ones have no age
+    bool flushing;
+    bool retry_pending;
+    unsigned long failure_time;
+
+#if SIM800_TELEMETRY_EEPROM
+    Sim800_Telemetry_Spill_Header spill;
+
+    int spill_address (byte slot);
+    void save_spill_header (void);
+    bool spill_oldest (void);
+#endif
+
+    bool get_record (unsigned int idx, Sim800_Telemetry_Record *record);
+    void remove_oldest (unsigned int removed);
+    unsigned long take_sequence (void);
+    unsigned int format_line (const Sim800_Telemetry_Record *record, unsigned long flush_time, char *line);
+    void write_text (const char *text);
+    void write_text_P (PGM_P text);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,183 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+#include "SIM800_Trace.h"
+
+//Event names, in id order
+#define SIM800_TRACE_NAME(id, name) static const char id##_NAME[] PROGMEM = name;
+#define SIM800_TRACE_NAME_ENTRY(id, name) id##_NAME,
+
+SIM800_TRACE_EVENTS (SIM800_TRACE_NAME)
+
+static const char * const TRACE_NAMES[SIM800_TRACE_IDS] PROGMEM = {SIM800_TRACE_EVENTS (SIM800_TRACE_NAME_ENTRY)};
+
+static_assert ((SIM800_TRACE_SIZE > 0) && (SIM800_TRACE_SIZE < 256), "SIM800_TRACE_SIZE must be 1..255");
+static_assert (SIM800_TRACE_TEXT_SIZE >= sizeof(unsigned int), "SIM800_TRACE_TEXT_SIZE must hold a number");
+
+#if (SIM800_LOG_LEVEL > SIM800_LOG_NONE) && (SIM800_LOG_OUTPUT == SIM800_LOG_TO_TRACE)
+Sim800_Trace sim800_trace;
+#endif
+
+//================================================================================================
+static const __FlashStringHelper *trace_name (byte id)
+{
+  if (id >= SIM800_TRACE_IDS) return F("?");
+
+  return (const __FlashStringHelper *)pgm_read_ptr(&TRACE_NAMES[id]);
+}
+
+//================================================================================================
+void sim800_log_print (byte id, unsigned int value)
+{
+  Serial.print (trace_name(id));
+
+  if (value != 0)
+  {
+    Serial.print (' ');
+    Serial.print (value);
+  }
+
+  Serial.println ();
+}
+
+//================================================================================================
+void sim800_log_print (byte id, const char *text)
+{
+  Serial.print (trace_name(id));
+  Serial.print (' ');
+  Serial.println (text);
+}
+
+//================================================================================================
+void sim800_log_print (byte id, const __FlashStringHelper *text)
+{
+  Serial.print (trace_name(id));
+  Serial.print (' ');
+  Serial.println (text);
+}
+
+//================================================================================================
+Sim800_Trace::Sim800_Trace()
+{
+  clear();
+}
+
+//================================================================================================
+void Sim800_Trace::clear (void)
+{
+  head = 0;
+  used = 0;
+  overwritten = 0;
+}
+
+//================================================================================================
+Sim800_Trace_Record *Sim800_Trace::next_record (byte id)
+{
+  Sim800_Trace_Record *record = &ring[head];
+
+  head = (head + 1) % SIM800_TRACE_SIZE;
+  if (used < SIM800_TRACE_SIZE) used++;
+  else overwritten++;
+
+  record->time_ms = millis();
+  record->id = id;
+
+  return record;
+}
+
+//================================================================================================
+void Sim800_Trace::log (byte id, unsigned int value)
+{
+  Sim800_Trace_Record *record = next_record (id);
+
+  record->length = SIM800_TRACE_NUMBER;
+  memcpy (record->args, &value, sizeof(value));
+}
+
+//================================================================================================
+void Sim800_Trace::log (byte id, const char *text)
+{
+  Sim800_Trace_Record *record = next_record (id);
+  size_t length = strlen (text);
+
+  record->length = (length < SIM800_TRACE_NUMBER) ? length : (SIM800_TRACE_NUMBER - 1);
+  strncpy (record->args, text, SIM800_TRACE_TEXT_SIZE);
+}
+
+//================================================================================================
+void Sim800_Trace::log (byte id, const __FlashStringHelper *text)
+{
+  Sim800_Trace_Record *record = next_record (id);
+  size_t length = strlen_P ((PGM_P)text);
+
+  record->length = (length < SIM800_TRACE_NUMBER) ? length : (SIM800_TRACE_NUMBER - 1);
+  strncpy_P (record->args, (PGM_P)text, SIM800_TRACE_TEXT_SIZE);
+}
+
+//================================================================================================
+bool Sim800_Trace::get (byte idx, Sim800_Trace_Record *record)
+{
+  if (idx >= used) return false;
+
+  *record = ring[(head + SIM800_TRACE_SIZE - used + idx) % SIM800_TRACE_SIZE];
+  return true;
+}
+
+//================================================================================================
+void Sim800_Trace::dump (void)
+{
+  //#SIM800 trace <records overwritten>
+  //<ms> <event> <number> | <ms> <event> "<start of line>" <length>
+  Serial.print (F("#SIM800 trace "));
+  Serial.println (overwritten);
+
+  Sim800_Trace_Record record;
+
+  for (byte idx = 0; get (idx, &record) == true; idx++)
+  {
+    Serial.print (record.time_ms);
+    Serial.print (' ');
+    Serial.print (trace_name(record.id));
+    Serial.print (' ');
+
+    if (record.length == SIM800_TRACE_NUMBER)
+    {
+      unsigned int value;
+      memcpy (&value, record.args, sizeof(value));
+      Serial.println (value);
+      continue;
+    }
+
+    Serial.print ('\"');
+    for (byte chr = 0; (chr < record.length) && (chr < SIM800_TRACE_TEXT_SIZE); chr++)
+    {
+      //Control characters as ^M, ^J, ^Z...
+      if ((byte)record.args[chr] < 0x20)
+      {
+        Serial.print ('^');
+        Serial.print ((char)(record.args[chr] + 0x40));
+      }
+      else
+      {
+        Serial.print (record.args[chr]);
+      }
+    }
+    Serial.print ('\"');
+
+    if (record.length > SIM800_TRACE_TEXT_SIZE)
+    {
+      Serial.print (' ');
+      Serial.print (record.length);
+    }
+    Serial.println ();
+  }
+
+  Serial.println (F("#end"));
+}
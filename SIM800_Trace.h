@@ -0,0 +1,169 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// SIM800 Logging
+//-------------------------------------------------------------------
+// Every message the library logs has a level and an event id (below).
+// Anything above SIM800_LOG_LEVEL is removed at compile time, arguments
+// and all, so the default (SIM800_LOG_NONE) costs nothing.
+//
+// Enabled messages go to sim800_trace, a ring of SIM800_TRACE_SIZE small
+// binary records (time, event id, a number or the start of a line) that
+// costs a few microseconds per message.  Print it when it's wanted with
+// sim800_trace.dump(), or read the records with ::count() / ::get().
+// Define SIM800_LOG_OUTPUT SIM800_LOG_TO_SERIAL to print each message to
+// Serial as it happens instead (slow; each line holds up the exchange).
+//
+//  SIM800_LOG_ERROR - failures ("F! ..."); protocol errors carry the line
+//                     number of the check that failed
+//  SIM800_LOG_INFO  - start-up, recovery steps and URCs
+//  SIM800_LOG_TRACE - every line sent and received
+//-------------------------------------------------------------------
+
+#ifndef SIM800_TRACE_H
+#define SIM800_TRACE_H
+
+#include <Arduino.h>
+
+#define SIM800_LOG_NONE  0
+#define SIM800_LOG_ERROR 1
+#define SIM800_LOG_INFO  2
+#define SIM800_LOG_TRACE 3
+
+#ifndef SIM800_LOG_LEVEL
+  #define SIM800_LOG_LEVEL SIM800_LOG_NONE
+#endif
+
+#define SIM800_LOG_TO_TRACE  0
+#define SIM800_LOG_TO_SERIAL 1
+
+#ifndef SIM800_LOG_OUTPUT
+  #define SIM800_LOG_OUTPUT SIM800_LOG_TO_TRACE
+#endif
+
+//Records held (the oldest are overwritten)
+#ifndef SIM800_TRACE_SIZE
+  #define SIM800_TRACE_SIZE 16
+#endif
+
+//How much of a logged line each record keeps
+#ifndef SIM800_TRACE_TEXT_SIZE
+  #define SIM800_TRACE_TEXT_SIZE 8
+#endif
+
+//-------------------------------------------------------------------
+// Event ids and their names, kept together so they can't drift apart
+#define SIM800_TRACE_EVENTS(EVENT) \
+  EVENT (TR_PROTO_FAILURE,   "F! Proto") \
+  EVENT (TR_NO_ANSWER,       "F! NoAnswer") \
+  EVENT (TR_CALL_TOO_LONG,   "F! CallTooLong") \
+  EVENT (TR_SLICE_INIT_FAIL, "F! SliceInit") \
+  EVENT (TR_USSD_TIMEOUT,    "F! Ussd") \
+  EVENT (TR_USSD_DISPLACED,  "F! UssdDisplaced") \
+  EVENT (TR_BAUD_FAIL,       "F! Baud") \
+  EVENT (TR_NO_RESPONSE,     "F! NoResp") \
+  EVENT (TR_RESET_FAIL,      "F! RstFail") \
+  EVENT (TR_NO_SIM,          "F! NoSim") \
+  EVENT (TR_RESUME_FAIL,     "F! Resume") \
+  EVENT (TR_INIT_FAIL,       "F! InitFail") \
+  EVENT (TR_CALL_INIT_FAIL,  "F! CallInit") \
+  EVENT (TR_NET_START_FAIL,  "F! NetStart") \
+  EVENT (TR_NO_IP,           "F! NoIP") \
+  EVENT (TR_SERVER_FAIL,     "F! ServerConnect") \
+  EVENT (TR_SEND_FAIL,       "F! SendFail") \
+  EVENT (TR_SITE_FAIL,       "F! SiteFail") \
+  EVENT (TR_POOL_SMS_FAIL,   "F! PoolSms") \
+  EVENT (TR_POOL_MODEM_FAIL, "F! PoolModem") \
+  EVENT (TR_TELEMETRY_FAIL,  "F! Telemetry") \
+  EVENT (TR_BAUD_DOWN,       "BaudDown") \
+  EVENT (TR_BAUD_UP,         "BaudUp") \
+  EVENT (TR_RESUME,          "Resume") \
+  EVENT (TR_REINIT,          "Re-Init") \
+  EVENT (TR_INIT_OK,         "InitOk") \
+  EVENT (TR_RESUME_OK,       "ResumeOk") \
+  EVENT (TR_PROFILE_OK,      "ProfileOk") \
+  EVENT (TR_SIM_OK,          "SimOk") \
+  EVENT (TR_TELEMETRY_SENT,  "TelemetrySent") \
+  EVENT (TR_URC_RING,        "URC=RING") \
+  EVENT (TR_URC_SMS,         "URC=SMS") \
+  EVENT (TR_URC_REBOOT,      "URC=REBOOT") \
+  EVENT (TR_URC_USSD,        "URC=USSD") \
+  EVENT (TR_SMS_ID,          "SmsId:") \
+  EVENT (TR_TX_COMMAND,      "TxC:") \
+  EVENT (TR_TX_ASYNC,        "TxA:") \
+  EVENT (TR_TX_SLICE,        "TxS:") \
+  EVENT (TR_RX_LINE,         "Rx:")
+
+#define SIM800_TRACE_ENUM(id, name) id,
+
+enum Sim800_Trace_Id {SIM800_TRACE_EVENTS (SIM800_TRACE_ENUM)
+                      SIM800_TRACE_IDS};
+
+//Marks a record holding a number rather than text
+#define SIM800_TRACE_NUMBER 0xFF
+
+struct Sim800_Trace_Record
+{
+  unsigned long time_ms;
+  byte id;
+  byte length;                           //Of the line logged (up to 254), or SIM800_TRACE_NUMBER
+  char args [SIM800_TRACE_TEXT_SIZE];    //Start of the line, or the number
+};
+
+//-------------------------------------------------------------------
+class Sim800_Trace
+{
+  public:
+    Sim800_Trace (void);
+
+    unsigned int overwritten;
+
+    void log (byte id, unsigned int value);
+    void log (byte id, const char *text);
+    void log (byte id, const __FlashStringHelper *text);
+
+    inline byte count (void) { return used; };
+    bool get (byte idx, Sim800_Trace_Record *record);   //0 = oldest
+    void dump (void);
+    void clear (void);
+
+  private:
+    Sim800_Trace_Record ring [SIM800_TRACE_SIZE];
+    byte head;
+    byte used;
+
+    Sim800_Trace_Record *next_record (byte id);
+};
+
+//Prints an event as it happens (SIM800_LOG_TO_SERIAL)
+void sim800_log_print (byte id, unsigned int value);
+void sim800_log_print (byte id, const char *text);
+void sim800_log_print (byte id, const __FlashStringHelper *text);
+
+//-------------------------------------------------------------------
+#if (SIM800_LOG_LEVEL > SIM800_LOG_NONE) && (SIM800_LOG_OUTPUT == SIM800_LOG_TO_TRACE)
+  extern Sim800_Trace sim800_trace;
+
+  #define SIM800_LOG(level, id, arg) do { if ((level) <= SIM800_LOG_LEVEL) sim800_trace.log (id, arg); } while (0)
+#elif (SIM800_LOG_LEVEL > SIM800_LOG_NONE)
+  #define SIM800_LOG(level, id, arg) do { if ((level) <= SIM800_LOG_LEVEL) sim800_log_print (id, arg); } while (0)
+#else
+  #define SIM800_LOG(level, id, arg) do { } while (0)
+#endif
+
+#define LogError(id, arg) SIM800_LOG (SIM800_LOG_ERROR, id, arg)
+#define LogInfo(id, arg)  SIM800_LOG (SIM800_LOG_INFO, id, arg)
+#define LogTrace(id, arg) SIM800_LOG (SIM800_LOG_TRACE, id, arg)
+
+//A protocol error, tagged with where it was found
+#define LogProtocolFailure() LogError (TR_PROTO_FAILURE, (unsigned int)__LINE__)
+
+#endif
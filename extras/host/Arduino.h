@@ -0,0 +1,119 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Host (Linux) stand-ins for the Arduino core
+//-------------------------------------------------------------------
+// Just enough of <Arduino.h> for SIM800_Control to build and run on a 
+// Linux host.  PROGMEM is ordinary memory, pins hold whatever was last
+// written to them (or whatever a simulated device attached to an input pin
+// says), and Serial (used by the debug output) goes to stderr.
+//
+// Time runs from the real monotonic clock, or (after 
+// host_clock_set_virtual(true)) from a virtual clock that only moves when
+// delay() is called or something (e.g. the simulator) advances it, so long
+// timeouts cost no real time
+//-------------------------------------------------------------------
+
+#ifndef SIM800_HOST_ARDUINO_H
+#define SIM800_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <functional>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+#define DEC 10
+#define HEX 16
+
+//Program memory is just memory on the host
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+
+#define strstr_P strstr
+#define strchr_P strchr
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+#define pgm_read_byte(p) (*(p))
+#define pgm_read_word(p) (*(p))
+#define pgm_read_dword(p) (*(p))
+#define pgm_read_ptr(p) (*(p))
+
+char *ltoa (long value, char *buffer, int radix);
+char *ultoa (unsigned long value, char *buffer, int radix);
+
+unsigned long millis (void);
+unsigned long micros (void);
+void delay (unsigned long ms);
+
+//Host only
+void host_clock_set_virtual (bool use_virtual);
+bool host_clock_is_virtual (void);
+void host_clock_advance_us (unsigned long long elapsed_us);
+unsigned long long host_clock_us (void);
+unsigned long long host_delay_us (void);
+
+void pinMode (uint8_t pin, uint8_t mode);
+void digitalWrite (uint8_t pin, uint8_t value);
+int digitalRead (uint8_t pin);
+
+//Host only: digitalRead(<pin>) asks <reader> from now on, and digitalWrite(<pin>) calls
+//<watcher> just before the level changes (empty ones detach them)
+void host_pin_attach (uint8_t pin, std::function<int (void)> reader);
+void host_pin_watch (uint8_t pin, std::function<void (void)> watcher);
+
+//Console used for the debug output
+class Sim800_Host_Console
+{
+  public:
+    Sim800_Host_Console (void) : muted (false) {}
+
+    bool muted;
+
+    void begin (long) {}
+    void flush (void) { fflush (stderr); }
+    int available (void) { return 0; }
+    int read (void) { return -1; }
+
+    size_t print (const char *text) { return muted ? 0 : fprintf (stderr, "%s", text); }
+    size_t print (const __FlashStringHelper *text) { return print ((const char *)text); }
+    size_t print (char value) { return muted ? 0 : fprintf (stderr, "%c", value); }
+    size_t print (long value, int base = DEC) { return muted ? 0 : fprintf (stderr, (base == HEX) ? "%lx" : "%ld", value); }
+    size_t print (int value, int base = DEC) { return print ((long)value, base); }
+    size_t print (unsigned long value, int base = DEC) { return muted ? 0 : fprintf (stderr, (base == HEX) ? "%lx" : "%lu", value); }
+    size_t print (unsigned int value, int base = DEC) { return print ((unsigned long)value, base); }
+    size_t print (unsigned char value, int base = DEC) { return print ((unsigned long)value, base); }
+
+    template <typename T> size_t println (T value) { return print (value) + print ('\n'); }
+    template <typename T> size_t println (T value, int base) { return print (value, base) + print ('\n'); }
+    size_t println (void) { return print ('\n'); }
+};
+
+extern Sim800_Host_Console Serial;
+
+#endif
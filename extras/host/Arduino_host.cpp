@@ -0,0 +1,153 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+#include <time.h>
+
+Sim800_Host_Console Serial;
+Sim800_Host_EEPROM EEPROM;
+
+//================================================================================================
+static unsigned long long clock_us (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((unsigned long long)now.tv_sec * 1000000ULL) + (now.tv_nsec / 1000);
+}
+
+//Like the Arduino, time starts from when the program does
+static unsigned long long start_us = clock_us();
+
+static bool virtual_clock = false;
+static unsigned long long virtual_us = 0;
+
+//Total time spent in delay(), to separate our own pauses from waiting on the module
+static unsigned long long delayed_us = 0;
+
+#define HOST_PINS 64
+
+static uint8_t pin_levels [HOST_PINS];
+static std::function<int (void)> pin_readers [HOST_PINS];
+static std::function<void (void)> pin_watchers [HOST_PINS];
+
+//================================================================================================
+void host_clock_set_virtual (bool use_virtual)
+{
+  //Carry on from the current time, so millis() never goes backwards
+  if (use_virtual == true) virtual_us = host_clock_us();
+  else start_us = clock_us() - host_clock_us();
+
+  virtual_clock = use_virtual;
+}
+
+//================================================================================================
+bool host_clock_is_virtual (void)
+{
+  return virtual_clock;
+}
+
+//================================================================================================
+void host_clock_advance_us (unsigned long long elapsed_us)
+{
+  if (virtual_clock == true) virtual_us += elapsed_us;
+}
+
+//================================================================================================
+unsigned long long host_clock_us (void)
+{
+  if (virtual_clock == true) return virtual_us;
+
+  return clock_us() - start_us;
+}
+
+//================================================================================================
+unsigned long long host_delay_us (void)
+{
+  return delayed_us;
+}
+
+//================================================================================================
+unsigned long millis (void)
+{
+  return (unsigned long)(host_clock_us() / 1000ULL);
+}
+
+//================================================================================================
+unsigned long micros (void)
+{
+  return (unsigned long)host_clock_us();
+}
+
+//================================================================================================
+void delay (unsigned long ms)
+{
+  delayed_us += (unsigned long long)ms * 1000ULL;
+
+  if (virtual_clock == true)
+  {
+    virtual_us += (unsigned long long)ms * 1000ULL;
+    return;
+  }
+
+  struct timespec pause;
+  pause.tv_sec = ms / 1000;
+  pause.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep (&pause, NULL);
+}
+
+//================================================================================================
+void pinMode (uint8_t, uint8_t) {}
+
+//================================================================================================
+void digitalWrite (uint8_t pin, uint8_t value)
+{
+  if (pin >= HOST_PINS) return;
+
+  if (pin_watchers[pin] && (pin_levels[pin] != value)) pin_watchers[pin]();
+  pin_levels[pin] = value;
+}
+
+//================================================================================================
+int digitalRead (uint8_t pin)
+{
+  if (pin >= HOST_PINS) return LOW;
+  if (pin_readers[pin]) return pin_readers[pin]();
+
+  return pin_levels[pin];
+}
+
+//================================================================================================
+void host_pin_attach (uint8_t pin, std::function<int (void)> reader)
+{
+  if (pin < HOST_PINS) pin_readers[pin] = reader;
+}
+
+//================================================================================================
+void host_pin_watch (uint8_t pin, std::function<void (void)> watcher)
+{
+  if (pin < HOST_PINS) pin_watchers[pin] = watcher;
+}
+
+//================================================================================================
+char *ltoa (long value, char *buffer, int radix)
+{
+  sprintf (buffer, (radix == 16) ? "%lx" : "%ld", value);
+  return buffer;
+}
+
+//================================================================================================
+char *ultoa (unsigned long value, char *buffer, int radix)
+{
+  sprintf (buffer, (radix == 16) ? "%lx" : "%lu", value);
+  return buffer;
+}
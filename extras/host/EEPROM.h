@@ -0,0 +1,57 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Host (Linux) stand-in for the Arduino EEPROM library
+//-------------------------------------------------------------------
+// RAM backed, so it only lasts as long as the program; enough to exercise
+// SIM800_TELEMETRY_EEPROM builds.  ::writes counts the cells written, to 
+// check how hard the EEPROM would be worked
+//-------------------------------------------------------------------
+
+#ifndef SIM800_HOST_EEPROM_H
+#define SIM800_HOST_EEPROM_H
+
+#include "Arduino.h"
+
+#define E2END 1023
+
+class Sim800_Host_EEPROM
+{
+  public:
+    Sim800_Host_EEPROM (void) : writes (0) { memset (cells, 0xFF, sizeof(cells)); }
+
+    unsigned long writes;
+
+    uint8_t read (int address) { return cells[address]; }
+    void write (int address, uint8_t value) { cells[address] = value; writes++; }
+    void update (int address, uint8_t value) { if (cells[address] != value) write (address, value); }
+    uint16_t length (void) { return sizeof(cells); }
+
+    template <typename T> T &get (int address, T &value) { memcpy (&value, &cells[address], sizeof(T)); return value; }
+
+    template <typename T> const T &put (int address, const T &value)
+    {
+      const uint8_t *bytes = (const uint8_t *)&value;
+
+      for (size_t idx = 0; idx < sizeof(T); idx++) update (address + idx, bytes[idx]);
+      return value;
+    }
+
+    //Host only: forget everything, as if the part were new
+    void erase (void) { memset (cells, 0xFF, sizeof(cells)); }
+
+  private:
+    uint8_t cells [E2END + 1];
+};
+
+extern Sim800_Host_EEPROM EEPROM;
+
+#endif
@@ -0,0 +1,440 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+#include "SIM800_Linux.h"
+#include "SIM800_Control.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+//================================================================================================
+static speed_t baud_to_speed (long baud_rate)
+{
+  switch (baud_rate)
+  {
+    case 1200 :   return B1200;
+    case 2400 :   return B2400;
+    case 4800 :   return B4800;
+    case 19200 :  return B19200;
+    case 38400 :  return B38400;
+    case 57600 :  return B57600;
+    case 115200 : return B115200;
+    case 230400 : return B230400;
+    case 460800 : return B460800;
+    default :     return B9600;
+  }
+}
+
+//================================================================================================
+Sim800_Linux_Serial::Sim800_Linux_Serial (const char *device_path)
+{
+  memset (&device, 0, sizeof(char) * sizeof(device));
+  strncpy (device, device_path, sizeof(device) - 1);
+
+  fd = -1;
+  baud = 9600;
+  hardware_flow_control = false;
+  port_lost = false;
+  overflow_count = 0;
+  overflows_reported = 0;
+  rx_head = 0;
+  rx_tail = 0;
+}
+
+//================================================================================================
+Sim800_Linux_Serial::~Sim800_Linux_Serial (void)
+{
+  close_port();
+}
+
+//================================================================================================
+bool Sim800_Linux_Serial::open_port (void)
+{
+  {
+    std::lock_guard<std::mutex> guard (port_lock);
+
+    if (fd >= 0) return true;
+
+    fd = open (device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    port_lost = false;
+  }
+
+  apply_settings();
+  return true;
+}
+
+//================================================================================================
+void Sim800_Linux_Serial::close_port (void)
+{
+  std::lock_guard<std::mutex> guard (port_lock);
+
+  if (fd < 0) return;
+
+  close (fd);
+  fd = -1;
+}
+
+//================================================================================================
+void Sim800_Linux_Serial::begin (long baud_rate)
+{
+  baud = baud_rate;
+
+  if (fd < 0) open_port();
+  else apply_settings();
+}
+
+//================================================================================================
+void Sim800_Linux_Serial::set_flow_control (bool rts_cts)
+{
+  hardware_flow_control = rts_cts;
+  apply_settings();
+}
+
+//================================================================================================
+void Sim800_Linux_Serial::apply_settings (void)
+{
+  struct termios settings;
+  std::lock_guard<std::mutex> guard (port_lock);
+
+  if (fd < 0) return;
+  if (tcgetattr (fd, &settings) != 0) return;
+
+  //Raw 8N1, no modem control
+  cfmakeraw (&settings);
+  settings.c_cflag |= (CLOCAL | CREAD);
+  settings.c_cflag &= ~CSTOPB;
+
+  if (hardware_flow_control == true) settings.c_cflag |= CRTSCTS;
+  else settings.c_cflag &= ~CRTSCTS;
+
+  cfsetispeed (&settings, baud_to_speed(baud));
+  cfsetospeed (&settings, baud_to_speed(baud));
+
+  tcsetattr (fd, TCSADRAIN, &settings);
+}
+
+//================================================================================================
+int Sim800_Linux_Serial::available (void)
+{
+  std::lock_guard<std::mutex> guard (rx_lock);
+
+  return (int)((rx_head + SIM800_LINUX_RX_SIZE - rx_tail) % SIM800_LINUX_RX_SIZE);
+}
+
+//================================================================================================
+int Sim800_Linux_Serial::read (void)
+{
+  std::lock_guard<std::mutex> guard (rx_lock);
+
+  if (rx_head == rx_tail) return -1;
+
+  uint8_t rx_byte = rx_ring[rx_tail];
+  rx_tail = (rx_tail + 1) % SIM800_LINUX_RX_SIZE;
+
+  return rx_byte;
+}
+
+//================================================================================================
+bool Sim800_Linux_Serial::overflow (void)
+{
+  std::lock_guard<std::mutex> guard (rx_lock);
+
+  bool overflowed = (overflow_count != overflows_reported);
+
+  overflows_reported = overflow_count;
+  return overflowed;
+}
+
+//================================================================================================
+size_t Sim800_Linux_Serial::write (uint8_t to_write)
+{
+  std::lock_guard<std::mutex> guard (port_lock);
+
+  if (fd < 0) return 0;
+
+  //The port is non-blocking (for the I/O thread), so wait for room if the driver is full
+  while (::write (fd, &to_write, 1) != 1)
+  {
+    if ((errno != EAGAIN) && (errno != EINTR)) return 0;
+
+    struct pollfd writable;
+    writable.fd = fd;
+    writable.events = POLLOUT;
+    poll (&writable, 1, 100);
+  }
+
+  return 1;
+}
+
+//================================================================================================
+bool Sim800_Linux_Serial::receive (void)
+{
+  uint8_t chunk[256];
+  ssize_t received;
+
+  //Called from the I/O thread whenever the port is readable
+  while (true)
+  {
+    received = ::read (fd, chunk, sizeof(chunk));
+
+    if (received < 0)
+    {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return true;
+    }
+
+    //A tty reads 0 (or EIO) once it's hung up
+    if (received <= 0)
+    {
+      port_lost = true;
+      return false;
+    }
+
+    std::lock_guard<std::mutex> guard (rx_lock);
+
+    for (ssize_t idx = 0; idx < received; idx++)
+    {
+      size_t next_head = (rx_head + 1) % SIM800_LINUX_RX_SIZE;
+
+      if (next_head == rx_tail)
+      {
+        //Ring full; drop the byte rather than overwrite unread data
+        overflow_count++;
+        continue;
+      }
+
+      rx_ring[rx_head] = chunk[idx];
+      rx_head = next_head;
+    }
+  }
+}
+
+//================================================================================================
+//================================================================================================
+Sim800_Linux_IO::Sim800_Linux_IO (void)
+{
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  running = false;
+
+  struct epoll_event wake_event;
+  memset (&wake_event, 0, sizeof(wake_event));
+  wake_event.events = EPOLLIN;
+  wake_event.data.ptr = NULL;
+  epoll_ctl (epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_event);
+}
+
+//================================================================================================
+Sim800_Linux_IO::~Sim800_Linux_IO (void)
+{
+  stop();
+  close (wake_fd);
+  close (epoll_fd);
+}
+
+//================================================================================================
+bool Sim800_Linux_IO::add_port (Sim800_Linux_Serial &port)
+{
+  if (port.open_port() == false) return false;
+
+  struct epoll_event port_event;
+  memset (&port_event, 0, sizeof(port_event));
+  port_event.events = EPOLLIN;
+  port_event.data.ptr = &port;
+
+  return (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, port.port_fd(), &port_event) == 0);
+}
+
+//================================================================================================
+bool Sim800_Linux_IO::start (void)
+{
+  if ((epoll_fd < 0) || (wake_fd < 0)) return false;
+  if (running == true) return true;
+
+  running = true;
+  io_thread = std::thread (&Sim800_Linux_IO::run, this);
+  return true;
+}
+
+//================================================================================================
+void Sim800_Linux_IO::stop (void)
+{
+  if (running == false) return;
+
+  running = false;
+
+  uint64_t wake_count = 1;
+  if (::write (wake_fd, &wake_count, sizeof(wake_count)) < 0) {}
+
+  if (io_thread.joinable()) io_thread.join();
+}
+
+//================================================================================================
+void Sim800_Linux_IO::run (void)
+{
+  struct epoll_event ready[16];
+
+  while (running == true)
+  {
+    int ready_count = epoll_wait (epoll_fd, ready, 16, -1);
+    bool data_received = false;
+
+    for (int idx = 0; idx < ready_count; idx++)
+    {
+      if (ready[idx].data.ptr == NULL)
+      {
+        //Stop request
+        uint64_t wake_count;
+        if (::read (wake_fd, &wake_count, sizeof(wake_count)) < 0) {}
+        continue;
+      }
+
+      Sim800_Linux_Serial *port = (Sim800_Linux_Serial *)ready[idx].data.ptr;
+
+      //Read whatever is left before giving up on a port that's hung up
+      if ((port->receive() == true) && ((ready[idx].events & (EPOLLHUP | EPOLLERR)) == 0))
+      {
+        data_received = true;
+        continue;
+      }
+
+      //Level triggered, so it would be reported on every wait from now on
+      epoll_ctl (epoll_fd, EPOLL_CTL_DEL, port->port_fd(), NULL);
+      port->close_port();
+      data_received = true;
+
+      if (on_port_lost) on_port_lost (*port);
+    }
+
+    if ((data_received == true) && on_receive) on_receive();
+  }
+}
+
+//================================================================================================
+//================================================================================================
+Sim800_Linux_Gateway::Sim800_Linux_Gateway (unsigned int refresh_interval_ms)
+{
+  refresh_interval = refresh_interval_ms;
+  woken = false;
+  running = false;
+}
+
+//================================================================================================
+Sim800_Linux_Gateway::~Sim800_Linux_Gateway (void)
+{
+  stop();
+}
+
+//================================================================================================
+void Sim800_Linux_Gateway::add_modem (SIM800_Control &modem, Sim800_Linux_Serial *port)
+{
+  std::lock_guard<std::mutex> guard (job_lock);
+
+  Modem added;
+  added.control = &modem;
+  added.port = port;
+
+  modems.push_back (added);
+}
+
+//================================================================================================
+void Sim800_Linux_Gateway::post (Job job)
+{
+  {
+    std::lock_guard<std::mutex> guard (job_lock);
+    jobs.push_back (job);
+  }
+
+  job_signal.notify_one();
+}
+
+//================================================================================================
+void Sim800_Linux_Gateway::wake (void)
+{
+  {
+    std::lock_guard<std::mutex> guard (job_lock);
+    woken = true;
+  }
+
+  job_signal.notify_one();
+}
+
+//================================================================================================
+bool Sim800_Linux_Gateway::start (void)
+{
+  if (running == true) return true;
+
+  running = true;
+  control_thread = std::thread (&Sim800_Linux_Gateway::run, this);
+  return true;
+}
+
+//================================================================================================
+void Sim800_Linux_Gateway::stop (void)
+{
+  if (running == false) return;
+
+  running = false;
+  wake();
+
+  if (control_thread.joinable()) control_thread.join();
+}
+
+//================================================================================================
+void Sim800_Linux_Gateway::run (void)
+{
+  while (running == true)
+  {
+    Job job;
+    std::vector<Modem> to_refresh;
+
+    {
+      std::unique_lock<std::mutex> guard (job_lock);
+
+      //Sleep until there's a job, new data, or it's time to refresh anyway
+      if ((jobs.empty() == true) && (woken == false))
+      {
+        job_signal.wait_for (guard, std::chrono::milliseconds(refresh_interval));
+      }
+
+      woken = false;
+      if (jobs.empty() == false)
+      {
+        job = jobs.front();
+        jobs.pop_front();
+      }
+
+      to_refresh = modems;
+    }
+
+    //Jobs and refreshes both run here, so the modems are only ever driven from this thread
+    if (job) job();
+
+    modems_lost.resize (to_refresh.size(), false);
+
+    for (size_t idx = 0; idx < to_refresh.size(); idx++)
+    {
+      bool lost = ((to_refresh[idx].port != NULL) && (to_refresh[idx].port->lost() == true));
+
+      //Tell the application once; refreshing a closed port would only time out
+      if ((lost == true) && (modems_lost[idx] == false) && on_modem_lost) on_modem_lost (*to_refresh[idx].control);
+      modems_lost[idx] = lost;
+
+      if (lost == false) to_refresh[idx].control->refresh();
+    }
+  }
+}
@@ -0,0 +1,166 @@
+//===================================================================
+/* 
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. 
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Linux gateway backend
+//-------------------------------------------------------------------
+// Sim800_Linux_Serial  - termios transport for a SIM800 on a tty (USB-serial
+//                        adapter etc).  Build the library with 
+//                        SIM800_TRANSPORT=Sim800_Linux_Serial to use it
+// Sim800_Linux_IO      - a single I/O thread that multiplexes every port
+//                        with epoll and drains them into their receive rings
+// Sim800_Linux_Gateway - a control thread that owns the SIM800_Control objects;
+//                        it calls ::refresh() on each of them, and runs jobs 
+//                        posted from any other thread in between.  
+//                        SIM800_Control isn't re-entrant, so only touch the 
+//                        modems from inside a posted job
+//
+// If a port hangs up (the adapter is unplugged), the I/O thread takes it out
+// of epoll and closes it, and the gateway stops refreshing its modem and
+// calls ::on_modem_lost (on the control thread).  Sim800_Linux_IO::add_port()
+// opens it again once it's back
+//
+// Usage:
+//   Sim800_Linux_Serial port ("/dev/ttyUSB0");
+//   SIM800_Control gsm (port, 0);
+//   Sim800_Linux_IO io;
+//   Sim800_Linux_Gateway gateway;
+//
+//   io.add_port (port);
+//   io.on_receive = [&] { gateway.wake(); };
+//   io.start();
+//   gsm.begin (9600, 115200);       //Talks to the module, so after io.start()
+//   gateway.add_modem (gsm, &port);
+//   gateway.start();
+//   gateway.post ([&] { gsm.send_sms_from_buffer (number); });
+//-------------------------------------------------------------------
+
+#ifndef SIM800_LINUX_H
+#define SIM800_LINUX_H
+
+#include <Arduino.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef SIM800_LINUX_RX_SIZE
+  #define SIM800_LINUX_RX_SIZE 4096
+#endif
+
+class SIM800_Control;
+
+class Sim800_Linux_Serial
+{
+  public:
+    Sim800_Linux_Serial (const char *device_path);
+    ~Sim800_Linux_Serial (void);
+
+    std::atomic<unsigned long> overflow_count;
+
+    bool open_port (void);
+    void close_port (void);
+    inline int port_fd (void) { return fd; };
+    inline bool lost (void) { return port_lost; };   //Hung up, or failed, since it was opened
+
+    void begin (long baud_rate);
+    void set_flow_control (bool rts_cts);
+
+    int available (void);
+    int read (void);
+    size_t write (uint8_t to_write);
+    bool overflow (void);             //As SoftwareSerial: true once after the ring dropped bytes
+
+    bool receive (void);              //false once the port has hung up or failed
+
+  private:
+    char device[64];
+    int fd;
+    long baud;
+    bool hardware_flow_control;
+    std::atomic<bool> port_lost;
+
+    std::mutex port_lock;             //fd, between the I/O thread closing it and write()
+
+    std::mutex rx_lock;
+    uint8_t rx_ring[SIM800_LINUX_RX_SIZE];
+    size_t rx_head;
+    size_t rx_tail;
+    unsigned long overflows_reported;
+
+    void apply_settings (void);
+};
+
+class Sim800_Linux_IO
+{
+  public:
+    Sim800_Linux_IO (void);
+    ~Sim800_Linux_IO (void);
+
+    std::function<void (void)> on_receive;
+    std::function<void (Sim800_Linux_Serial &)> on_port_lost;   //From the I/O thread, after it's closed
+
+    bool add_port (Sim800_Linux_Serial &port);
+    bool start (void);
+    void stop (void);
+
+  private:
+    int epoll_fd;
+    int wake_fd;
+    std::atomic<bool> running;
+    std::thread io_thread;
+
+    void run (void);
+};
+
+class Sim800_Linux_Gateway
+{
+  public:
+    typedef std::function<void (void)> Job;
+
+    Sim800_Linux_Gateway (unsigned int refresh_interval_ms = 20);
+    ~Sim800_Linux_Gateway (void);
+
+    std::function<void (SIM800_Control &)> on_modem_lost;
+
+    void add_modem (SIM800_Control &modem, Sim800_Linux_Serial *port = NULL);
+    void post (Job job);
+    void wake (void);
+
+    bool start (void);
+    void stop (void);
+
+  private:
+    struct Modem
+    {
+      SIM800_Control *control;
+      Sim800_Linux_Serial *port;
+    };
+
+    unsigned int refresh_interval;
+    std::vector<Modem> modems;
+    std::vector<bool> modems_lost;    //Only touched by the control thread
+
+    std::mutex job_lock;
+    std::condition_variable job_signal;
+    std::deque<Job> jobs;
+    bool woken;
+
+    std::atomic<bool> running;
+    std::thread control_thread;
+
+    void run (void);
+};
+
+#endif
@@ -0,0 +1,1214 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+#include "SIM800_Simulator.h"
+
+#include <sstream>
+
+//Power-on defaults (AT&F)
+static const bool FACTORY_ECHO = true;
+
+//How far ahead in the capture to look for a command line that doesn't match
+static const size_t REPLAY_RESYNC_LINES = 8;
+
+static const unsigned long long REPLAY_NEVER = ~0ULL;
+
+//Roughly what a SIM800L on a UK network takes to answer each command
+static const struct
+{
+  const char *prefix;
+  unsigned long latency_ms;
+} DEFAULT_LATENCIES[] =
+{
+  {"AT&F",          100},
+  {"AT&W",          200},
+  {"AT+CLIP",       150},
+  {"AT+CFUN",      2500},
+  {"AT+CMGS",       100},
+  {"+CMGS",        3000},
+  {"AT+CMGL",        80},
+  {"AT+CMGD",       100},
+  {"AT+CUSD=1,",    300},
+  {"+CUSD",        2500},
+  {"ATD",           200},
+  {"ATH",           300},
+  {"ATA",           300},
+  {"AT+CSTT",        50},
+  {"AT+CIICR",     1500},
+  {"AT+CIFSR",       50},
+  {"AT+CIPSTART",   100},
+  {"CONNECT OK",   1200},
+  {"AT+CIPSEND",    100},
+  {"SEND OK",       600},
+  {"+BOB",          800},
+  {"AT+CIPCLOSE",   100},
+  {"AT+CIPSHUT",    400}
+};
+
+//================================================================================================
+static bool starts_with (const std::string &text, const char *prefix)
+{
+  return (text.compare (0, strlen(prefix), prefix) == 0);
+}
+
+//================================================================================================
+static std::string quoted_field (const std::string &text)
+{
+  size_t start = text.find ('\"');
+  if (start == std::string::npos) return std::string();
+
+  size_t end = text.find ('\"', start + 1);
+  if (end == std::string::npos) return text.substr (start + 1);
+
+  return text.substr (start + 1, end - start - 1);
+}
+
+//================================================================================================
+static std::string ussd_text (const std::string &reply, int dcs, size_t line_length)
+{
+  //The coding groups (3GPP TS 23.038) that carry UCS2, which the module passes on as hex
+  bool ucs2 = (dcs == 0x11) || (((dcs & 0xC0) == 0x40) && ((dcs & 0x0C) == 0x08)) ||
+              (((dcs & 0xF0) == 0x90) && ((dcs & 0x0C) == 0x08));
+  std::string text;
+
+  for (size_t idx = 0; idx < reply.size(); idx++)
+  {
+    if (ucs2 == false) { text += reply[idx]; continue; }
+
+    char hex[5];
+    snprintf (hex, sizeof(hex), "%04X", (unsigned char)reply[idx]);
+    text += hex;
+  }
+
+  if (line_length == 0) return text;
+
+  std::string lines;
+
+  for (size_t idx = 0; idx < text.size(); idx += line_length)
+  {
+    if (idx > 0) lines += "\r\n";
+    lines += text.substr (idx, line_length);
+  }
+
+  return lines;
+}
+
+//================================================================================================
+Sim800_Simulator::Sim800_Simulator (void)
+{
+  bytes_received = 0;
+  bytes_sent = 0;
+  commands_handled = 0;
+  bytes_dropped = 0;
+  overflow_count = 0;
+  overflows_reported = 0;
+  bytes_held_by_rts = 0;
+  writes_while_cts_held = 0;
+
+  default_latency_ms = 20;
+  boot_time_ms = 3000;
+  drop_permille = 0;
+  random_seed = 1;
+  rssi = 18;
+  ussd_reply = "Your balance is 5.00 GBP.";
+  ussd_dcs = 15;
+  ussd_line_length = 0;
+  call_answer_ms = 5000;
+  call_length_ms = 10000;
+  server_reply = "+BOB: 1";
+  cts_held = false;
+
+  sms_sent_count = 0;
+
+  for (size_t idx = 0; idx < (sizeof(DEFAULT_LATENCIES) / sizeof(DEFAULT_LATENCIES[0])); idx++)
+  {
+    set_latency (DEFAULT_LATENCIES[idx].prefix, DEFAULT_LATENCIES[idx].latency_ms);
+  }
+
+  tx_free_at = 0;
+
+  flow_wired = false;
+  rts_input = 0;
+  cts_output = 0;
+  rts_holding = false;
+
+  //The module is already up and autobauding, as after an Arduino-only reset
+  link_baud = 9600;
+  modem_baud = 0;
+  booted = true;
+
+  current.echo = FACTORY_ECHO;
+  current.sms_text_mode = 0;
+  current.caller_id = 0;
+  current.ussd_results = 0;
+  current.call_reports = 0;
+  current.flow_control = "0,0";
+  saved = current;
+
+  network_registered = true;
+  sim_inserted = true;
+  radio_on = true;
+  gprs_up = false;
+  socket_open = false;
+
+  next_sms_index = 1;
+  next_message_ref = 1;
+
+  call_status = '\0';
+  call_direction = '0';
+  call_id = 0;
+
+  data_mode = DM_COMMAND;
+
+  replay_matched_lines = 0;
+  replay_skipped_lines = 0;
+  replay_unmatched_lines = 0;
+  replaying = false;
+  replay_speed = 1;
+  replay_line = 0;
+  replay_record = 0;
+  replay_anchor_us = 0;
+  replay_anchor_ms = 0;
+}
+
+//================================================================================================
+Sim800_Simulator::~Sim800_Simulator (void)
+{
+  if (flow_wired == false) return;
+
+  host_pin_watch (rts_input, NULL);
+  host_pin_attach (cts_output, NULL);
+}
+
+//================================================================================================
+void Sim800_Simulator::set_latency (const char *prefix, unsigned long latency_ms)
+{
+  for (size_t idx = 0; idx < latencies.size(); idx++)
+  {
+    if (latencies[idx].first == prefix)
+    {
+      latencies[idx].second = latency_ms;
+      return;
+    }
+  }
+
+  latencies.push_back (std::make_pair (std::string(prefix), latency_ms));
+}
+
+//================================================================================================
+unsigned long Sim800_Simulator::latency_for (const std::string &command)
+{
+  unsigned long latency = default_latency_ms;
+  size_t best_match = 0;
+
+  //Longest matching prefix wins
+  for (size_t idx = 0; idx < latencies.size(); idx++)
+  {
+    if ((latencies[idx].first.size() > best_match) && (starts_with (command, latencies[idx].first.c_str()) == true))
+    {
+      best_match = latencies[idx].first.size();
+      latency = latencies[idx].second;
+    }
+  }
+
+  return latency;
+}
+
+//================================================================================================
+void Sim800_Simulator::set_registered (bool registered)
+{
+  network_registered = registered;
+  if (registered == true) return;
+
+  //Losing the network takes the data link and any call with it
+  if (socket_open == true) emit_line ("CLOSED");
+  if (gprs_up == true) emit_line ("+PDP: DEACT");
+  socket_open = false;
+  gprs_up = false;
+
+  if (call_status != '\0')
+  {
+    set_call_status ('6');
+    emit_line ("NO CARRIER");
+    end_call();
+  }
+}
+
+//================================================================================================
+void Sim800_Simulator::set_sim_inserted (bool inserted)
+{
+  sim_inserted = inserted;
+}
+
+//================================================================================================
+void Sim800_Simulator::wire_flow_control (byte rts_pin, byte cts_pin)
+{
+  flow_wired = true;
+  rts_input = rts_pin;
+  cts_output = cts_pin;
+
+  //Whatever was due before RTS moves went out (or was held) at the old level
+  host_pin_watch (rts_pin, [this] { run_timers(); deliver(); });
+  host_pin_attach (cts_pin, [this] { return read_cts(); });
+}
+
+//================================================================================================
+void Sim800_Simulator::at (unsigned long delay_ms, Action action)
+{
+  timers.insert (std::make_pair (host_clock_us() + ((unsigned long long)delay_ms * 1000ULL), action));
+}
+
+//================================================================================================
+void Sim800_Simulator::inject_urc (const char *text, unsigned long delay_ms)
+{
+  std::string line (text);
+
+  at (delay_ms, [this, line] { emit_line (line); });
+}
+
+//================================================================================================
+int Sim800_Simulator::receive_sms (const char *number, const char *text)
+{
+  Stored_Sms sms;
+
+  sms.index = next_sms_index++;
+  sms.unread = true;
+  sms.number = number;
+  sms.text = text;
+  inbox.push_back (sms);
+
+  emit_line ("+CMTI: \"SM\"," + std::to_string (sms.index));
+
+  return sms.index;
+}
+
+//================================================================================================
+void Sim800_Simulator::incoming_call (const char *number, byte rings)
+{
+  if (call_status != '\0') return;
+
+  unsigned long this_call = ++call_id;
+  call_direction = '1';
+  call_number = number;
+  set_call_status ('4');
+
+  for (byte ring = 0; ring < rings; ring++)
+  {
+    at (ring * 3000UL, [this, this_call]
+    {
+      if ((call_id != this_call) || (call_status != '4')) return;
+
+      emit_line ("RING");
+      if (current.caller_id != 0) emit_line ("+CLIP: \"" + call_number + "\",145,\"\",0,\"\",0");
+    });
+  }
+
+  //The caller gives up
+  at (rings * 3000UL, [this, this_call]
+  {
+    if ((call_id != this_call) || (call_status != '4')) return;
+
+    set_call_status ('6');
+    emit_line ("NO CARRIER");
+    end_call();
+  });
+}
+
+//================================================================================================
+void Sim800_Simulator::reboot (void)
+{
+  //Everything in flight is lost, along with the runtime settings
+  timers.clear();
+  tx_queue.clear();
+  tx_free_at = 0;
+
+  current = saved;
+  data_mode = DM_COMMAND;
+  command_line.clear();
+  gprs_up = false;
+  socket_open = false;
+  radio_on = true;
+  call_status = '\0';
+  call_id++;
+  booted = false;
+
+  at (boot_time_ms, [this]
+  {
+    booted = true;
+
+    //An autobauding module doesn't know what rate to announce itself at
+    if (modem_baud != 0) emit_line ("RDY");
+    emit_line ("+CFUN: 1");
+    emit_line (sim_inserted ? "+CPIN: READY" : "+CPIN: NOT INSERTED");
+  });
+
+  at (boot_time_ms + 2000, [this] { emit_line ("Call Ready"); });
+  at (boot_time_ms + 2500, [this] { emit_line ("SMS Ready"); });
+}
+
+//================================================================================================
+void Sim800_Simulator::begin (long baud_rate)
+{
+  link_baud = baud_rate;
+}
+
+//================================================================================================
+int Sim800_Simulator::available (void)
+{
+  run_timers();
+  deliver();
+
+  //Nothing to read, so let time pass
+  if (rx_fifo.empty() == true) let_time_pass();
+
+  return (int)rx_fifo.size();
+}
+
+//================================================================================================
+void Sim800_Simulator::let_time_pass (void)
+{
+  if (host_clock_is_virtual() == false) return;
+
+  //Up to a millisecond, or the next thing that happens
+  unsigned long long now = host_clock_us();
+  unsigned long long step = 1000ULL;
+
+  if ((tx_queue.empty() == false) && (tx_queue.front().due > now) && ((tx_queue.front().due - now) < step))
+  {
+    step = tx_queue.front().due - now;
+  }
+  if ((timers.empty() == false) && (timers.begin()->first > now) && ((timers.begin()->first - now) < step))
+  {
+    step = timers.begin()->first - now;
+  }
+  if ((replay_due_us() > now) && ((replay_due_us() - now) < step))
+  {
+    step = replay_due_us() - now;
+  }
+
+  host_clock_advance_us (step);
+  run_timers();
+  deliver();
+}
+
+//================================================================================================
+bool Sim800_Simulator::rts_paused (void)
+{
+  //AT+IFC=2,<n> - the module stops sending while RTS is high
+  return ((flow_wired == true) && (current.flow_control.compare (0, 1, "2") == 0) && (digitalRead (rts_input) == HIGH));
+}
+
+//================================================================================================
+bool Sim800_Simulator::cts_raised (void)
+{
+  //AT+IFC=<n>,2 - the module raises CTS when it can't take data
+  size_t comma = current.flow_control.find (',');
+
+  return ((flow_wired == true) && (cts_held == true) && (comma != std::string::npos) &&
+          (current.flow_control.compare (comma + 1, std::string::npos, "2") == 0));
+}
+
+//================================================================================================
+int Sim800_Simulator::read_cts (void)
+{
+  run_timers();
+  deliver();
+
+  //Something is waiting on CTS, so let time pass until the module lowers it
+  if (cts_raised() == true) let_time_pass();
+
+  return (cts_raised() == true) ? HIGH : LOW;
+}
+
+//================================================================================================
+int Sim800_Simulator::read (void)
+{
+  run_timers();
+  deliver();
+
+  if (rx_fifo.empty() == true) return -1;
+
+  char next_char = rx_fifo.front();
+  rx_fifo.pop_front();
+
+  return (uint8_t)next_char;
+}
+
+//================================================================================================
+bool Sim800_Simulator::overflow (void)
+{
+  bool overflowed = (overflow_count != overflows_reported);
+
+  overflows_reported = overflow_count;
+  return overflowed;
+}
+
+//================================================================================================
+size_t Sim800_Simulator::write (uint8_t to_write)
+{
+  bytes_received++;
+  if (cts_raised() == true) writes_while_cts_held++;
+
+  //The UART holds us up for the time the byte takes on the wire
+  host_clock_advance_us (byte_time_us());
+  run_timers();
+
+  if (replaying == true)
+  {
+    replay_write ((char)to_write);
+    return 1;
+  }
+
+  //Nothing is listening while booting, and a wrong rate is just noise
+  if ((booted == false) || (rates_match() == false)) return 1;
+
+  if (data_mode != DM_COMMAND)
+  {
+    handle_data ((char)to_write);
+  }
+  else if (to_write == '\r')
+  {
+    std::string command;
+    command.swap (command_line);
+    handle_command (command);
+  }
+  else if ((to_write != '\n') && (command_line.size() < 556))
+  {
+    command_line += (char)to_write;
+  }
+
+  return 1;
+}
+
+//================================================================================================
+unsigned long long Sim800_Simulator::byte_time_us (void)
+{
+  //Start + 8 data + stop bits
+  return 10000000ULL / (unsigned long long)((link_baud > 0) ? link_baud : 9600);
+}
+
+//================================================================================================
+bool Sim800_Simulator::rates_match (void)
+{
+  return ((modem_baud == 0) || (modem_baud == link_baud));
+}
+
+//================================================================================================
+bool Sim800_Simulator::random_drop (void)
+{
+  if (drop_permille == 0) return false;
+
+  random_seed = (random_seed * 1103515245UL) + 12345UL;
+  return (((random_seed >> 16) % 1000) < drop_permille);
+}
+
+//================================================================================================
+void Sim800_Simulator::run_timers (void)
+{
+  while ((timers.empty() == false) && (timers.begin()->first <= host_clock_us()))
+  {
+    Action action = timers.begin()->second;
+    timers.erase (timers.begin());
+    action();
+  }
+
+  if (replaying == true) run_replay();
+}
+
+//================================================================================================
+void Sim800_Simulator::deliver (void)
+{
+  unsigned long long now = host_clock_us();
+
+  if (rts_paused() == true)
+  {
+    rts_holding = true;
+    return;
+  }
+
+  if (rts_holding == true)
+  {
+    //What was held back goes out from now, at the wire rate
+    unsigned long long next_due = now;
+
+    for (size_t idx = 0; idx < tx_queue.size(); idx++)
+    {
+      if (tx_queue[idx].due <= now) bytes_held_by_rts++;
+
+      if (tx_queue[idx].due < next_due) tx_queue[idx].due = next_due;
+      next_due = tx_queue[idx].due + byte_time_us();
+    }
+
+    if ((tx_queue.empty() == false) && (tx_free_at < tx_queue.back().due)) tx_free_at = tx_queue.back().due;
+    rts_holding = false;
+  }
+
+  while ((tx_queue.empty() == false) && (tx_queue.front().due <= now))
+  {
+    bytes_sent++;
+
+    //A full receive buffer loses the byte, as SoftwareSerial would
+    if (rx_fifo.size() >= SIM800_SIMULATOR_RX_SIZE) overflow_count++;
+    else rx_fifo.push_back (tx_queue.front().value);
+
+    tx_queue.pop_front();
+  }
+}
+
+//================================================================================================
+void Sim800_Simulator::emit_raw (const std::string &text)
+{
+  if (rates_match() == false)
+  {
+    bytes_dropped += text.size();
+    return;
+  }
+
+  unsigned long long due = host_clock_us();
+  if (tx_free_at > due) due = tx_free_at;
+
+  for (size_t idx = 0; idx < text.size(); idx++)
+  {
+    due += byte_time_us();
+
+    if (random_drop() == true)
+    {
+      bytes_dropped++;
+      continue;
+    }
+
+    Pending_Byte next_byte;
+    next_byte.due = due;
+    next_byte.value = text[idx];
+    tx_queue.push_back (next_byte);
+  }
+
+  tx_free_at = due;
+}
+
+//================================================================================================
+void Sim800_Simulator::emit_line (const std::string &text)
+{
+  emit_raw ("\r\n" + text + "\r\n");
+}
+
+//================================================================================================
+void Sim800_Simulator::reply (const std::vector<std::string> &lines, const std::string &result, unsigned long latency_ms)
+{
+  std::string text;
+
+  for (size_t idx = 0; idx < lines.size(); idx++)
+  {
+    text += "\r\n" + lines[idx] + "\r\n";
+  }
+
+  if (result == "> ") text += "\r\n> ";
+  else if (result.empty() == false) text += "\r\n" + result + "\r\n";
+
+  if (text.empty() == true) return;
+
+  at (latency_ms, [this, text] { emit_raw (text); });
+}
+
+//================================================================================================
+void Sim800_Simulator::handle_command (const std::string &command)
+{
+  //Blank lines (and the CR/LF after a CTRL+Z) are ignored
+  if (command.empty() == true) return;
+
+  if (current.echo == true) emit_raw (command + "\r\n");
+
+  if ((starts_with (command, "AT") == false) && (starts_with (command, "at") == false)) return;
+
+  commands_handled++;
+
+  std::vector<std::string> lines;
+  std::string result;
+
+  if (starts_with (command, "ATD") == true)
+  {
+    result = run_command (command, lines);
+  }
+  else
+  {
+    //AT+A;+B;+C - run each in turn, stopping at the first error
+    size_t start = 0;
+    bool quoted = false;
+
+    for (size_t idx = 0; idx <= command.size(); idx++)
+    {
+      if ((idx < command.size()) && (command[idx] == '\"')) quoted = !quoted;
+      if ((idx < command.size()) && ((command[idx] != ';') || (quoted == true))) continue;
+
+      std::string part = command.substr (start, idx - start);
+      if (start > 0) part = "AT" + part;
+      start = idx + 1;
+
+      result = run_command (part, lines);
+      if (result == "ERROR") break;
+    }
+  }
+
+  reply (lines, result, latency_for (command));
+}
+
+//================================================================================================
+std::string Sim800_Simulator::run_command (const std::string &command, std::vector<std::string> &lines)
+{
+  unsigned long latency = latency_for (command);
+  bool network_ok = ((network_registered == true) && (radio_on == true) && (sim_inserted == true));
+
+  if (command == "AT") return "OK";
+
+  if ((command == "ATE0") || (command == "ATE 0")) { current.echo = false; return "OK"; }
+  if ((command == "ATE1") || (command == "ATE 1")) { current.echo = true; return "OK"; }
+
+  if (command == "AT&F")
+  {
+    current.echo = FACTORY_ECHO;
+    current.sms_text_mode = 0;
+    current.caller_id = 0;
+    current.ussd_results = 0;
+    current.call_reports = 0;
+    current.flow_control = "0,0";
+    return "OK";
+  }
+
+  if (command == "AT&W")
+  {
+    //As on a real SIM800, AT+CUSD isn't part of the saved profile
+    saved = current;
+    saved.ussd_results = 0;
+    return "OK";
+  }
+
+  if (command == "ATI") { lines.push_back ("SIM800 R14.18"); return "OK"; }
+
+  if (starts_with (command, "AT+IPR?") == true)
+  {
+    lines.push_back ("+IPR: " + std::to_string (modem_baud));
+    return "OK";
+  }
+
+  if (starts_with (command, "AT+IPR=") == true)
+  {
+    long new_rate = atol (command.c_str() + 7);
+
+    //Acknowledged at the old rate, then the module moves
+    at (latency, [this, new_rate]
+    {
+      emit_raw ("\r\nOK\r\n");
+      modem_baud = new_rate;
+    });
+    return "";
+  }
+
+  if (starts_with (command, "AT+IFC=") == true) { current.flow_control = command.substr (7); return "OK"; }
+  if (command == "AT+IFC?") { lines.push_back ("+IFC: " + current.flow_control); return "OK"; }
+
+  if (command == "AT+CCID")
+  {
+    if (sim_inserted == false) return "ERROR";
+
+    lines.push_back ("8944100030123456789F");
+    return "OK";
+  }
+
+  if (command == "AT+CMGF?") { lines.push_back ("+CMGF: " + std::to_string (current.sms_text_mode)); return "OK"; }
+  if (starts_with (command, "AT+CMGF=") == true) { current.sms_text_mode = atoi (command.c_str() + 8); return "OK"; }
+
+  if (command == "AT+CLIP?") { lines.push_back ("+CLIP: " + std::to_string (current.caller_id) + ",1"); return "OK"; }
+  if (starts_with (command, "AT+CLIP=") == true) { current.caller_id = atoi (command.c_str() + 8); return "OK"; }
+
+  if (command == "AT+CUSD?") { lines.push_back ("+CUSD: " + std::to_string (current.ussd_results)); return "OK"; }
+  if (starts_with (command, "AT+CUSD=") == true)
+  {
+    current.ussd_results = atoi (command.c_str() + 8);
+    if (command.find (',') == std::string::npos) return "OK";
+
+    //AT+CUSD=1,"<code>" - the network answers some time after the OK
+    if (network_ok == false) return "ERROR";
+
+    at (latency + latency_for ("+CUSD"), [this]
+    {
+      if (current.ussd_results != 0)
+      {
+        emit_line ("+CUSD: 0,\"" + ussd_text (ussd_reply, ussd_dcs, ussd_line_length) + "\"," + std::to_string (ussd_dcs));
+      }
+    });
+    return "OK";
+  }
+
+  if (starts_with (command, "AT+CLCC=") == true) { current.call_reports = atoi (command.c_str() + 8); return "OK"; }
+  if (command == "AT+CLCC")
+  {
+    if (call_status != '\0') lines.push_back (clcc_line());
+    return "OK";
+  }
+
+  if (command == "AT+CREG?") { lines.push_back (network_ok ? "+CREG: 0,1" : "+CREG: 0,2"); return "OK"; }
+  if (command == "AT+CGREG?") { lines.push_back (network_ok ? "+CGREG: 0,1" : "+CGREG: 0,2"); return "OK"; }
+  if (command == "AT+CGATT?") { lines.push_back (network_ok ? "+CGATT: 1" : "+CGATT: 0"); return "OK"; }
+
+  if (command == "AT+CSQ")
+  {
+    lines.push_back ("+CSQ: " + std::to_string ((radio_on == true) ? rssi : 99) + ",0");
+    return "OK";
+  }
+
+  if (starts_with (command, "AT+CFUN=") == true)
+  {
+    radio_on = (atoi (command.c_str() + 8) != 0);
+
+    if (radio_on == false)
+    {
+      //Minimum functionality drops everything that needs the network
+      bool registered = network_registered;
+      set_registered (false);
+      network_registered = registered;
+    }
+    return "OK";
+  }
+
+  if (starts_with (command, "AT+CMGS=") == true)
+  {
+    if (current.sms_text_mode == 0) return "ERROR";
+
+    last_sms_number = quoted_field (command);
+    data_buffer.clear();
+    data_mode = DM_SMS_TEXT;
+    return "> ";
+  }
+
+  if (starts_with (command, "AT+CMGL=") == true)
+  {
+    for (size_t idx = 0; idx < inbox.size(); idx++)
+    {
+      lines.push_back ("+CMGL: " + std::to_string (inbox[idx].index) +
+                       (inbox[idx].unread ? ",\"REC UNREAD\",\"" : ",\"REC READ\",\"") +
+                       inbox[idx].number + "\",\"\",\"22/01/28,10:00:00+00\"");
+      lines.push_back (inbox[idx].text);
+      inbox[idx].unread = false;
+    }
+    return "OK";
+  }
+
+  if (starts_with (command, "AT+CMGD=") == true)
+  {
+    int index = atoi (command.c_str() + 8);
+
+    //AT+CMGD=<index>,4 deletes everything
+    if (command.find (",4") != std::string::npos) inbox.clear();
+
+    for (size_t idx = 0; idx < inbox.size(); idx++)
+    {
+      if (inbox[idx].index == index)
+      {
+        inbox.erase (inbox.begin() + idx);
+        break;
+      }
+    }
+    return "OK";
+  }
+
+  if (starts_with (command, "ATD") == true)
+  {
+    if ((call_status != '\0') || (network_ok == false)) return "NO CARRIER";
+
+    size_t start = command.find_first_not_of (' ', 3);
+    size_t end = command.find (';');
+    call_number = command.substr (start, (end == std::string::npos) ? std::string::npos : end - start);
+    call_direction = '0';
+
+    unsigned long this_call = ++call_id;
+    at (latency, [this, this_call] { if (call_id == this_call) set_call_status ('2'); });
+    at (latency + 1500, [this, this_call] { if (call_id == this_call) set_call_status ('3'); });
+
+    if (call_answer_ms != 0)
+    {
+      at (latency + call_answer_ms, [this, this_call] { if (call_id == this_call) set_call_status ('0'); });
+
+      if (call_length_ms != 0)
+      {
+        //The far end hangs up
+        at (latency + call_answer_ms + call_length_ms, [this, this_call]
+        {
+          if (call_id != this_call) return;
+
+          set_call_status ('6');
+          emit_line ("NO CARRIER");
+          end_call();
+        });
+      }
+    }
+    return "OK";
+  }
+
+  if (command == "ATA")
+  {
+    if ((call_status != '4') || (call_direction != '1')) return "NO CARRIER";
+
+    set_call_status ('0');
+    return "OK";
+  }
+
+  if (command == "ATH")
+  {
+    if (call_status != '\0')
+    {
+      set_call_status ('6');
+      end_call();
+    }
+    return "OK";
+  }
+
+  if (starts_with (command, "AT+CSTT=") == true) return "OK";
+
+  if (command == "AT+CIICR")
+  {
+    if (network_ok == false) return "ERROR";
+
+    gprs_up = true;
+    return "OK";
+  }
+
+  if (command == "AT+CIFSR")
+  {
+    if (gprs_up == false) return "ERROR";
+
+    //Just the address, no OK
+    lines.push_back ("10.64.12.7");
+    return "";
+  }
+
+  if (starts_with (command, "AT+CIPSTART=") == true)
+  {
+    if (gprs_up == false) return "ERROR";
+
+    at (latency + latency_for ("CONNECT OK"), [this]
+    {
+      socket_open = gprs_up;
+      emit_line (gprs_up ? "CONNECT OK" : "CONNECT FAIL");
+    });
+    return "OK";
+  }
+
+  if (command == "AT+CIPSEND")
+  {
+    if (socket_open == false) return "ERROR";
+
+    data_buffer.clear();
+    data_mode = DM_UPLOAD;
+    return "> ";
+  }
+
+  if (command == "AT+CIPCLOSE")
+  {
+    if (socket_open == false) return "ERROR";
+
+    socket_open = false;
+    return "CLOSE OK";
+  }
+
+  if (command == "AT+CIPSHUT")
+  {
+    socket_open = false;
+    gprs_up = false;
+    return "SHUT OK";
+  }
+
+  return "ERROR";
+}
+
+//================================================================================================
+void Sim800_Simulator::handle_data (char value)
+{
+  if (value == char(27))
+  {
+    //ESC abandons the message/upload
+    data_mode = DM_COMMAND;
+    data_buffer.clear();
+    return;
+  }
+
+  if (value != char(26))
+  {
+    //Skip the LF left over from the command that opened the prompt
+    if ((data_buffer.empty() == true) && (value == '\n')) return;
+
+    if (data_buffer.size() < 2048) data_buffer += value;
+    return;
+  }
+
+  //CTRL+Z - send it
+  Data_Mode finished = data_mode;
+  data_mode = DM_COMMAND;
+
+  if (finished == DM_SMS_TEXT)
+  {
+    //Drop the CR/LF that send_command() puts after the text
+    while ((data_buffer.empty() == false) && ((data_buffer.back() == '\r') || (data_buffer.back() == '\n')))
+    {
+      data_buffer.erase (data_buffer.size() - 1);
+    }
+    last_sms_text = data_buffer;
+
+    if ((network_registered == false) || (radio_on == false))
+    {
+      reply (std::vector<std::string>(), "+CMS ERROR: 500", latency_for ("+CMGS"));
+      return;
+    }
+
+    sms_sent_count++;
+    std::vector<std::string> lines;
+    lines.push_back ("+CMGS: " + std::to_string (next_message_ref++));
+    reply (lines, "OK", latency_for ("+CMGS"));
+  }
+  else
+  {
+    last_upload = data_buffer;
+
+    unsigned long sent_at = latency_for ("SEND OK");
+    unsigned long answered_at = sent_at + latency_for ("+BOB");
+
+    at (sent_at, [this] { if (socket_open == true) emit_line ("SEND OK"); });
+    at (answered_at, [this] { if ((socket_open == true) && (server_reply.empty() == false)) emit_line (server_reply); });
+
+    //The server closes its end once it has answered
+    at (answered_at + 100, [this]
+    {
+      if (socket_open == false) return;
+
+      socket_open = false;
+      emit_line ("CLOSED");
+    });
+  }
+}
+
+//================================================================================================
+void Sim800_Simulator::set_call_status (char status)
+{
+  call_status = status;
+
+  if (current.call_reports != 0) emit_line (clcc_line());
+}
+
+//================================================================================================
+void Sim800_Simulator::end_call (void)
+{
+  call_status = '\0';
+  call_id++;
+}
+
+//================================================================================================
+std::string Sim800_Simulator::clcc_line (void)
+{
+  //+CLCC: <id>,<dir>,<stat>,<mode>,<mpty>,<number>,<type>
+  std::string line ("+CLCC: 1,");
+
+  line += call_direction;
+  line += ',';
+  line += call_status;
+  line += ",0,0,\"" + call_number + "\",";
+  line += ((call_number.empty() == false) && (call_number[0] == '+')) ? "145" : "129";
+
+  return line;
+}
+
+//================================================================================================
+bool Sim800_Simulator::load_capture (const std::string &dump)
+{
+  std::istringstream input (dump);
+  std::string line;
+  std::string tx_line;
+  unsigned long long time_ms = 0;
+  bool in_capture = false;
+
+  capture_tx.clear();
+  capture_rx.clear();
+
+  while (std::getline (input, line))
+  {
+    if ((line.empty() == false) && (line[line.size() - 1] == '\r')) line.erase (line.size() - 1);
+
+    if (starts_with (line, "#SIM800 capture") == true)
+    {
+      in_capture = true;
+      continue;
+    }
+    if (starts_with (line, "#end") == true) break;
+
+    //Anything else on the console (debug output) is skipped
+    if ((in_capture == false) || (line.size() < 5) || ((line[0] != 'T') && (line[0] != 'R')) || (line[1] != ' ')) continue;
+
+    std::istringstream fields (line.substr (2));
+    unsigned long delta_ms;
+    std::string hex;
+
+    if (!(fields >> delta_ms >> hex) || ((hex.size() % 2) != 0)) return false;
+
+    time_ms += delta_ms;
+
+    std::string data;
+    for (size_t idx = 0; idx < hex.size(); idx += 2)
+    {
+      data += (char)strtoul (hex.substr (idx, 2).c_str(), NULL, 16);
+    }
+
+    if (line[0] == 'R')
+    {
+      Capture_Record record;
+      record.time_ms = time_ms;
+      record.tx_lines = capture_tx.size();
+      record.data = data;
+      capture_rx.push_back (record);
+      continue;
+    }
+
+    //Commands are kept as lines (CR terminated, LFs dropped), as that's
+    //how they're matched against what the library sends
+    for (size_t idx = 0; idx < data.size(); idx++)
+    {
+      if (data[idx] == '\n') continue;
+
+      if (data[idx] != '\r')
+      {
+        tx_line += data[idx];
+        continue;
+      }
+
+      if (tx_line.empty() == false)
+      {
+        Capture_Line command;
+        command.text.swap (tx_line);
+        command.time_ms = time_ms;
+        capture_tx.push_back (command);
+      }
+    }
+  }
+
+  return ((capture_tx.empty() == false) || (capture_rx.empty() == false));
+}
+
+//================================================================================================
+void Sim800_Simulator::start_replay (unsigned int speed)
+{
+  //Nothing from the emulated module carries over
+  timers.clear();
+  tx_queue.clear();
+  rx_fifo.clear();
+  tx_free_at = 0;
+  data_mode = DM_COMMAND;
+  command_line.clear();
+  modem_baud = 0;
+
+  replaying = true;
+  replay_speed = (speed > 0) ? speed : 1;
+  replay_line = 0;
+  replay_record = 0;
+  replay_input.clear();
+  replay_matched_lines = 0;
+  replay_skipped_lines = 0;
+  replay_unmatched_lines = 0;
+
+  replay_anchor_us = host_clock_us();
+  replay_anchor_ms = 0;
+  if (capture_tx.empty() == false) replay_anchor_ms = capture_tx[0].time_ms;
+  if ((capture_rx.empty() == false) && (capture_rx[0].time_ms < replay_anchor_ms)) replay_anchor_ms = capture_rx[0].time_ms;
+}
+
+//================================================================================================
+bool Sim800_Simulator::replay_finished (void)
+{
+  return ((replay_line >= capture_tx.size()) && (replay_record >= capture_rx.size()));
+}
+
+//================================================================================================
+std::string Sim800_Simulator::replay_next_line (size_t ahead)
+{
+  if ((replay_line + ahead) >= capture_tx.size()) return std::string();
+
+  return capture_tx[replay_line + ahead].text;
+}
+
+//================================================================================================
+unsigned long long Sim800_Simulator::replay_due_us (void)
+{
+  if ((replaying == false) || (replay_record >= capture_rx.size())) return REPLAY_NEVER;
+
+  const Capture_Record &record = capture_rx[replay_record];
+
+  //Still waiting on the library for the commands that came first
+  if (record.tx_lines > replay_line) return REPLAY_NEVER;
+
+  if (record.time_ms <= replay_anchor_ms) return replay_anchor_us;
+
+  return replay_anchor_us + (((record.time_ms - replay_anchor_ms) * 1000ULL) / replay_speed);
+}
+
+//================================================================================================
+void Sim800_Simulator::replay_skip_line (void)
+{
+  if (replay_line >= capture_tx.size()) return;
+
+  replay_skipped_lines++;
+  replay_anchor (replay_line);
+}
+
+//================================================================================================
+void Sim800_Simulator::replay_anchor (size_t line)
+{
+  //Time in the capture is measured from the last line both sides agree on
+  replay_line = line + 1;
+  replay_anchor_us = host_clock_us();
+  replay_anchor_ms = capture_tx[line].time_ms;
+}
+
+//================================================================================================
+void Sim800_Simulator::run_replay (void)
+{
+  while (replay_due_us() <= host_clock_us())
+  {
+    emit_raw (capture_rx[replay_record].data);
+    replay_record++;
+  }
+}
+
+//================================================================================================
+void Sim800_Simulator::replay_write (char value)
+{
+  if (value == '\n') return;
+
+  if (value != '\r')
+  {
+    if (replay_input.size() < 556) replay_input += value;
+    return;
+  }
+
+  std::string line;
+  line.swap (replay_input);
+  if (line.empty() == true) return;
+
+  for (size_t ahead = 0; ahead < REPLAY_RESYNC_LINES; ahead++)
+  {
+    if ((replay_line + ahead) >= capture_tx.size()) break;
+
+    if (capture_tx[replay_line + ahead].text == line)
+    {
+      replay_matched_lines++;
+      replay_skipped_lines += ahead;
+      replay_anchor (replay_line + ahead);
+      run_replay();
+      return;
+    }
+  }
+
+  replay_unmatched_lines++;
+}
@@ -0,0 +1,272 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Simulated SIM800 for host builds
+//-------------------------------------------------------------------
+// Sim800_Simulator stands in for both the serial port and the module
+// behind it, so the whole command set can be run on a PC with no hardware.
+// Build the library with SIM800_TRANSPORT=Sim800_Simulator (make sim).
+//
+// Replies are scheduled against host_clock_us(): each command has a
+// latency (set_latency(), matched on the longest command prefix), and
+// every byte takes its real time on the wire at the current baud rate.
+// The receive side holds SIM800_SIMULATOR_RX_SIZE bytes, like the
+// SoftwareSerial buffer, and anything beyond that is lost.
+//
+// With the virtual clock on (host_clock_set_virtual(true)) writes take
+// their transmit time, and polling an idle port moves time on by a
+// millisecond, so an 85 second AT+CIICR timeout costs microseconds and
+// every run is repeatable.
+//
+// Scripted behaviour / faults:
+//   inject_urc()      - any unsolicited line, after a delay
+//   receive_sms()     - store a message and announce it with +CMTI
+//   incoming_call()   - RING/+CLIP every 3 secs until answered or given up
+//   reboot()          - lose the runtime settings, then RDY ... SMS Ready
+//   set_registered()  - lose/regain the network (CREG, CGREG, CGATT)
+//   set_sim_inserted()- AT+CCID fails without a SIM
+//   drop_permille     - lose sent bytes at random (seeded, so repeatable)
+//   ussd_dcs          - the reply's coding; UCS2 ones send it as hex, and
+//                       ussd_line_length breaks it over several lines
+//   at()              - run any other action at a given time
+//
+// Hardware flow control:
+//   wire_flow_control() connects the library's RTS and CTS pins (as given to
+//   SIM800_Control::enable_flow_control).  Once AT+IFC=2,2 is in force, RTS
+//   high holds the module's output back (it carries on at the wire rate when
+//   RTS drops), and cts_held raises CTS; polling CTS while it's raised lets
+//   virtual time pass, as polling an idle port does
+//
+// Replay:
+//   load_capture() takes the text from SIM800_Control::capture.dump(), and
+//   start_replay() switches from emulating the module to playing back what
+//   the real one sent.  Each received record is held until the library has
+//   sent the command lines that came before it in the capture, then comes
+//   out with its original spacing (divided by the speed).  The lines the
+//   library sends are matched against the capture, looking a few lines
+//   ahead to get back in step; see sim800_replay.cpp for a driver.
+//
+// Usage:
+//   host_clock_set_virtual (true);
+//   Sim800_Simulator modem;
+//   SIM800_Control gsm (modem, 0);
+//
+//   modem.set_latency ("AT+CIICR", 2500);
+//   gsm.begin (9600, 115200);
+//   gsm.initialise (false);
+//   modem.receive_sms ("+447700900123", "Hello");
+//-------------------------------------------------------------------
+
+#ifndef SIM800_SIMULATOR_H
+#define SIM800_SIMULATOR_H
+
+#include <Arduino.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef SIM800_SIMULATOR_RX_SIZE
+  #define SIM800_SIMULATOR_RX_SIZE 64
+#endif
+
+class Sim800_Simulator
+{
+  public:
+    typedef std::function<void (void)> Action;
+
+    Sim800_Simulator (void);
+    ~Sim800_Simulator (void);
+
+    //Link statistics
+    unsigned long bytes_received;     //From the library
+    unsigned long bytes_sent;         //To the library
+    unsigned long commands_handled;
+    unsigned long bytes_dropped;
+    unsigned long overflow_count;
+
+    //Behaviour (change any time)
+    unsigned long default_latency_ms;
+    unsigned long boot_time_ms;
+    unsigned int drop_permille;
+    unsigned long random_seed;
+    int rssi;
+    std::string ussd_reply;
+    int ussd_dcs;                     //UCS2 codings (e.g. 72) send the reply as hex
+    size_t ussd_line_length;          //Break the reply's text every so many chars (0 = never)
+    unsigned long call_answer_ms;     //0 = never answered
+    unsigned long call_length_ms;     //0 = only ends with ATH
+    std::string server_reply;
+    bool cts_held;                    //Module not ready for data (with AT+IFC on)
+
+    //Flow control statistics
+    unsigned long bytes_held_by_rts;       //Waited in the module for RTS to drop
+    unsigned long writes_while_cts_held;   //Sent regardless; should stay 0
+
+    //What the module was asked to send
+    unsigned long sms_sent_count;
+    std::string last_sms_number;
+    std::string last_sms_text;
+    std::string last_upload;
+
+    void set_latency (const char *prefix, unsigned long latency_ms);
+    void set_registered (bool registered);
+    void set_sim_inserted (bool inserted);
+    void wire_flow_control (byte rts_pin, byte cts_pin);
+
+    void at (unsigned long delay_ms, Action action);
+    void inject_urc (const char *text, unsigned long delay_ms = 0);
+    int receive_sms (const char *number, const char *text);
+    void incoming_call (const char *number, byte rings = 5);
+    void reboot (void);
+
+    //Replay of a capture (counts of the library's command lines)
+    unsigned long replay_matched_lines;
+    unsigned long replay_skipped_lines;     //In the capture, never sent
+    unsigned long replay_unmatched_lines;   //Sent, not in the capture
+
+    bool load_capture (const std::string &dump);
+    void start_replay (unsigned int speed = 1);
+    bool replay_finished (void);
+    std::string replay_next_line (size_t ahead = 0);
+    unsigned long long replay_due_us (void);
+    void replay_skip_line (void);
+
+    inline size_t stored_sms (void) { return inbox.size(); };
+    inline bool call_active (void) { return (call_status != '\0'); };
+    inline long baud_rate (void) { return modem_baud; };
+
+    //Transport interface
+    void begin (long baud_rate);
+    int available (void);
+    int read (void);
+    size_t write (uint8_t to_write);
+    bool overflow (void);             //As SoftwareSerial: true once after bytes were lost
+
+  private:
+    struct Pending_Byte
+    {
+      unsigned long long due;
+      char value;
+    };
+
+    struct Stored_Sms
+    {
+      int index;
+      bool unread;
+      std::string number;
+      std::string text;
+    };
+
+    struct Profile
+    {
+      bool echo;
+      byte sms_text_mode;
+      byte caller_id;
+      byte ussd_results;
+      byte call_reports;
+      std::string flow_control;       //AT+IFC
+    };
+
+    struct Capture_Line
+    {
+      std::string text;
+      unsigned long long time_ms;
+    };
+
+    struct Capture_Record
+    {
+      unsigned long long time_ms;
+      size_t tx_lines;                //Command lines sent before it
+      std::string data;
+    };
+
+    std::vector<std::pair<std::string, unsigned long> > latencies;
+    std::multimap<unsigned long long, Action> timers;
+    std::deque<Pending_Byte> tx_queue;
+    std::deque<char> rx_fifo;
+    unsigned long long tx_free_at;
+    unsigned long overflows_reported;
+
+    bool flow_wired;
+    byte rts_input;
+    byte cts_output;
+    bool rts_holding;                 //Output held back by RTS at the last delivery
+
+    long link_baud;
+    long modem_baud;                  //0 = autobaud
+    bool booted;
+
+    Profile current;
+    Profile saved;
+
+    bool network_registered;
+    bool sim_inserted;
+    bool radio_on;
+    bool gprs_up;
+    bool socket_open;
+
+    std::vector<Stored_Sms> inbox;
+    int next_sms_index;
+    int next_message_ref;
+
+    char call_status;                 //+CLCC <stat>, '\0' = no call
+    char call_direction;
+    std::string call_number;
+    unsigned long call_id;
+
+    enum Data_Mode {DM_COMMAND, DM_SMS_TEXT, DM_UPLOAD};
+    Data_Mode data_mode;
+    std::string command_line;
+    std::string data_buffer;
+
+    std::vector<Capture_Line> capture_tx;
+    std::vector<Capture_Record> capture_rx;
+    bool replaying;
+    unsigned int replay_speed;
+    size_t replay_line;
+    size_t replay_record;
+    unsigned long long replay_anchor_us;
+    unsigned long long replay_anchor_ms;
+    std::string replay_input;
+
+    void run_replay (void);
+    void replay_write (char value);
+    void replay_anchor (size_t line);
+
+    void let_time_pass (void);
+    bool rts_paused (void);
+    bool cts_raised (void);
+    int read_cts (void);
+
+    unsigned long long byte_time_us (void);
+    bool rates_match (void);
+    bool random_drop (void);
+    void run_timers (void);
+    void deliver (void);
+
+    unsigned long latency_for (const std::string &command);
+    void emit_raw (const std::string &text);
+    void emit_line (const std::string &text);
+    void reply (const std::vector<std::string> &lines, const std::string &result, unsigned long latency_ms);
+
+    void handle_command (const std::string &command);
+    std::string run_command (const std::string &command, std::vector<std::string> &lines);
+    void handle_data (char value);
+
+    void set_call_status (char status);
+    void end_call (void);
+    std::string clcc_line (void);
+};
+
+#endif
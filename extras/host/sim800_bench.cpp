@@ -0,0 +1,466 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// End-to-end benchmark of the public operations
+//-------------------------------------------------------------------
+// Runs each operation against Sim800_Simulator (with its default, roughly
+// real-world latencies) on the virtual clock, and reports per operation:
+//   virtual_ms  - how long it would take on the device
+//   delay_ms    - how much of that was the library's own delay() calls
+//   wait_ms     - the rest (waiting on the module, and time on the wire)
+//   wall_us     - host CPU time for the whole operation
+//   tx/rx bytes and round trips (commands sent)
+//
+// The start-up section brings up a fresh module (and a fresh SIM800_Control,
+// as after a restart) each way, then sends an SMS and a telemetry batch:
+//   cold_start        - the default initialise()
+//   lazy_cold_start   - ::lazy_init, leaving SMS text mode for the first send
+//   fast_boot_first   - ::fast_boot on a module with nothing saved yet
+//   fast_boot_matched - ::fast_boot again after a reboot, with the profile saved
+// and reports the start-up time, its round trips, and ::time_to_first_sms and
+// ::time_to_first_upload.  Recovery from a reboot (resume_after_reboot()
+// against a full initialise()) is timed by the reboot_resume and
+// reboot_initialise operations
+//
+// The slice section drives a fresh SIM800_Control with nothing but
+// ::refresh_slice(BENCH_SLICE_BUDGET_MS):
+//   slice_start        - start-up from a booted module
+//   slice_reboot       - recovery after the module reboots
+// and reports the virtual time, the number of slices, and ::slice_worst_us
+// against the budget (a run only passes if every slice kept to it)
+//
+// Usage: sim800_bench [--json] [--iterations n] [--baud rate]
+//   --json writes one JSON document to stdout, for comparing commits
+//-------------------------------------------------------------------
+
+#include "SIM800_Control.h"
+#include "SIM800_Telemetry.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define BENCH_SLICE_BUDGET_MS 5
+
+struct Bench_Result
+{
+  std::string name;
+  unsigned int runs;
+  unsigned int passes;
+  unsigned long long virtual_us;
+  unsigned long long delay_us;
+  unsigned long long wall_ns;
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+  unsigned long round_trips;
+};
+
+struct Startup_Result
+{
+  std::string name;
+  unsigned int runs;
+  unsigned int passes;
+  unsigned long long startup_us;
+  unsigned long round_trips;
+  unsigned long long first_sms_ms;
+  unsigned long long first_upload_ms;
+};
+
+static Sim800_Simulator modem;
+static SIM800_Control gsm (modem, 0);
+static SIM800_Telemetry telemetry (gsm);
+static std::vector<Bench_Result> results;
+struct Slice_Result
+{
+  std::string name;
+  unsigned int runs;
+  unsigned int passes;
+  unsigned long long virtual_us;
+  unsigned long slices;
+  unsigned long worst_us;
+};
+
+static std::vector<Startup_Result> startup_results;
+static std::vector<Slice_Result> slice_results;
+
+static char test_number[] = "+447700900123";
+
+//================================================================================================
+template <typename Operation> static void run_operation (const char *name, Operation operation)
+{
+  Bench_Result *result = NULL;
+
+  for (size_t idx = 0; idx < results.size(); idx++)
+  {
+    if (results[idx].name == name) result = &results[idx];
+  }
+
+  if (result == NULL)
+  {
+    Bench_Result fresh = {name, 0, 0, 0, 0, 0, 0, 0, 0};
+    results.push_back (fresh);
+    result = &results.back();
+  }
+
+  //Let the poll caches (network, signal, SMS) expire, and any stray URCs arrive
+  unsigned long settle_start = millis();
+  while ((millis() - settle_start) < 11000UL)
+  {
+    gsm.refresh();
+  }
+
+  unsigned long long virtual_start = host_clock_us();
+  unsigned long long delay_start = host_delay_us();
+  unsigned long tx_start = modem.bytes_received;
+  unsigned long rx_start = modem.bytes_sent;
+  unsigned long commands_start = modem.commands_handled;
+  std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+
+  bool passed = operation();
+
+  std::chrono::steady_clock::time_point wall_end = std::chrono::steady_clock::now();
+
+  result->runs++;
+  if (passed == true) result->passes++;
+  result->virtual_us += host_clock_us() - virtual_start;
+  result->delay_us += host_delay_us() - delay_start;
+  result->wall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(wall_end - wall_start).count();
+  result->tx_bytes += modem.bytes_received - tx_start;
+  result->rx_bytes += modem.bytes_sent - rx_start;
+  result->round_trips += modem.commands_handled - commands_start;
+}
+
+//================================================================================================
+static void run_suite (long baud_rate)
+{
+  run_operation ("begin", [baud_rate] { gsm.begin (9600, baud_rate); return (gsm.link_baud_rate == baud_rate); });
+  run_operation ("initialise", [] { gsm.initialise (false); return gsm.initialised; });
+  run_operation ("connected_to_network", [] { return gsm.connected_to_network(); });
+  run_operation ("get_signal_bars", [] { return (gsm.get_signal_bars() > 0); });
+
+  run_operation ("send_sms_from_buffer", []
+  {
+    strcpy (gsm.sms_buffer, "Benchmark message");
+    return gsm.send_sms_from_buffer (test_number);
+  });
+
+  modem.receive_sms ("+447700900999", "Inbound benchmark message");
+
+  char sms_id[4];
+  run_operation ("get_pending_sms", [&sms_id] { return (gsm.get_pending_sms (&sms_id) && (sms_id[0] != '\0')); });
+  run_operation ("delete_sms", [&sms_id] { gsm.delete_sms (sms_id); return (modem.stored_sms() == 0); });
+
+  run_operation ("put_balance_in_sms_buffer", [] { return gsm.put_balance_in_sms_buffer(); });
+  run_operation ("call_number", [] { return gsm.call_number (test_number); });
+
+  run_operation ("web_submission", []
+  {
+    if (gsm.prep_for_web_submission() == false) return false;
+
+    const char *payload = "GET /bench HTTP/1.0\r\nHost: lythamrnli.jamesamor.co.uk\r\n";
+    while (*payload != '\0') gsm.write (*payload++);
+
+    return gsm.complete_web_submission();
+  });
+
+  //A batch of readings over one connection
+  run_operation ("telemetry_flush", []
+  {
+    for (int idx = 0; idx < SIM800_TELEMETRY_BATCH; idx++) telemetry.add ("t=21.5,h=40");
+    return (telemetry.flush() && (telemetry.pending() == 0));
+  });
+
+  run_operation ("refresh_idle", []
+  {
+    for (int idx = 0; idx < 1000; idx++) gsm.refresh();
+    return true;
+  });
+
+  //A reboot ("Call Ready" then "SMS Ready"), recovered by refresh() through
+  //resume_after_reboot(), against a full initialise() after the same reboot
+  int resets = 0;
+
+  run_operation ("reboot_resume", [&resets]
+  {
+    resets = gsm.gsm_resets;
+    modem.reboot();
+
+    unsigned long start = millis();
+    while (((millis() - start) < 60000UL) && ((gsm.gsm_resets == resets) || (gsm.initialised == false)))
+    {
+      gsm.refresh();
+    }
+
+    resets++;
+    return ((gsm.initialised == true) && (gsm.gsm_resets == resets));
+  });
+
+  //(the settle before it catches a second count of the reboot above)
+  run_operation ("reboot_initialise", [&resets]
+  {
+    bool counted_once = (gsm.gsm_resets == resets);
+
+    modem.reboot();
+    gsm.initialise (false);
+    return ((gsm.initialised == true) && (counted_once == true));
+  });
+}
+
+//================================================================================================
+static void run_startup (const char *name, Sim800_Simulator &module, bool fast_boot, bool lazy_init, long baud_rate)
+{
+  Startup_Result *result = NULL;
+
+  for (size_t idx = 0; idx < startup_results.size(); idx++)
+  {
+    if (startup_results[idx].name == name) result = &startup_results[idx];
+  }
+
+  if (result == NULL)
+  {
+    Startup_Result fresh = {name, 0, 0, 0, 0, 0, 0};
+    startup_results.push_back (fresh);
+    result = &startup_results.back();
+  }
+
+  SIM800_Control unit (module, 0);
+  SIM800_Telemetry readings (unit);
+
+  unit.fast_boot = fast_boot;
+  unit.lazy_init = lazy_init;
+
+  unsigned long long virtual_start = host_clock_us();
+  unsigned long commands_start = module.commands_handled;
+
+  unit.begin (9600, baud_rate);
+  unit.initialise (false);
+
+  result->startup_us += host_clock_us() - virtual_start;
+  result->round_trips += module.commands_handled - commands_start;
+
+  strcpy (unit.sms_buffer, "Benchmark message");
+  bool sent = unit.send_sms_from_buffer (test_number);
+
+  for (int idx = 0; idx < SIM800_TELEMETRY_BATCH; idx++) readings.add ("t=21.5,h=40");
+  bool uploaded = readings.flush();
+
+  result->runs++;
+  if ((unit.initialised == true) && (sent == true) && (uploaded == true)) result->passes++;
+  result->first_sms_ms += unit.time_to_first_sms;
+  result->first_upload_ms += unit.time_to_first_upload;
+}
+
+//================================================================================================
+static void run_startup_suite (long baud_rate)
+{
+  Sim800_Simulator cold_module;
+  Sim800_Simulator lazy_module;
+  Sim800_Simulator saved_module;
+
+  run_startup ("cold_start", cold_module, false, false, baud_rate);
+  run_startup ("lazy_cold_start", lazy_module, false, true, baud_rate);
+  run_startup ("fast_boot_first", saved_module, true, false, baud_rate);
+
+  //The first run saved the profile (AT&W); restart both ends
+  saved_module.reboot();
+  run_startup ("fast_boot_matched", saved_module, true, false, baud_rate);
+}
+
+//================================================================================================
+//Calls refresh_slice() until <done>, or a couple of minutes have gone
+template <typename Done> static void run_slice (const char *name, SIM800_Control &unit, Done done)
+{
+  Slice_Result *result = NULL;
+
+  for (size_t idx = 0; idx < slice_results.size(); idx++)
+  {
+    if (slice_results[idx].name == name) result = &slice_results[idx];
+  }
+
+  if (result == NULL)
+  {
+    Slice_Result fresh = {name, 0, 0, 0, 0, 0};
+    slice_results.push_back (fresh);
+    result = &slice_results.back();
+  }
+
+  unsigned long long virtual_start = host_clock_us();
+  unsigned long start = millis();
+  unsigned long slices = 0;
+  bool finished = false;
+
+  unit.slice_worst_us = 0;
+
+  while ((finished == false) && ((millis() - start) < 120000UL))
+  {
+    finished = ((unit.refresh_slice (BENCH_SLICE_BUDGET_MS) == true) && (done() == true));
+    slices++;
+  }
+
+  result->runs++;
+  if ((finished == true) && (unit.slice_worst_us <= (BENCH_SLICE_BUDGET_MS * 1000UL))) result->passes++;
+  result->virtual_us += host_clock_us() - virtual_start;
+  result->slices += slices;
+  if (unit.slice_worst_us > result->worst_us) result->worst_us = unit.slice_worst_us;
+}
+
+//================================================================================================
+static void run_slice_suite (long baud_rate)
+{
+  Sim800_Simulator module;
+  SIM800_Control unit (module, 0);
+
+  unit.begin (9600, baud_rate);
+  run_slice ("slice_start", unit, [] { return true; });
+
+  int resets = unit.gsm_resets;
+  module.reboot();
+  run_slice ("slice_reboot", unit, [&unit, resets] { return (unit.gsm_resets != resets); });
+}
+
+//================================================================================================
+static void print_table (unsigned int iterations, long baud_rate)
+{
+  printf ("SIM800 end-to-end benchmark (%u iterations, %ld baud, averages per run)\n\n", iterations, baud_rate);
+  printf ("%-26s %5s %11s %10s %10s %10s %8s %8s %6s\n",
+          "operation", "pass", "virtual_ms", "delay_ms", "wait_ms", "wall_us", "tx", "rx", "trips");
+
+  for (size_t idx = 0; idx < results.size(); idx++)
+  {
+    const Bench_Result &result = results[idx];
+    double runs = (double)result.runs;
+
+    printf ("%-26s %2u/%-2u %11.1f %10.1f %10.1f %10.1f %8.1f %8.1f %6.1f\n",
+            result.name.c_str(), result.passes, result.runs,
+            result.virtual_us / runs / 1000.0,
+            result.delay_us / runs / 1000.0,
+            (result.virtual_us - result.delay_us) / runs / 1000.0,
+            result.wall_ns / runs / 1000.0,
+            result.tx_bytes / runs, result.rx_bytes / runs, result.round_trips / runs);
+  }
+
+  printf ("\n%-26s %5s %11s %6s %13s %16s\n", "start-up", "pass", "startup_ms", "trips", "first_sms_ms", "first_upload_ms");
+
+  for (size_t idx = 0; idx < startup_results.size(); idx++)
+  {
+    const Startup_Result &result = startup_results[idx];
+    double runs = (double)result.runs;
+
+    printf ("%-26s %2u/%-2u %11.1f %6.1f %13.1f %16.1f\n",
+            result.name.c_str(), result.passes, result.runs,
+            result.startup_us / runs / 1000.0, result.round_trips / runs,
+            result.first_sms_ms / runs, result.first_upload_ms / runs);
+  }
+
+  printf ("\n%-26s %5s %11s %8s %9s %9s\n", "slice", "pass", "virtual_ms", "slices", "worst_us", "budget_us");
+
+  for (size_t idx = 0; idx < slice_results.size(); idx++)
+  {
+    const Slice_Result &result = slice_results[idx];
+    double runs = (double)result.runs;
+
+    printf ("%-26s %2u/%-2u %11.1f %8.1f %9lu %9lu\n",
+            result.name.c_str(), result.passes, result.runs,
+            result.virtual_us / runs / 1000.0, result.slices / runs, result.worst_us, BENCH_SLICE_BUDGET_MS * 1000UL);
+  }
+
+  printf ("\nprotocol errors: %u, rx overflows: %lu\n", gsm.protocol_error_count, modem.overflow_count);
+}
+
+//================================================================================================
+static void print_json (unsigned int iterations, long baud_rate)
+{
+  printf ("{\n  \"benchmark\": \"sim800_e2e\",\n  \"iterations\": %u,\n  \"baud\": %ld,\n", iterations, baud_rate);
+  printf ("  \"protocol_errors\": %u,\n  \"rx_overflows\": %lu,\n  \"operations\": [\n", gsm.protocol_error_count, modem.overflow_count);
+
+  for (size_t idx = 0; idx < results.size(); idx++)
+  {
+    const Bench_Result &result = results[idx];
+    double runs = (double)result.runs;
+
+    printf ("    {\"name\": \"%s\", \"runs\": %u, \"passes\": %u, "
+            "\"virtual_ms\": %.3f, \"delay_ms\": %.3f, \"wait_ms\": %.3f, \"wall_us\": %.3f, "
+            "\"tx_bytes\": %.1f, \"rx_bytes\": %.1f, \"round_trips\": %.1f}%s\n",
+            result.name.c_str(), result.runs, result.passes,
+            result.virtual_us / runs / 1000.0,
+            result.delay_us / runs / 1000.0,
+            (result.virtual_us - result.delay_us) / runs / 1000.0,
+            result.wall_ns / runs / 1000.0,
+            result.tx_bytes / runs, result.rx_bytes / runs, result.round_trips / runs,
+            (idx + 1 < results.size()) ? "," : "");
+  }
+
+  printf ("  ],\n  \"startup\": [\n");
+
+  for (size_t idx = 0; idx < startup_results.size(); idx++)
+  {
+    const Startup_Result &result = startup_results[idx];
+    double runs = (double)result.runs;
+
+    printf ("    {\"name\": \"%s\", \"runs\": %u, \"passes\": %u, \"startup_ms\": %.3f, \"round_trips\": %.1f, "
+            "\"time_to_first_sms_ms\": %.1f, \"time_to_first_upload_ms\": %.1f}%s\n",
+            result.name.c_str(), result.runs, result.passes,
+            result.startup_us / runs / 1000.0, result.round_trips / runs,
+            result.first_sms_ms / runs, result.first_upload_ms / runs,
+            (idx + 1 < startup_results.size()) ? "," : "");
+  }
+
+  printf ("  ],\n  \"slice_budget_us\": %lu,\n  \"slice\": [\n", BENCH_SLICE_BUDGET_MS * 1000UL);
+
+  for (size_t idx = 0; idx < slice_results.size(); idx++)
+  {
+    const Slice_Result &result = slice_results[idx];
+    double runs = (double)result.runs;
+
+    printf ("    {\"name\": \"%s\", \"runs\": %u, \"passes\": %u, \"virtual_ms\": %.3f, \"slices\": %.1f, \"worst_us\": %lu}%s\n",
+            result.name.c_str(), result.runs, result.passes,
+            result.virtual_us / runs / 1000.0, result.slices / runs, result.worst_us,
+            (idx + 1 < slice_results.size()) ? "," : "");
+  }
+
+  printf ("  ]\n}\n");
+}
+
+//================================================================================================
+int main (int argc, char **argv)
+{
+  bool json = false;
+  unsigned int iterations = 5;
+  long baud_rate = 115200;
+
+  for (int arg = 1; arg < argc; arg++)
+  {
+    if (strcmp (argv[arg], "--json") == 0) json = true;
+    else if ((strcmp (argv[arg], "--iterations") == 0) && (arg + 1 < argc)) iterations = atoi (argv[++arg]);
+    else if ((strcmp (argv[arg], "--baud") == 0) && (arg + 1 < argc)) baud_rate = atol (argv[++arg]);
+    else
+    {
+      fprintf (stderr, "Usage: %s [--json] [--iterations n] [--baud rate]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  //The debug output would swamp the report (and the timings)
+  host_clock_set_virtual (true);
+  Serial.muted = true;
+
+  for (unsigned int run = 0; run < iterations; run++)
+  {
+    run_suite (baud_rate);
+    run_startup_suite (baud_rate);
+    run_slice_suite (baud_rate);
+  }
+
+  if (json == true) print_json (iterations, baud_rate);
+  else print_table (iterations, baud_rate);
+
+  return 0;
+}
@@ -0,0 +1,255 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// End-to-end test of the Linux backend
+//-------------------------------------------------------------------
+// Drives SIM800_Control through Sim800_Linux_Serial, Sim800_Linux_IO and
+// Sim800_Linux_Gateway, exactly as a gateway would, with a pseudo terminal
+// (openpty) in place of the USB-serial adapter.  A thread on the other end
+// of the pty plays a minimal SIM800: it answers the start-up commands,
+// accepts an SMS, and then announces an incoming one (+CMTI).
+//
+// Checks that begin() finds the module, initialise() and an SMS send run
+// as gateway jobs, the +CMTI arrives as an EV_SMS_RECEIVED event, and the
+// receive ring never overflowed.  Then hangs up the pty, as unplugging the
+// adapter would, and checks the port is closed, the gateway reports the
+// modem lost, and neither thread keeps waking.  Runs in real time (a few
+// seconds)
+//
+// Usage: sim800_linux_test   (exits non-zero if a check fails)
+//-------------------------------------------------------------------
+
+#include "SIM800_Control.h"
+
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+
+static std::atomic<bool> modem_running;
+static std::atomic<unsigned int> sms_received;
+static std::atomic<unsigned int> io_wakes;
+static std::atomic<bool> modem_lost;
+
+static char test_number[] = "+447700900123";
+static unsigned int failures = 0;
+
+//================================================================================================
+static void modem_send (int fd, const std::string &text)
+{
+  if (write (fd, text.c_str(), text.size()) < 0) {}
+}
+
+//================================================================================================
+static void modem_reply (int fd, const std::string &line)
+{
+  //Echo is never turned on, so it's just the reply
+  if ((line == "AT") || (line == "ATE 0") || (line == "AT&F") ||
+      (line.compare (0, 7, "AT+CMGF") == 0) || (line.compare (0, 7, "AT+CLIP") == 0) ||
+      (line.compare (0, 7, "AT+CUSD") == 0) || (line.compare (0, 7, "AT+CFUN") == 0))
+  {
+    modem_send (fd, "\r\nOK\r\n");
+
+    //Boot already finished; announce it for initialise() to find
+    if (line == "AT") modem_send (fd, "\r\nSMS Ready\r\n");
+  }
+  else if (line == "AT+CCID")
+  {
+    modem_send (fd, "\r\n8944500102198304826\r\n\r\nOK\r\n");
+  }
+  else
+  {
+    modem_send (fd, "\r\nERROR\r\n");
+  }
+}
+
+//================================================================================================
+static void modem_run (int fd)
+{
+  std::string line;
+  bool sms_text = false;
+  char incoming;
+
+  while (modem_running == true)
+  {
+    struct pollfd readable;
+    readable.fd = fd;
+    readable.events = POLLIN;
+
+    if ((poll (&readable, 1, 50) <= 0) || (read (fd, &incoming, 1) != 1)) continue;
+
+    if (sms_text == true)
+    {
+      //Everything up to CTRL+Z is the message
+      if (incoming != char(0x1A)) continue;
+
+      sms_text = false;
+      sms_received++;
+      modem_send (fd, "\r\n+CMGS: 1\r\n\r\nOK\r\n");
+      modem_send (fd, "\r\n+CMTI: \"SM\",3\r\n");
+      continue;
+    }
+
+    if (incoming == '\n') continue;
+
+    if (incoming != '\r')
+    {
+      line += incoming;
+      continue;
+    }
+
+    if (line.compare (0, 8, "AT+CMGS=") == 0)
+    {
+      modem_send (fd, "\r\n> ");
+      sms_text = true;
+    }
+    else if (line.empty() == false)
+    {
+      modem_reply (fd, line);
+    }
+
+    line.clear();
+  }
+}
+
+//================================================================================================
+static void check (const char *name, bool passed)
+{
+  printf ("%-34s %s\n", name, (passed == true) ? "ok" : "FAILED");
+  if (passed == false) failures++;
+}
+
+//================================================================================================
+//Runs <job> on the gateway's control thread, and waits (up to <timeout_s>) for its result
+template <typename Job> static bool run_job (Sim800_Linux_Gateway &gateway, Job job, unsigned int timeout_s)
+{
+  std::shared_ptr<std::promise<bool> > result (new std::promise<bool>);
+  std::future<bool> outcome = result->get_future();
+
+  gateway.post ([result, job] { result->set_value (job()); });
+
+  if (outcome.wait_for (std::chrono::seconds(timeout_s)) != std::future_status::ready) return false;
+  return outcome.get();
+}
+
+//================================================================================================
+int main (void)
+{
+  int modem_fd;
+  int port_fd;
+  char port_name[64];
+
+  if (openpty (&modem_fd, &port_fd, port_name, NULL, NULL) != 0)
+  {
+    perror ("openpty");
+    return 1;
+  }
+
+  //The library opens the port by name, as it would a /dev/ttyUSBn
+  struct termios raw;
+  tcgetattr (modem_fd, &raw);
+  cfmakeraw (&raw);
+  tcsetattr (modem_fd, TCSANOW, &raw);
+
+  modem_running = true;
+  sms_received = 0;
+  io_wakes = 0;
+  modem_lost = false;
+  std::thread modem_thread (modem_run, modem_fd);
+
+  Sim800_Linux_Serial port (port_name);
+  SIM800_Control gsm (port, 0);
+  Sim800_Linux_IO io;
+  Sim800_Linux_Gateway gateway;
+
+  //Only the SMS text format is needed, so skip the radio cycle
+  gsm.lazy_init = true;
+
+  check ("add_port", io.add_port (port));
+  io.on_receive = [&] { io_wakes++; gateway.wake(); };
+  check ("io start", io.start());
+
+  gsm.begin (9600, 9600);
+  check ("begin", gsm.link_baud_rate == 9600);
+
+  gateway.add_modem (gsm, &port);
+  gateway.on_modem_lost = [&] (SIM800_Control &) { modem_lost = true; };
+  gateway.start();
+
+  check ("initialise", run_job (gateway, [&] { gsm.initialise (false); return gsm.initialised; }, 30));
+
+  check ("send_sms_from_buffer", run_job (gateway, [&]
+  {
+    gsm.clear_sms_buffer();
+    strcpy (gsm.sms_buffer, "Linux backend test");
+    return gsm.send_sms_from_buffer (test_number);
+  }, 30));
+
+  check ("modem took the message", sms_received == 1);
+
+  //The +CMTI is picked up by the gateway's own refresh()
+  bool sms_event = false;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+  while ((sms_event == false) && (std::chrono::steady_clock::now() < deadline))
+  {
+    sms_event = run_job (gateway, [&]
+    {
+      Sim800_Event event;
+
+      while (gsm.events.pop (&event) == true)
+      {
+        if ((event.type == EV_SMS_RECEIVED) && (strcmp (event.data, "3") == 0)) return true;
+      }
+      return false;
+    }, 5);
+
+    if (sms_event == false) std::this_thread::sleep_for (std::chrono::milliseconds(50));
+  }
+
+  check ("EV_SMS_RECEIVED", sms_event);
+  check ("no protocol errors", gsm.protocol_error_count == 0);
+  check ("no rx ring overflows", port.overflow_count == 0);
+
+  //Unplug: the modem end of the pty goes away
+  modem_running = false;
+  modem_thread.join();
+  close (modem_fd);
+
+  deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while ((modem_lost == false) && (std::chrono::steady_clock::now() < deadline))
+  {
+    std::this_thread::sleep_for (std::chrono::milliseconds(10));
+  }
+
+  check ("port lost", port.lost() && (port.port_fd() < 0));
+  check ("gateway reported modem lost", modem_lost == true);
+
+  //A hung up port left in epoll would be reported (and wake the gateway) on every wait
+  unsigned int wakes_after_loss = io_wakes;
+  std::this_thread::sleep_for (std::chrono::milliseconds(300));
+  check ("no wakes after hang up", io_wakes == wakes_after_loss);
+
+  gateway.stop();
+  io.stop();
+  close (port_fd);
+
+  printf ("\n%s\n", (failures == 0) ? "PASS" : "FAIL");
+
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,299 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Microbenchmark of the parsing kernels (SIM800_Parse)
+//-------------------------------------------------------------------
+// Runs each kernel over a corpus of real modem output and reports ns/line
+// and cycles/byte (cycles from the TSC on x86, otherwise not reported).
+// The "(old)" rows are the loops the kernels replaced, kept here as a
+// baseline: a strstr per code for the URCs, and strlen() on every pass of
+// the comma-splitting loops.
+//
+// Usage: sim800_parse_bench [--json] [--repeat n]
+//-------------------------------------------------------------------
+
+#include "SIM800_Parse.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_CYCLE_COUNTER 1
+  static inline unsigned long long cycle_count (void) { return __rdtsc(); }
+#else
+  #define HAVE_CYCLE_COUNTER 0
+  static inline unsigned long long cycle_count (void) { return 0; }
+#endif
+
+#define LINE_SIZE 162
+
+//Captured from a SIM800L (R14.18) on Vodafone UK: start-up, polling,
+//SMS, calls, USSD and a web submission
+static const char *CORPUS[] =
+{
+  "RDY", "+CFUN: 1", "+CPIN: READY", "Call Ready", "SMS Ready",
+  "AT", "OK", "OK", "OK",
+  "8944100030123456789F", "OK",
+  "+CREG: 0,1", "OK",
+  "+CSQ: 18,0", "OK",
+  "+CGREG: 0,1", "OK",
+  "+CGATT: 1", "OK",
+  "+CMTI: \"SM\",3",
+  "+CMGL: 3,\"REC UNREAD\",\"+447881554465\",\"\",\"19/04/23,15:17:24+04\"",
+  "Pump 2 running, tank level 74%",
+  "OK",
+  "+CMGL: 4,\"REC UNREAD\",\"Lebara\",\"\",\"19/04/24,09:02:11+04\"",
+  "0059006F00750072002000620061006C0061006E0063006500200069007300200035002E0030003000200047004200500021",
+  "OK",
+  "RING",
+  "+CLIP: \"+447881554465\",145,\"\",0,\"\",0",
+  "RING",
+  "+CLIP: \"+447881554465\",145,\"\",0,\"\",0",
+  "NO CARRIER",
+  "+CLCC: 1,0,2,0,0,\"+447881554465\",145",
+  "+CLCC: 1,0,3,0,0,\"+447881554465\",145",
+  "+CLCC: 1,0,0,0,0,\"+447881554465\",145",
+  "+CLCC: 1,0,6,0,0,\"+447881554465\",145",
+  "+CUSD: 0,\"Your balance is 5.00 GBP. Top up at vodafone.co.uk\",15",
+  "+CUSD: 0,\"00590065007300210020004F006B\",72",
+  "10.64.12.7",
+  "CONNECT OK",
+  "SEND OK",
+  "+BOB: 1",
+  "CLOSED",
+  "SHUT OK",
+  "+CMGS: 112", "OK",
+  "ERROR"
+};
+#define CORPUS_LINES (sizeof(CORPUS) / sizeof(CORPUS[0]))
+
+struct Kernel_Result
+{
+  std::string name;
+  unsigned long long lines;
+  unsigned long long bytes;
+  unsigned long long nanoseconds;
+  unsigned long long cycles;
+};
+
+static std::vector<Kernel_Result> results;
+static volatile unsigned long sink;
+
+//================================================================================================
+//The pre-SIM800_Parse versions, for comparison
+static byte old_classify_urc (const char *line)
+{
+  if (strstr (line, "+CUSD: ") != NULL) return URC_USSD;
+  else if (strstr (line, "+CLIP: ") != NULL) return URC_CALLER_ID;
+  else if (strstr (line, "+CLCC: ") != NULL) return URC_CALL_STATE;
+  else if (strstr (line, "NO CARRIER") != NULL) return URC_NO_CARRIER;
+  else if (strstr (line, "+CMTI: \"SM\"") != NULL) return URC_SMS;
+  else if ((strstr (line, "SMS Ready") != NULL) || (strstr (line, "Call Ready") != NULL)) return URC_READY;
+  else if (strstr (line, "CLOSED") != NULL) return URC_CLOSED;
+
+  return URC_NONE;
+}
+
+//================================================================================================
+static char old_csv_field (char *line, byte field)
+{
+  byte csv_token = 0;
+  byte token_start = 0;
+
+  for (byte idx = 6; idx < strlen(line); idx++)
+  {
+    if (line[idx] == ',')
+    {
+      csv_token++;
+      if (csv_token == field) token_start = idx+1;
+      if (csv_token == field + 1) line[idx] = '\0';
+    }
+  }
+
+  return line[token_start];
+}
+
+//================================================================================================
+template <typename Kernel> static void time_kernel (const char *name, const std::vector<std::string> &lines,
+                                                   unsigned int repeat, Kernel kernel)
+{
+  Kernel_Result result = {name, 0, 0, 0, 0};
+  char scratch[LINE_SIZE];
+
+  for (size_t idx = 0; idx < lines.size(); idx++) result.bytes += lines[idx].size();
+  result.bytes *= repeat;
+  result.lines = (unsigned long long)lines.size() * repeat;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  unsigned long long cycles_start = cycle_count();
+
+  for (unsigned int run = 0; run < repeat; run++)
+  {
+    for (size_t idx = 0; idx < lines.size(); idx++)
+    {
+      //Most kernels work in place, so give each a fresh copy (as rx_buffer would be)
+      memcpy (scratch, lines[idx].c_str(), lines[idx].size() + 1);
+      sink += kernel (scratch);
+    }
+  }
+
+  result.cycles = cycle_count() - cycles_start;
+  result.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+  results.push_back (result);
+}
+
+//================================================================================================
+static std::vector<std::string> lines_starting (const char *prefix)
+{
+  std::vector<std::string> matching;
+
+  for (size_t idx = 0; idx < CORPUS_LINES; idx++)
+  {
+    if (strncmp (CORPUS[idx], prefix, strlen(prefix)) == 0) matching.push_back (CORPUS[idx]);
+  }
+
+  return matching;
+}
+
+//================================================================================================
+static void time_framing (unsigned int repeat)
+{
+  Kernel_Result result = {"frame_byte", 0, 0, 0, 0};
+  std::string stream;
+  char line[LINE_SIZE];
+  byte line_pos = 0;
+
+  //As the module sends it: <CR><LF>text<CR><LF>
+  for (size_t idx = 0; idx < CORPUS_LINES; idx++)
+  {
+    stream += "\r\n";
+    stream += CORPUS[idx];
+    stream += "\r\n";
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  unsigned long long cycles_start = cycle_count();
+
+  for (unsigned int run = 0; run < repeat; run++)
+  {
+    for (size_t idx = 0; idx < stream.size(); idx++)
+    {
+      if (sim800_frame_byte (line, &line_pos, LINE_SIZE, stream[idx]) == true)
+      {
+        result.lines++;
+        line_pos = 0;
+      }
+    }
+  }
+
+  result.cycles = cycle_count() - cycles_start;
+  result.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  result.bytes = (unsigned long long)stream.size() * repeat;
+  sink += line_pos;
+
+  results.push_back (result);
+}
+
+//================================================================================================
+static void print_results (bool json, unsigned int repeat)
+{
+  if (json == true)
+  {
+    printf ("{\n  \"benchmark\": \"sim800_parse\",\n  \"repeat\": %u,\n  \"corpus_lines\": %u,\n  \"kernels\": [\n",
+            repeat, (unsigned int)CORPUS_LINES);
+  }
+  else
+  {
+    printf ("SIM800 parsing kernels (%u lines of corpus x %u)\n\n", (unsigned int)CORPUS_LINES, repeat);
+    printf ("%-22s %12s %10s %12s\n", "kernel", "lines", "ns/line", "cycles/byte");
+  }
+
+  for (size_t idx = 0; idx < results.size(); idx++)
+  {
+    const Kernel_Result &result = results[idx];
+    double ns_per_line = (double)result.nanoseconds / (double)result.lines;
+    double cycles_per_byte = (double)result.cycles / (double)result.bytes;
+
+    if (json == true)
+    {
+      printf ("    {\"name\": \"%s\", \"lines\": %llu, \"bytes\": %llu, \"ns_per_line\": %.2f, ",
+              result.name.c_str(), result.lines, result.bytes, ns_per_line);
+      if (HAVE_CYCLE_COUNTER) printf ("\"cycles_per_byte\": %.3f}", cycles_per_byte);
+      else printf ("\"cycles_per_byte\": null}");
+      printf ("%s\n", (idx + 1 < results.size()) ? "," : "");
+    }
+    else
+    {
+      printf ("%-22s %12llu %10.2f ", result.name.c_str(), result.lines, ns_per_line);
+      if (HAVE_CYCLE_COUNTER) printf ("%12.3f\n", cycles_per_byte);
+      else printf ("%12s\n", "n/a");
+    }
+  }
+
+  if (json == true) printf ("  ]\n}\n");
+}
+
+//================================================================================================
+int main (int argc, char **argv)
+{
+  bool json = false;
+  unsigned int repeat = 20000;
+
+  for (int arg = 1; arg < argc; arg++)
+  {
+    if (strcmp (argv[arg], "--json") == 0) json = true;
+    else if ((strcmp (argv[arg], "--repeat") == 0) && (arg + 1 < argc)) repeat = atoi (argv[++arg]);
+    else
+    {
+      fprintf (stderr, "Usage: %s [--json] [--repeat n]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<std::string> all_lines (CORPUS, CORPUS + CORPUS_LINES);
+  std::vector<std::string> clcc_lines = lines_starting ("+CLCC: ");
+  std::vector<std::string> cmgl_lines = lines_starting ("+CMGL: ");
+  std::vector<std::string> ucs2_lines;
+
+  for (size_t idx = 0; idx < CORPUS_LINES; idx++)
+  {
+    if (sim800_find_ucs2 (CORPUS[idx]) != SIM800_NOT_UCS2) ucs2_lines.push_back (CORPUS[idx]);
+  }
+
+  time_framing (repeat);
+
+  time_kernel ("classify_urc", all_lines, repeat, [] (char *line) { return sim800_classify_urc (line); });
+  time_kernel ("classify_urc (old)", all_lines, repeat, [] (char *line) { return old_classify_urc (line); });
+
+  time_kernel ("csv_field clcc", clcc_lines, repeat, [] (char *line)
+  {
+    char *status = sim800_csv_field (&line[6], 2);
+    return (status != NULL) ? *status : 0;
+  });
+  time_kernel ("csv_field clcc (old)", clcc_lines, repeat, [] (char *line) { return old_csv_field (line, 2); });
+
+  time_kernel ("csv_field cmgl", cmgl_lines, repeat, [] (char *line)
+  {
+    char *caller = sim800_csv_field (&line[7], 2);
+    return (caller != NULL) ? *sim800_csv_cut (caller) : 0;
+  });
+  time_kernel ("csv_field cmgl (old)", cmgl_lines, repeat, [] (char *line) { return old_csv_field (line, 2); });
+
+  time_kernel ("find_ucs2", all_lines, repeat, [] (char *line) { return sim800_find_ucs2 (line); });
+  time_kernel ("decode_ucs2", ucs2_lines, repeat, [] (char *line) { return sim800_decode_ucs2 (line, sim800_find_ucs2 (line)); });
+
+  print_results (json, repeat);
+
+  return 0;
+}
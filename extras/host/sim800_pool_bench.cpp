@@ -0,0 +1,118 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Benchmark of SIM800_Pool on three simulated modems
+//-------------------------------------------------------------------
+// Feeds a run of messages through the pool on the virtual clock while:
+//   modem 0 - sends everything it's given
+//   modem 1 - loses the network a few seconds in (+CMS ERROR for each send)
+//   modem 2 - reboots part way through, and is picked up again by refresh()
+//
+// Reports what each modem sent and failed, whether the pool was passing it
+// over at the end, and the overall rate.  Checks that every message got out,
+// that the modem without a network was marked as failing, and that the
+// reboot was seen
+//
+// Usage: sim800_pool_bench [--messages n]   (exits non-zero if a check fails)
+//-------------------------------------------------------------------
+
+#include "SIM800_Control.h"
+#include "SIM800_Pool.h"
+
+#define POOL_BENCH_MODEMS 3
+
+static Sim800_Simulator modem_0;
+static Sim800_Simulator modem_1;
+static Sim800_Simulator modem_2;
+static SIM800_Control gsm_0 (modem_0, 0);
+static SIM800_Control gsm_1 (modem_1, 0);
+static SIM800_Control gsm_2 (modem_2, 0);
+
+static SIM800_Control *gsm [POOL_BENCH_MODEMS] = {&gsm_0, &gsm_1, &gsm_2};
+static const char *roles [POOL_BENCH_MODEMS] = {"healthy", "network lost", "reboots"};
+
+static SIM800_Pool pool;
+static unsigned int failures = 0;
+
+//================================================================================================
+static void check (const char *name, bool passed)
+{
+  printf ("%-34s %s\n", name, (passed == true) ? "ok" : "FAILED");
+  if (passed == false) failures++;
+}
+
+//================================================================================================
+int main (int argc, char **argv)
+{
+  unsigned int messages = 40;
+
+  for (int arg = 1; arg < argc; arg++)
+  {
+    if ((strcmp (argv[arg], "--messages") == 0) && (arg + 1 < argc)) messages = atoi (argv[++arg]);
+    else
+    {
+      fprintf (stderr, "Usage: %s [--messages n]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  host_clock_set_virtual (true);
+  Serial.muted = true;
+
+  for (byte idx = 0; idx < POOL_BENCH_MODEMS; idx++)
+  {
+    gsm[idx]->begin (9600, 115200);
+    gsm[idx]->initialise (false);
+    pool.add_modem (*gsm[idx]);
+  }
+
+  modem_1.at (5000, [] { modem_1.set_registered (false); });
+  modem_2.at (30000, [] { modem_2.reboot(); });
+
+  int resets_before = gsm_2.gsm_resets;
+  unsigned long start = millis();
+  unsigned int queued = 0;
+  char message [32];
+
+  //Keep the pool full, and every modem's URCs read, until it's all out (or an hour has gone)
+  while (((pool.sent_count + pool.failed_count) < messages) && ((millis() - start) < 3600000UL))
+  {
+    snprintf (message, sizeof(message), "Pool message %u", queued);
+    if ((queued < messages) && (pool.queue_sms ("+447700900123", message) == true)) queued++;
+
+    pool.service();
+
+    for (byte idx = 0; idx < POOL_BENCH_MODEMS; idx++) gsm[idx]->refresh();
+  }
+
+  unsigned long elapsed = millis() - start;
+
+  printf ("SIM800 pool benchmark (%u messages, %d modems)\n\n", messages, POOL_BENCH_MODEMS);
+  printf ("%-6s %-14s %6s %7s %8s %7s %8s\n", "modem", "role", "sent", "failed", "errors", "resets", "failing");
+
+  for (byte idx = 0; idx < POOL_BENCH_MODEMS; idx++)
+  {
+    printf ("%-6u %-14s %6lu %7lu %8u %7d %8s\n", idx, roles[idx], pool.sent_by_modem[idx], pool.failed_by_modem[idx],
+            gsm[idx]->protocol_error_count, gsm[idx]->gsm_resets, (pool.modem_failing (idx) == true) ? "yes" : "no");
+  }
+
+  printf ("\nsent: %lu, failed: %lu, retries: %lu, virtual time: %.1f s, messages/hour: %lu\n\n",
+          pool.sent_count, pool.failed_count, pool.retry_count, elapsed / 1000.0, pool.messages_per_hour());
+
+  check ("every message sent", (pool.sent_count == messages) && (pool.failed_count == 0));
+  check ("lost network marked failing", pool.modem_failing (1) && (pool.sent_by_modem[1] < pool.sent_by_modem[0]));
+  check ("reboot seen", gsm_2.gsm_resets != resets_before);
+  check ("failed sends retried", pool.retry_count == (pool.failed_by_modem[0] + pool.failed_by_modem[1] + pool.failed_by_modem[2]));
+
+  printf ("\n%s\n", (failures == 0) ? "PASS" : "FAIL");
+
+  return (failures == 0) ? 0 : 1;
+}
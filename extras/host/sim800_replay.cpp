@@ -0,0 +1,294 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// Replay of a serial capture taken on the device
+//-------------------------------------------------------------------
+// Build the sketch with SIM800_ENABLE_CAPTURE 1, call gsm.capture.dump()
+// when something goes wrong, and save the console text to a file.  This
+// plays what the module sent back into the library, driving the public
+// operations that the captured commands came from (AT+CMGL ->
+// get_pending_sms, ATD -> dial_number, and so on), and reports how the
+// library handled it: results, events, protocol errors, and how well its
+// commands lined up with the capture.
+//
+// Runs on the virtual clock (as fast as it can, timings as on the device)
+// unless --realtime is given; --speed divides the captured gaps.
+//
+// Usage: sim800_replay <capture.txt> [--speed n] [--realtime] [--baud rate] [--verbose]
+//   --verbose shows the library's log (build with make replay LOG_LEVEL=3)
+//-------------------------------------------------------------------
+
+#include "SIM800_Control.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+//How far ahead of the next captured command to look for one we know
+#define DISPATCH_LOOKAHEAD 4
+
+static Sim800_Simulator modem;
+static SIM800_Control gsm (modem, 0);
+
+static const unsigned long long NOT_DUE = ~0ULL;
+
+//================================================================================================
+static bool starts_with (const std::string &text, const char *prefix)
+{
+  return (text.compare (0, strlen(prefix), prefix) == 0);
+}
+
+//================================================================================================
+static std::string quoted_field (const std::string &text)
+{
+  size_t start = text.find ('\"');
+  if (start == std::string::npos) return std::string();
+
+  size_t end = text.find ('\"', start + 1);
+  if (end == std::string::npos) return text.substr (start + 1);
+
+  return text.substr (start + 1, end - start - 1);
+}
+
+//================================================================================================
+static void report (const char *operation, const std::string &detail, bool result)
+{
+  printf ("%10.3f  %-26s %-24s %s\n", host_clock_us() / 1000000.0, operation, detail.c_str(), result ? "ok" : "FAIL");
+}
+
+//================================================================================================
+static void show_events (void)
+{
+  Sim800_Event event;
+
+  while (gsm.events.pop (&event) == true)
+  {
+    printf ("%10.3f    event %u %s\n", host_clock_us() / 1000000.0, (unsigned int)event.type, event.data);
+  }
+}
+
+//================================================================================================
+static void pump (void)
+{
+  //Let in everything the module sent before the next command, as the
+  //sketch's loop() would have
+  while (modem.replay_due_us() != NOT_DUE)
+  {
+    gsm.refresh();
+  }
+
+  show_events();
+}
+
+//================================================================================================
+static bool command_ahead (const char *prefix, size_t lookahead)
+{
+  for (size_t ahead = 0; ahead < lookahead; ahead++)
+  {
+    if (starts_with (modem.replay_next_line (ahead), prefix) == true) return true;
+  }
+
+  return false;
+}
+
+//================================================================================================
+static void web_submission (void)
+{
+  bool result = gsm.prep_for_web_submission();
+  report ("prep_for_web_submission", "", result);
+  if (result == false) return;
+
+  //The payload is whatever the sketch wrote between AT+CIPSEND and the CTRL+Z
+  //(collected first, as each line written moves the capture on)
+  std::string payload;
+
+  for (size_t ahead = 0; ahead < 32; ahead++)
+  {
+    std::string line = modem.replay_next_line (ahead);
+    if ((line.empty() == true) || (line[0] == char(26))) break;
+
+    payload += line + "\r\n";
+  }
+
+  for (size_t idx = 0; idx < payload.size(); idx++) gsm.write (payload[idx]);
+
+  report ("complete_web_submission", "", gsm.complete_web_submission());
+}
+
+//================================================================================================
+static bool dispatch (const std::string &line)
+{
+  char buffer[40];
+
+  if (line == "AT")
+  {
+    gsm.initialise (false);
+    report ("initialise", "", gsm.initialised);
+  }
+  else if (starts_with (line, "AT+CREG?") == true)
+  {
+    report ("connected_to_network", "", gsm.connected_to_network());
+  }
+  else if (starts_with (line, "AT+CSQ") == true)
+  {
+    byte bars = gsm.get_signal_bars();
+    report ("get_signal_bars", std::to_string (bars), (bars > 0));
+  }
+  else if (starts_with (line, "AT+CGREG?") == true)
+  {
+    if (command_ahead ("AT+CIPSTART", 8) == true) web_submission();
+    else report ("connected_to_gprs", "", gsm.connected_to_gprs());
+  }
+  else if (starts_with (line, "AT+CMGL") == true)
+  {
+    char sms_id[4];
+    bool result = gsm.get_pending_sms (&sms_id);
+    report ("get_pending_sms", result ? std::string(sms_id) + " " + gsm.sms_buffer : "", result);
+  }
+  else if (starts_with (line, "AT+CMGD=") == true)
+  {
+    strncpy (buffer, line.substr (8).c_str(), 3);
+    buffer[3] = '\0';
+    gsm.delete_sms (buffer);
+    report ("delete_sms", buffer, true);
+  }
+  else if (starts_with (line, "AT+CMGS=") == true)
+  {
+    strncpy (buffer, quoted_field (line).c_str(), sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    gsm.clear_sms_buffer();
+    strncpy (gsm.sms_buffer, modem.replay_next_line (1).c_str(), TX_BUFFER_SIZE - 1);
+    report ("send_sms_from_buffer", buffer, gsm.send_sms_from_buffer (buffer));
+  }
+  else if (starts_with (line, "AT+CUSD=1,") == true)
+  {
+    std::string code = quoted_field (line);
+
+    //Any message read earlier has been dealt with; send_ussd() won't take the buffer from it otherwise
+    gsm.clear_sms_buffer();
+    report ("send_ussd", code, gsm.send_ussd (code.c_str()));
+  }
+  else if (starts_with (line, "AT+CUSD=2") == true)
+  {
+    report ("cancel_ussd", "", gsm.cancel_ussd());
+  }
+  else if (starts_with (line, "ATD") == true)
+  {
+    std::string number = line.substr (3);
+    while ((number.empty() == false) && (number[0] == ' ')) number.erase (0, 1);
+    if ((number.empty() == false) && (number[number.size() - 1] == ';')) number.erase (number.size() - 1);
+
+    strncpy (buffer, number.c_str(), sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    report ("dial_number", buffer, gsm.dial_number (buffer));
+  }
+  else if (starts_with (line, "ATH") == true)
+  {
+    report ("hang_up", "", gsm.hang_up());
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+//================================================================================================
+int main (int argc, char **argv)
+{
+  const char *capture_file = NULL;
+  unsigned int speed = 1;
+  bool realtime = false;
+  bool verbose = false;
+  bool usage = false;
+  long baud_rate = 115200;
+
+  for (int arg = 1; arg < argc; arg++)
+  {
+    if ((strcmp (argv[arg], "--speed") == 0) && (arg + 1 < argc)) speed = atoi (argv[++arg]);
+    else if ((strcmp (argv[arg], "--baud") == 0) && (arg + 1 < argc)) baud_rate = atol (argv[++arg]);
+    else if (strcmp (argv[arg], "--realtime") == 0) realtime = true;
+    else if (strcmp (argv[arg], "--verbose") == 0) verbose = true;
+    else if ((argv[arg][0] != '-') && (capture_file == NULL)) capture_file = argv[arg];
+    else usage = true;
+  }
+
+  if ((capture_file == NULL) || (usage == true))
+  {
+    fprintf (stderr, "Usage: %s <capture.txt> [--speed n] [--realtime] [--baud rate] [--verbose]\n", argv[0]);
+    return 1;
+  }
+
+  std::ifstream input (capture_file);
+  std::stringstream dump;
+  dump << input.rdbuf();
+
+  if ((input.is_open() == false) || (modem.load_capture (dump.str()) == false))
+  {
+    fprintf (stderr, "%s: no capture found in %s\n", argv[0], capture_file);
+    return 1;
+  }
+
+  host_clock_set_virtual (true);
+  Serial.muted = !verbose;
+
+  //Bring the library up against the emulated module (always on the virtual
+  //clock, it's nothing to do with the capture), then hand over
+  gsm.begin (9600, baud_rate);
+  gsm.initialise (false);
+  show_events();
+
+  if (realtime == true) host_clock_set_virtual (false);
+
+  unsigned int start_errors = gsm.protocol_error_count;
+  modem.start_replay (speed);
+
+  printf ("%10s  %-26s %-24s %s\n", "time_s", "operation", "detail", "result");
+
+  while (modem.replay_finished() == false)
+  {
+    pump();
+
+    if (modem.replay_next_line().empty() == true)
+    {
+      //Only received data left, and nothing more will let it out
+      if (modem.replay_due_us() == NOT_DUE) break;
+      continue;
+    }
+
+    //Features are switched on as they're first used, so the operation's
+    //own command can be a line or two behind the AT+CMGF=1 etc.
+    bool dispatched = false;
+
+    for (size_t ahead = 0; (ahead < DISPATCH_LOOKAHEAD) && (dispatched == false); ahead++)
+    {
+      std::string line = modem.replay_next_line (ahead);
+      if (line.empty() == true) break;
+
+      unsigned long matched = modem.replay_matched_lines;
+      dispatched = dispatch (line);
+
+      //Ran, but nothing it sent was in the capture
+      if ((dispatched == true) && (modem.replay_matched_lines == matched)) dispatched = false;
+    }
+
+    if (dispatched == false) modem.replay_skip_line();
+  }
+
+  pump();
+
+  printf ("\nprotocol errors: %u, lines matched: %lu, skipped: %lu, unmatched: %lu\n",
+          gsm.protocol_error_count - start_errors, modem.replay_matched_lines,
+          modem.replay_skipped_lines, modem.replay_unmatched_lines);
+
+  return 0;
+}
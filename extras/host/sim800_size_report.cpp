@@ -0,0 +1,44 @@
+//===================================================================
+/*
+ * Copyright (c) 2022, James Amor
+ * All rights reserved.
+
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+//===================================================================
+
+//-------------------------------------------------------------------
+// One row of "make size-report"
+//-------------------------------------------------------------------
+// Built once per configuration (with that configuration's defines), and fed
+// the totals line of size -t for the library objects built the same way.
+// Prints the code size, the static data, and the RAM each SIM800_Control
+// object takes.
+//
+// The figures are for the host compiler, so only the differences between
+// configurations carry over to an AVR build
+//
+// Usage: size -t <objects> | tail -1 | sim800_size_report <config name>
+//-------------------------------------------------------------------
+
+#include "SIM800_Control.h"
+
+//================================================================================================
+int main (int argc, char **argv)
+{
+  unsigned long text = 0;
+  unsigned long data = 0;
+  unsigned long bss = 0;
+
+  //<text> <data> <bss> <dec> <hex> (TOTALS)
+  if ((argc < 2) || (scanf ("%lu %lu %lu", &text, &data, &bss) != 3))
+  {
+    fprintf (stderr, "Usage: size -t <objects> | tail -1 | %s <config name>\n", argv[0]);
+    return 1;
+  }
+
+  printf ("%-14s %8lu %8lu %8lu\n", argv[1], text, data + bss, (unsigned long)sizeof(SIM800_Control));
+
+  return 0;
+}